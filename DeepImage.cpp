@@ -47,6 +47,17 @@ DeepImageChannel::DeepImageChannel(int width_, int height_, const Array2D<unsign
 {
 }
 
+size_t DeepImageChannel::GetMemoryUsage() const
+{
+    size_t totalSamples = 0;
+    for(int y = 0; y < height; y++)
+        for(int x = 0; x < width; x++)
+            totalSamples += sampleCount[y][x];
+
+    // Count the sample data and the per-pixel sample pointers.
+    return totalSamples * GetBytesPerSample() + size_t(width) * height * sizeof(void *);
+}
+
 template<typename T>
 TypedDeepImageChannel<T>::TypedDeepImageChannel(int width_, int height_, const Array2D<unsigned int> &sampleCount_):
     DeepImageChannel(width_, height_, sampleCount_)
@@ -219,24 +230,47 @@ void TypedDeepImageChannel<T>::AddToFramebuffer(string name, const Header &heade
     frameBuffer.insert(name, slice);
 }
 
-template<typename T>
-void TypedDeepImageChannel<T>::UnpremultiplyChannel(shared_ptr<DeepImageChannelProxy> A)
-{
-    for(int y = 0; y < height; y++)
+namespace {
+    // Set reciprocals to 1/alpha for each sample in row y, so multiplying by it unpremultiplies.
+    // Samples with no alpha are left unchanged.
+    void GetAlphaReciprocals(const DeepImageChannelProxy &A, int y, vector<float> &reciprocals)
     {
-        for(int x = 0; x < width; x++)
+        reciprocals.clear();
+        for(int x = 0; x < A.width; x++)
         {
-            T *channelSamples = GetSamples(x, y);
-            for(int s = 0; s < sampleCount[y][x]; ++s)
+            for(int s = 0; s < (int) A.sampleCount[y][x]; ++s)
             {
-                float a = A->Get(x,y,s);
-                if(a > 0.00001f)
-                    channelSamples[s] = T(channelSamples[s] / a);
+                float a = A.Get(x,y,s);
+                reciprocals.push_back(a > 0.00001f? 1/a:1);
             }
         }
     }
 }
 
+template<typename T>
+void TypedDeepImageChannel<T>::UnpremultiplyChannel(shared_ptr<DeepImageChannelProxy> A)
+{
+    ParallelFor(height, [&](int startY, int endY) {
+        vector<float> reciprocals;
+        for(int y = startY; y < endY; y++)
+        {
+            GetAlphaReciprocals(*A, y, reciprocals);
+            ScaleRow(y, reciprocals.data());
+        }
+    });
+}
+
+template<typename T>
+void TypedDeepImageChannel<T>::ScaleRow(int y, const float *scale)
+{
+    for(int x = 0; x < width; x++)
+    {
+        T *channelSamples = GetSamples(x, y);
+        for(int s = 0; s < sampleCount[y][x]; ++s)
+            channelSamples[s] = T(channelSamples[s] * *scale++);
+    }
+}
+
 DeepImage::DeepImage(int width_, int height_)
 {
     width = width_;
@@ -289,8 +323,62 @@ shared_ptr<DeepImageChannelProxy> DeepImage::GetAlphaChannel() const
     return make_shared<DeepImageChannelProxyImpl<V4f>>(rgba, 3);
 }
 
+void DeepImage::UnpremultiplyChannels(int startY, int endY)
+{
+    vector<shared_ptr<DeepImageChannel>> channelsToUnpremultiply;
+    for(auto it: channels)
+    {
+        if(it.second->needsUnpremultiply)
+            channelsToUnpremultiply.push_back(it.second);
+    }
+
+    if(channelsToUnpremultiply.empty())
+        return;
+
+    auto A = GetAlphaChannel();
+    ParallelFor(endY - startY, [&](int start, int end) {
+        vector<float> reciprocals;
+        for(int y = startY + start; y < startY + end; y++)
+        {
+            GetAlphaReciprocals(*A, y, reciprocals);
+            for(auto channel: channelsToUnpremultiply)
+                channel->ScaleRow(y, reciprocals.data());
+        }
+    });
+}
+
+shared_ptr<DeepImage> DeepImage::Clone() const
+{
+    auto result = make_shared<DeepImage>(width, height);
+    result->header = header;
+    result->sorted = sorted;
+    result->missingChannels = missingChannels;
+    memcpy(&result->sampleCount[0][0], &sampleCount[0][0], sizeof(sampleCount[0][0]) * width * height);
+
+    lock_guard<mutex> lock(channelsLock);
+    for(auto it: channels)
+    {
+        // Create each channel with the new sample counts, and copy samples one pixel at a time,
+        // since samples added with AddSample aren't in one block.
+        shared_ptr<const DeepImageChannel> channel = it.second;
+        shared_ptr<DeepImageChannel> newChannel(channel->CreateSameType(result->sampleCount));
+        newChannel->needsUnpremultiply = channel->needsUnpremultiply;
+
+        const char * const*srcData = channel->GetSamplesBlind();
+        char **dstData = newChannel->GetSamplesBlind();
+        int bytesPerSample = channel->GetBytesPerSample();
+        for(int i = 0; i < width * height; ++i)
+            memcpy(dstData[i], srcData[i], bytesPerSample * (&sampleCount[0][0])[i]);
+
+        result->channels[it.first] = newChannel;
+    }
+
+    return result;
+}
+
 int DeepImage::AddSample(int x, int y)
 {
+    sorted = false;
     sampleCount[y][x]++;
     for(auto it: channels)
     {
@@ -311,6 +399,7 @@ void DeepImage::AddSampleCountSliceToFramebuffer(DeepFrameBuffer &frameBuffer)
 
 shared_ptr<DeepImageChannel> DeepImage::GetBaseChannel(string name)
 {
+    lock_guard<mutex> lock(channelsLock);
     auto it = channels.find(name);
     if(it == channels.end())
         return nullptr;
@@ -318,6 +407,18 @@ shared_ptr<DeepImageChannel> DeepImage::GetBaseChannel(string name)
     return it->second;
 }
 
+size_t DeepImage::RemoveChannel(string name)
+{
+    lock_guard<mutex> lock(channelsLock);
+    auto it = channels.find(name);
+    if(it == channels.end())
+        return 0;
+
+    size_t bytes = it->second->GetMemoryUsage();
+    channels.erase(it);
+    return bytes;
+}
+
 shared_ptr<DeepImage> DeepImageReader::Open(string filename)
 {
     // First, read just the header to check that this is a deep EXR.
@@ -358,7 +459,29 @@ shared_ptr<DeepImage> DeepImageReader::Open(string filename)
     return image;
 }
 
-void DeepImageReader::Read(const DeepFrameBuffer &frameBuffer)
+namespace {
+    // Return the number of scanlines in each chunk of a file with the given compression.
+    int GetLinesPerChunk(Compression compression)
+    {
+        switch(compression)
+        {
+        case ZIP_COMPRESSION:
+        case PXR24_COMPRESSION:
+            return 16;
+        case PIZ_COMPRESSION:
+        case B44_COMPRESSION:
+        case B44A_COMPRESSION:
+        case DWAA_COMPRESSION:
+            return 32;
+        case DWAB_COMPRESSION:
+            return 256;
+        default:
+            return 1;
+        }
+    }
+}
+
+void DeepImageReader::Read(const DeepFrameBuffer &frameBuffer, function<void(int startY, int endY)> rowsRead)
 {
     // Read the main image data.
     shared_ptr<DeepScanLineInputFile> deepFile = dynamic_pointer_cast<DeepScanLineInputFile>(file);
@@ -367,7 +490,23 @@ void DeepImageReader::Read(const DeepFrameBuffer &frameBuffer)
         Box2i dataWindow = deepFile->header().dataWindow();
         deepFile->setFrameBuffer(frameBuffer);
         deepFile->readPixelSampleCounts(dataWindow.min.y, dataWindow.max.y);
-        deepFile->readPixels(dataWindow.min.y, dataWindow.max.y);
+
+        // If nobody is waiting for rows, read everything at once, so OpenEXR can decode as
+        // many chunks at a time as it has threads.  Otherwise, read in blocks with a chunk
+        // for each thread, so rows can be processed while later ones are read.  Blocks are
+        // at least 64 lines, so compressions with small chunks don't make a call for every
+        // few lines.  Both are multiples of the lines per chunk, so chunks aren't split.
+        int blockSize = dataWindow.max.y - dataWindow.min.y + 1;
+        if(rowsRead)
+            blockSize = max(64, GetLinesPerChunk(deepFile->header().compression()) * GetThreadCount());
+
+        for(int y = dataWindow.min.y; y <= dataWindow.max.y; y += blockSize)
+        {
+            int lastY = min(y + blockSize - 1, dataWindow.max.y);
+            deepFile->readPixels(y, lastY);
+            if(rowsRead)
+                rowsRead(y - dataWindow.min.y, lastY - dataWindow.min.y + 1);
+        }
     }
     else
     {
@@ -424,6 +563,9 @@ void DeepImageReader::Read(const DeepFrameBuffer &frameBuffer)
                 }
             }
         }
+
+        if(rowsRead)
+            rowsRead(0, height);
     }
 
     file.reset();
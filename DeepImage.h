@@ -5,15 +5,24 @@
 #include <vector>
 #include <memory>
 #include <set>
+#include <functional>
+#include <mutex>
 
 #include <OpenEXR/ImfDeepFrameBuffer.h>
 #include <OpenEXR/ImfArray.h>
 #include <OpenEXR/ImathVec.h>
 #include <OpenEXR/ImfHeader.h>
 
+#include "helpers.h"
+
 using namespace std;
 class DeepImageChannelProxy;
 
+// DeepImageUtil.h includes this header, so declare what AddChannelToFramebuffer uses from it.
+namespace DeepImageUtil {
+    vector<string> GetChannelsInLayer(const Imf::Header &header, string layerName);
+}
+
 template<class T> Imf::PixelType GetEXRPixelType();
 template<class T> int GetEXRElementSize();
 template<class T> int GetEXRElementCount();
@@ -57,6 +66,13 @@ public:
     bool needsUnpremultiply = false;
     virtual void UnpremultiplyChannel(shared_ptr<DeepImageChannelProxy> alpha) = 0;
 
+    // Multiply each sample in row y by the corresponding value in scale, which has one value
+    // for each sample in the row, in pixel order.  This is used to unpremultiply channels.
+    virtual void ScaleRow(int y, const float *scale) = 0;
+
+    // Return the approximate number of bytes used by this channel's samples.
+    size_t GetMemoryUsage() const;
+
     int width, height;
 
     // This is a reference to DeepImage::sampleCount, which is shared by all channels.
@@ -151,6 +167,8 @@ public:
     // Unpremultiply this channel.  The alpha parameter is deepImage->GetAlphaChannel().
     void UnpremultiplyChannel(shared_ptr<DeepImageChannelProxy> alpha);
 
+    void ScaleRow(int y, const float *scale);
+
     Imf::Array2D<T *> data;
     vector<shared_ptr<Imf::Array2D<T *>>> readPointers;
 
@@ -234,7 +252,18 @@ public:
     // Get an untyped pointer.  This is useful when T isn't available to call GetChannel.
     shared_ptr<DeepImageChannel> GetBaseChannel(string name);
 
+    // Remove a channel, returning the approximate number of bytes freed, or 0 if the channel
+    // doesn't exist.  The memory is freed once nobody else holds a reference to the channel.
+    size_t RemoveChannel(string name);
+
     shared_ptr<DeepImageChannelProxy> GetAlphaChannel() const;
+
+    // Return a copy of this image and all of its channels.
+    shared_ptr<DeepImage> Clone() const;
+
+    // Unpremultiply all channels with needsUnpremultiply set in rows [startY,endY).  Alpha
+    // is only read once per sample, no matter how many channels are unpremultiplied.
+    void UnpremultiplyChannels(int startY, int endY);
     
     // Add a sample to each channel for the given pixel.  Return the sample
     // index of the new sample.
@@ -249,6 +278,13 @@ public:
     map<string, shared_ptr<DeepImageChannel>> channels;
     Imf::Array2D<unsigned int> sampleCount;
 
+    // This is set by DeepImageUtil::SortSamplesByDepth, and cleared if samples are added.
+    bool sorted = false;
+
+    // Independent operations can run at the same time, so AddChannel and GetChannel lock
+    // channels.  Code that iterates over channels directly only runs in exclusive operations.
+    mutable mutex channelsLock;
+
     // Channels that were requested with AddChannelToFramebuffer, but that
     // aren't in the file.
     set<string> missingChannels;
@@ -262,7 +298,7 @@ shared_ptr<TypedDeepImageChannel<T>> DeepImage::AddChannelToFramebuffer(string c
         // Just return the channel we already created with this name.
         auto result = dynamic_pointer_cast<TypedDeepImageChannel<T>>(channels.at(channelName));
         if(result == nullptr)
-            throw exception("A channel was added twice with different data types");
+            throw StringException("A channel was added twice with different data types");
         return result;
     }
 
@@ -289,6 +325,8 @@ shared_ptr<TypedDeepImageChannel<T>> DeepImage::AddChannel(string name, shared_p
 {
     if(channel == nullptr)
         channel = make_shared<TypedDeepImageChannel<T>>(width, height, sampleCount);
+
+    lock_guard<mutex> lock(channelsLock);
     channels[name] = channel;
     return channel;
 }
@@ -312,7 +350,11 @@ public:
 
     // Read the read of the file opened by a call to Open.  This should be called after setting
     // up channels to read by calling image->AddChannelToFramebuffer.
-    void Read(const Imf::DeepFrameBuffer &frameBuffer);
+    //
+    // If rowsRead is set, the image is read in blocks of scanlines, and it's called with the
+    // range of rows after each block is read, so it can process the data while it's still
+    // in cache.  Otherwise, the image is read in one call.
+    void Read(const Imf::DeepFrameBuffer &frameBuffer, function<void(int startY, int endY)> rowsRead = nullptr);
 
 private:
     shared_ptr<Imf::GenericInputFile> file;
@@ -1,5 +1,6 @@
 #include "DeepImageUtil.h"
 #include "SimpleImage.h"
+#include "NormalTransform.h"
 #include "helpers.h"
 
 #include <algorithm>
@@ -69,12 +70,29 @@ shared_ptr<SimpleImage> DeepImageUtil::CollapseEXR(
         CollapseMode mode)
 {
     shared_ptr<SimpleImage> result = make_shared<SimpleImage>(image->width, image->height);
+    ParallelFor(image->height, [&](int startY, int endY) {
+        vector<V4f> rows((endY - startY) * image->width);
+        CollapseEXRRows(image, id, rgba, mask, objectIds, mode, startY, endY, rows.data());
+        result->SetRows(startY, endY, rows.data());
+    });
+    return result;
+}
 
-    for(int y = 0; y < image->height; y++)
+void DeepImageUtil::CollapseEXRRows(
+        shared_ptr<const DeepImage> image,
+        shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+        shared_ptr<const TypedDeepImageChannel<V4f>> rgba,
+        shared_ptr<const TypedDeepImageChannel<float>> mask,
+        const set<int> &objectIds,
+        CollapseMode mode,
+        int startY, int endY,
+        V4f *output)
+{
+    for(int y = startY; y < endY; y++)
     {
         for(int x = 0; x < image->width; x++)
         {
-            V4f &out = result->GetRGBA(x, y);
+            V4f &out = output[(y-startY)*image->width + x];
             out = V4f(0,0,0,0);
 
             int samples = image->NumSamples(x,y);
@@ -115,8 +133,6 @@ shared_ptr<SimpleImage> DeepImageUtil::CollapseEXR(
             }
         }
     }
-
-    return result;
 }
 
 // Change all samples with an object ID of fromObjectId to intoObjectId.
@@ -165,7 +181,7 @@ M44f DeepImageUtil::GetWorldToCameraMatrix(shared_ptr<const DeepImage> image, st
         string s = "worldToCamera matrix attribute is missing";
         if(!reason.empty())
             s += " (required by: " + reason + ")";
-        throw exception(s.c_str());
+        throw StringException(s);
     }
 
     return worldToCameraAttr->value();
@@ -206,6 +222,8 @@ void DeepImageUtil::SortSamplesByDepth(shared_ptr<DeepImage> image)
             }
         }
     }
+
+    image->sorted = true;
 }
 
 /*
@@ -361,7 +379,24 @@ void DeepImageUtil::ExtractMask(
     int objectId,
     shared_ptr<SimpleImage> layer)
 {
-    for(int y = 0; y < A->height; y++)
+    ParallelFor(A->height, [&](int startY, int endY) {
+        vector<V4f> rows((endY - startY) * A->width);
+        ExtractMaskRows(alphaMask, compositeAlpha, mask, A, id, objectId, startY, endY, rows.data());
+        layer->SetRows(startY, endY, rows.data());
+    });
+}
+
+void DeepImageUtil::ExtractMaskRows(
+    bool alphaMask,
+    bool compositeAlpha,
+    shared_ptr<const TypedDeepImageChannel<float>> mask,
+    shared_ptr<const DeepImageChannelProxy> A,
+    shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+    int objectId,
+    int startY, int endY,
+    V4f *output)
+{
+    for(int y = startY; y < endY; y++)
     {
         for(int x = 0; x < A->width; x++)
         {
@@ -414,38 +449,88 @@ void DeepImageUtil::ExtractMask(
                 color = V4f(resultValue,resultValue,resultValue,resultValue);
             else
                 color = V4f(resultValue,resultValue,resultValue,1);
-            layer->GetRGBA(x,y) = color;
+            output[(y-startY)*A->width + x] = color;
         }
     }
 }
 
-vector<float> DeepImageUtil::GetSampleVisibility(shared_ptr<const DeepImage> image, int x, int y)
-{
-    vector<float> result;
-
-    auto A = image->GetAlphaChannel();
-
-    for(int s = 0; s < image->sampleCount[y][x]; ++s)
+namespace {
+    // Store the visibility of each sample at x,y in result, like GetSampleVisibility.  Each
+    // sample is covered by every sample after it, so work backwards from the nearest sample,
+    // accumulating the amount of light that gets through.
+    //
+    // This is O(n) instead of O(n^2), but multiplies each sample's (1-alpha) terms in the
+    // opposite order from applying each new sample to the samples under it, so visibilities
+    // can differ from that in the last bits.
+    void GetSampleVisibilityWithAlpha(const DeepImageChannelProxy &A, int x, int y, vector<float> &result)
     {
-        float alpha = A->Get(x, y, s);
-
-        // Apply the alpha term to each sample underneath this one.
-        for(float &sampleAlpha: result)
-            sampleAlpha *= 1-alpha;
+        int count = A.sampleCount[y][x];
+        result.resize(count);
 
-        result.push_back(1.0f);
+        float visibility = 1.0f;
+        for(int s = count-1; s >= 0; --s)
+        {
+            result[s] = visibility;
+            visibility *= 1-A.Get(x, y, s);
+        }
     }
+}
+
+vector<float> DeepImageUtil::GetSampleVisibility(shared_ptr<const DeepImage> image, int x, int y)
+{
+    vector<float> result;
+    GetSampleVisibilityWithAlpha(*image->GetAlphaChannel(), x, y, result);
     return result;
 }
 
 void DeepImageUtil::GetSampleVisibilities(shared_ptr<const DeepImage> image, Array2D<vector<float>> &SampleVisibilities)
 {
+    // Get alpha once.  GetAlphaChannel locks the channel list, so calling it for each pixel
+    // would serialize the threads.
+    auto A = image->GetAlphaChannel();
+
     SampleVisibilities.resizeErase(image->height, image->width);
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
-            SampleVisibilities[y][x] = DeepImageUtil::GetSampleVisibility(image, x, y);
-    }
+    ParallelFor(image->height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; y++)
+        {
+            for(int x = 0; x < image->width; x++)
+                GetSampleVisibilityWithAlpha(*A, x, y, SampleVisibilities[y][x]);
+        }
+    });
+}
+
+void DeepImageUtil::GetNearestSamples(shared_ptr<const DeepImage> image,
+    shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+    const set<int> &objectIds,
+    Array2D<int> &nearestSamples)
+{
+    auto Z = image->GetChannel<float>("Z");
+
+    nearestSamples.resizeErase(image->height, image->width);
+    ParallelFor(image->height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; y++)
+        {
+            for(int x = 0; x < image->width; x++)
+            {
+                int &nearest = nearestSamples[y][x];
+                nearest = -1;
+
+                for(int s = 0; s < image->NumSamples(x,y); ++s)
+                {
+                    if(objectIds.find(id->Get(x,y,s)) == objectIds.end())
+                        continue;
+
+                    if(nearest != -1)
+                    {
+                        if(Z->Get(x,y,s) > Z->Get(x,y,nearest))
+                            continue;
+                    }
+
+                    nearest = s;
+                }
+            }
+        }
+    });
 }
 
 namespace {
@@ -537,22 +622,28 @@ void DeepImageUtil::TransformNormalMap(shared_ptr<const DeepImage> image,
     shared_ptr<TypedDeepImageChannel<V3f>> outputChannel,
     M44f matrix)
 {
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
+    // Copy each row into a contiguous buffer, so TransformNormals can work on the whole
+    // row at once instead of a few samples per pixel.
+    ParallelFor(image->height, [&](int startY, int endY) {
+        vector<V3f> row;
+        for(int y = startY; y < endY; y++)
         {
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
+            row.clear();
+            for(int x = 0; x < image->width; x++)
             {
-                V3f vec = inputChannel->Get(x,y,s);
+                const V3f *samples = inputChannel->GetSamples(x, y);
+                row.insert(row.end(), samples, samples + image->NumSamples(x, y));
+            }
 
-                // We're working with normal maps, and Arnold doesn't always output normalized
-                // normals due to a bug, so normalize now.
-                vec.normalize();
+            TransformNormals(matrix, row.data(), row.data(), (int) row.size());
 
-                V3f result;
-                matrix.multDirMatrix(vec, result);
-                outputChannel->Get(x,y,s) = result;
+            const V3f *next = row.data();
+            for(int x = 0; x < image->width; x++)
+            {
+                int count = image->NumSamples(x, y);
+                copy(next, next + count, outputChannel->GetSamples(x, y));
+                next += count;
             }
         }
-    }
+    });
 }
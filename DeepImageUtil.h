@@ -51,6 +51,18 @@ namespace DeepImageUtil {
 	    shared_ptr<const TypedDeepImageChannel<float>> mask = nullptr,
 	    set<int> objectIds = {},
             CollapseMode mode = CollapseMode_Normal);
+
+    // Flatten rows [startY,endY) like CollapseEXR, storing them in output.  This lets images
+    // be flattened a block of rows at a time as they're written.
+    void CollapseEXRRows(
+	    shared_ptr<const DeepImage> image,
+	    shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+	    shared_ptr<const TypedDeepImageChannel<Imath::V4f>> color,
+	    shared_ptr<const TypedDeepImageChannel<float>> mask,
+	    const set<int> &objectIds,
+            CollapseMode mode,
+            int startY, int endY,
+            Imath::V4f *output);
 
     // Change all samples with an object ID of fromObjectId to intoObjectId.
     void CombineObjectId(shared_ptr<TypedDeepImageChannel<uint32_t>> id, int fromObjectId, int intoObjectId);
@@ -106,6 +118,17 @@ namespace DeepImageUtil {
 	int objectId,
 	shared_ptr<SimpleImage> layer);
 
+    // Extract rows [startY,endY) of a mask like ExtractMask, storing them in output.
+    void ExtractMaskRows(
+	bool alphaMask,
+	bool compositeAlpha,
+	shared_ptr<const TypedDeepImageChannel<float>> mask,
+	shared_ptr<const DeepImageChannelProxy> alpha,
+	shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+	int objectId,
+        int startY, int endY,
+        Imath::V4f *output);
+
     // Return the visibility of each sample at the given pixel.
     //
     // Each value in the result is the visibility of that sample.  For example, if RGBA
@@ -134,6 +157,13 @@ namespace DeepImageUtil {
     // above, [0.75, 1.0].
     vector<float> GetSampleVisibility(shared_ptr<const DeepImage> image, int x, int y);
     void GetSampleVisibilities(shared_ptr<const DeepImage> image, Imf::Array2D<vector<float>> &SampleVisibilities);
+
+    // Find the sample nearest to the camera for each pixel, considering only samples with
+    // an ID in objectIds.  Pixels with no matching samples are set to -1.
+    void GetNearestSamples(shared_ptr<const DeepImage> image,
+        shared_ptr<const TypedDeepImageChannel<uint32_t>> id,
+        const set<int> &objectIds,
+        Imf::Array2D<int> &nearestSamples);
 
     // Copy all samples from all channels of images into a single image.
     shared_ptr<DeepImage> CombineImages(vector<shared_ptr<DeepImage>> images);
@@ -158,7 +188,7 @@ void DeepImageUtil::UnpremultiplyChannel(shared_ptr<const TypedDeepImageChannel<
     {
 	for(int x = 0; x < channel->width; x++)
 	{
-	    const V4f *rgbaSamples = rgba->GetSamples(x, y);
+	    const Imath::V4f *rgbaSamples = rgba->GetSamples(x, y);
 	    T *channelSamples = channel->GetSamples(x, y);
 	    for(int s = 0; s < channel->sampleCount[y][x]; ++s)
 	    {
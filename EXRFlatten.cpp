@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <math.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <vector>
+
+// Too fine-grained:
+#include <OpenEXR/ImathBox.h>
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfStringAttribute.h>
+#include <OpenEXR/ImfThreading.h>
+#include <OpenEXR/Iex.h>
+
+#include "DeepImage.h"
+#include "DeepImageUtil.h"
+#include "helpers.h"
+
+#include "EXRFlatten.h"
+#include "EXROperation.h"
+#include "EXROperation_CreateMask.h"
+#include "EXROperation_WriteLayers.h"
+#include "EXROperation_FixArnold.h"
+#include "EXROperation_Stroke.h"
+
+using namespace std;
+using namespace Imf;
+using namespace Imath;
+using namespace Iex;
+
+// This currently processes all object IDs at once, which means we need enough memory to hold all
+// output buffers at once.  We could make a separate pass for each object ID to reduce memory usage,
+// so we only need to hold one at a time.
+//
+// Not currently supported/tested:
+// - data window is untested
+// - tiled images
+// - volumes (samples with non-zero depth)
+// - arbitrary channel mappings, including layers (we assume "R", "G", "B", "A", "Z", "ZBack", "id")
+// - separate per-color alpha (RA, GA, BA)
+// - (and lots of other stuff, EXR is "too general")
+
+
+// Collapse the image to a flat file, and save a non-deep EXR.
+class EXROperation_SaveFlattenedImage: public EXROperation
+{
+public:
+    EXROperation_SaveFlattenedImage(const SharedConfig &sharedConfig_, string opt, vector<pair<string,string>> args):
+        sharedConfig(sharedConfig_)
+    {
+        filename = opt;
+
+        // With --frames, every frame would write the same file, and with --frame-workers
+        // they'd write it at the same time.  Global options come first, so frames is already set.
+        if(!sharedConfig.frames.empty() && filename.find("<frame>") == string::npos && filename.find("<inputname>") == string::npos)
+            throw StringException("--save-flattened=" + filename + " would be written by every frame.  Include <frame> or <inputname> in the filename.");
+
+        for(auto it: args)
+        {
+            string arg = it.first;
+            string value = it.second;
+
+            if(arg == "object-id")
+                objectIds.insert(atoi(value.c_str()));
+            else if(arg == "channel")
+                channel = value;
+        }
+    }
+
+    void AddChannels(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
+    {
+        image->AddChannelToFramebuffer<uint32_t>(sharedConfig.GetIdChannel(image->header), frameBuffer);
+        image->AddChannelToFramebuffer<V4f>(channel, frameBuffer);
+    }
+
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+    {
+        dependencies.exclusive = false;
+        dependencies.reads.insert(sharedConfig.GetIdChannel(image->header));
+        dependencies.reads.insert(channel);
+    }
+
+    void Run(shared_ptr<EXROperationState> state) const
+    {
+        string f = sharedConfig.GetFilename(state->SubstituteInputFilename(filename));
+        printf("Writing %s\n", f.c_str());
+
+        shared_ptr<const DeepImage> image = state->image;
+        auto id = image->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
+        auto rgba = image->GetChannel<V4f>(channel);
+
+        // Add the main RGBA layer.  This is flattened a block of rows at a time as it's
+        // written, so the flattened image is never entirely in memory.
+        vector<SimpleImage::EXRLayersToWrite> layers;
+        layers.push_back(SimpleImage::EXRLayersToWrite(image->width, image->height, Header(image->width, image->height),
+            [&](int startY, int endY, V4f *pixels) {
+                DeepImageUtil::CollapseEXRRows(image, id, rgba, nullptr, objectIds,
+                    DeepImageUtil::CollapseMode_Normal, startY, endY, pixels);
+            }));
+        sharedConfig.outputSink->WriteImages(f, layers, sharedConfig.writeOptions);
+    }
+
+private:
+    string filename;
+    const SharedConfig &sharedConfig;
+    set<int> objectIds;
+    string channel = "rgba";
+};
+
+class EXROperation_Stats: public EXROperation
+{
+public:
+    EXROperation_Stats(const SharedConfig &sharedConfig_, string opt, vector<pair<string,string>> args):
+        sharedConfig(sharedConfig_)
+    {
+        filename = opt;
+
+        for(auto it: args)
+        {
+            string arg = it.first;
+            string value = it.second;
+
+            if(arg == "object-id")
+                objectIds.insert(atoi(value.c_str()));
+        }
+    }
+
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+    {
+        // This only reads sample counts, which only exclusive operations change.
+        dependencies.exclusive = false;
+    }
+
+    void GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const
+    {
+        // We don't read any channels, so only sample counts need to be loaded.
+        requirements.rgba = false;
+        requirements.sorted = false;
+    }
+
+    void Run(shared_ptr<EXROperationState> state) const
+    {
+        int totalSamples = 0;
+        int totalEmptyPixels = 0;
+        int totalVisiblePixels = 0;
+        for(int y = 0; y < state->image->height; y++)
+        {
+            for(int x = 0; x < state->image->width; x++)
+            {
+                int samples = state->image->NumSamples(x, y);
+                totalSamples += samples;
+                if(samples == 0)
+                    totalEmptyPixels++;
+                else
+                    totalVisiblePixels++;
+            }
+        }
+
+        printf("Average samples per pixel: %f\n", double(totalSamples) / totalVisiblePixels );
+        printf("Visible pixels: %0f%%\n", 100*(double(totalVisiblePixels) / (totalVisiblePixels+totalEmptyPixels)) );
+    }
+
+private:
+    string filename;
+    const SharedConfig &sharedConfig;
+    set<int> objectIds;
+};
+
+template<typename T>
+shared_ptr<T> CreateOp(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments)
+{
+    return make_shared<T>(sharedConfig, opt, arguments);
+}
+
+static map<string, EXRFlatten::CreateFunc> Operations = {
+    { "save-layers", CreateOp<EXROperation_WriteLayers> },
+    { "create-mask", CreateOp<EXROperation_CreateMask> },
+    { "create-camera-space-normals", CreateOp<EXROperation_CreateCameraSpaceNormalMap> },
+    { "stroke", CreateOp<EXROperation_Stroke> },
+    { "save-flattened", CreateOp<EXROperation_SaveFlattenedImage> },
+    { "stats", CreateOp<EXROperation_Stats> },
+};
+
+vector<pair<string,string>> EXRFlatten::ParseArgs(const vector<string> &args)
+{
+    vector<pair<string,string>> results;
+    for(string option: args)
+    {
+        if(option.substr(0, 2) != "--")
+        {
+            printf("Warning: unrecognized argument %s\n", option.c_str());
+            continue;
+        }
+        option = option.substr(2);
+
+        string argument;
+        int pos = option.find('=');
+        if(pos != string::npos)
+        {
+            argument = option.substr(pos+1);
+            option = option.substr(0, pos);
+        }
+
+        results.push_back(make_pair(option, argument));
+    }
+
+    return results;
+}
+
+void EXRFlatten::ParseOptions(const vector<pair<string,string>> &options)
+{
+    string currentOp;
+    vector<pair<string,string>> accumulatedOptions;
+
+    auto finalizeOp = [&] {
+        if(currentOp.empty())
+            return;
+
+        string firstOption = accumulatedOptions[0].second;
+        vector<pair<string,string>> options(accumulatedOptions.begin()+1, accumulatedOptions.end());
+        auto op = Operations.at(currentOp)(sharedConfig, firstOption, options);
+        accumulatedOptions.clear();
+        currentOp.clear();
+
+        // Merge consecutive --create-mask operations, so all of the masks are created in
+        // a single pass over the image.
+        auto createMask = dynamic_pointer_cast<EXROperation_CreateMask>(op);
+        auto prevCreateMask = operations.empty()? nullptr:dynamic_pointer_cast<EXROperation_CreateMask>(operations.back());
+        if(createMask && prevCreateMask && prevCreateMask->Merge(*createMask))
+            return;
+
+        operations.push_back(op);
+    };
+
+    for(auto it: options)
+    {
+        string opt = it.first;
+        string value = it.second;
+
+        // See if this is a global option.
+        if(sharedConfig.ParseOption(opt, value))
+        {
+            // There are too many confusing situations if global operations can come in between
+            // operations, so require that they come first.
+            //
+            // For example, if we allow specifying --output we can allow a different output directory
+            // for each operation, but if you say
+            // --output=output --save-layers --output=output2 --save-layers
+            //
+            // it's unclear whether the second --output is meant to affect the first --save-layers or
+            // not, since normally options for an operation come after the operation, but global options
+            // typically come before it.  This isn't useful enough for the complication.
+            if(!currentOp.empty() || !operations.empty())
+                throw StringException("Global options must precede operations: --" + opt);
+            continue;
+        }
+
+        // See if this is an option to create a new operation, eg. --stroke.
+        if(Operations.find(opt) != Operations.end())
+        {
+            // This is a new operation.  Finish the previous one, creating it and passing it
+            // any options we saw since the operation command.
+            finalizeOp();
+
+            // Save the function to create the operation.  We'll create it after we've collected
+            // its arguments.
+            currentOp = opt;
+
+            // Save the operation argument itself.  The option will be the argument when creating
+            // the operation, eg. the 1 in --stroke=1.
+            accumulatedOptions.emplace_back(opt, value);
+            continue;
+        }
+
+        // We don't know what this option is.  Add it to accumulatedOptions, so we send it
+        // with the current operation's arguments.  
+        if(currentOp.empty())
+            printf("Unrecognized argument: %s\n", opt.c_str());
+        else
+            accumulatedOptions.emplace_back(opt, value);
+    }
+
+    // Finish creating the last op.
+    finalizeOp();
+
+    if(sharedConfig.inputFilenames.empty())
+        throw StringException("No input files were specified.");
+    if(operations.empty())
+        throw StringException("No operations were specified.");
+
+    // This is always run first.
+    operations.insert(operations.begin(), make_shared<EXROperation_FixArnold>());
+
+    if(!sharedConfig.frames.empty())
+    {
+        bool hasFramePattern = false;
+        for(string filename: sharedConfig.inputFilenames)
+            if(filename.find('#') != string::npos)
+                hasFramePattern = true;
+        if(!hasFramePattern)
+            throw StringException("--frames requires an input filename with a frame number pattern, like render.####.exr");
+    }
+}
+
+void EXRFlatten::Run() const
+{
+    if(sharedConfig.inputFilenames.empty())
+        throw StringException("No input files");
+
+    SetupThreads();
+
+    // Write stats are totals for the whole process, so remember where they started to
+    // report only this run.
+    SimpleImage::WriteStats startStats = SimpleImage::GetWriteStats();
+
+    if(sharedConfig.frames.empty())
+        RunFrame(sharedConfig.inputFilenames);
+    else
+    {
+        // Process each frame with the same operations.  With --frame-workers, several frames
+        // are processed at once, each on its own thread.  ParallelFor runs serially inside
+        // a worker, so each frame's own work isn't split across threads.
+        ParallelFor((int) sharedConfig.frames.size(), [&](int begin, int end) {
+            for(int i = begin; i < end; ++i)
+                RunFrame(sharedConfig.GetFrameInputFilenames(sharedConfig.frames[i]));
+        }, 1, sharedConfig.frameWorkers);
+    }
+
+    if(sharedConfig.writeOptions.incremental)
+    {
+        SimpleImage::WriteStats stats = SimpleImage::GetWriteStats();
+        stats.filesWritten -= startStats.filesWritten;
+        stats.filesSkipped -= startStats.filesSkipped;
+        stats.bytesWritten -= startStats.bytesWritten;
+        stats.bytesSkipped -= startStats.bytesSkipped;
+        printf("Wrote %i %s (%.1f MB), skipped %i unchanged %s (%.1f MB)\n",
+            stats.filesWritten, stats.filesWritten == 1? "file":"files", stats.bytesWritten / (1024.0*1024.0),
+            stats.filesSkipped, stats.filesSkipped == 1? "file":"files", stats.bytesSkipped / (1024.0*1024.0));
+    }
+}
+
+void EXRFlatten::SetOutputSink(shared_ptr<OutputSink> sink)
+{
+    sharedConfig.outputSink = sink;
+}
+
+void EXRFlatten::SetupThreads()
+{
+    // Let OpenEXR read and write each file with multiple threads too.  With one thread,
+    // leave it single-threaded instead of handing lines to a single worker.
+    int threads = GetThreadCount();
+    setGlobalThreadCount(threads > 1? threads:0);
+}
+
+void EXRFlatten::RunFrame(const vector<string> &inputFilenames) const
+{
+    SetupThreads();
+    Process(Load(inputFilenames), inputFilenames);
+}
+
+namespace {
+    // Arnold images need to be unpremultiplied as they're read.
+    bool IsArnold(const Header &header)
+    {
+        return header.findTypedAttribute<StringAttribute>("arnold/version") != NULL;
+    }
+}
+
+void EXRFlatten::AddInputChannels(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer, bool &needsRGBA, bool &needsSort) const
+{
+    for(auto op: operations)
+        op->AddChannels(image, frameBuffer);
+
+    // rgba and Z are only loaded if something needs them.  Unpremultiplying needs alpha, and
+    // sorting needs Z.
+    bool unpremultiply = IsArnold(image->header);
+    for(auto it: image->channels)
+        needsRGBA |= unpremultiply && it.second->needsUnpremultiply;
+
+    for(auto op: operations)
+    {
+        EXROperation::Requirements requirements;
+        op->GetRequirements(image, requirements);
+        needsRGBA |= requirements.rgba;
+        needsSort |= requirements.sorted;
+    }
+}
+
+bool EXRFlatten::CanProcess(shared_ptr<const DeepImage> image) const
+{
+    // Set up the channels we'd load for an image with the same header.  Nothing is read, so
+    // the image only needs to be 1x1.
+    auto needed = make_shared<DeepImage>(1, 1);
+    needed->header = image->header;
+    DeepFrameBuffer frameBuffer;
+    bool needsRGBA = false, needsSort = false;
+    AddInputChannels(needed, frameBuffer, needsRGBA, needsSort);
+    if(needsRGBA)
+        needed->AddChannelToFramebuffer<V4f>("rgba", frameBuffer);
+    if(needsSort)
+        needed->AddChannelToFramebuffer<float>("Z", frameBuffer);
+
+    if(!needed->missingChannels.empty() || (needsSort && !image->sorted))
+        return false;
+
+    for(auto it: needed->channels)
+    {
+        // Skip channels that operations create, like mask outputs, which aren't in the file.
+        if(DeepImageUtil::GetChannelsInLayer(image->header, it.first).empty())
+            continue;
+
+        // The channel has to have been loaded with the same type, and unpremultiplied the same way.
+        shared_ptr<const DeepImageChannel> channel = map_get(image->channels, it.first, nullptr);
+        if(channel == nullptr || typeid(*channel.get()) != typeid(*it.second.get()) ||
+            channel->needsUnpremultiply != it.second->needsUnpremultiply)
+            return false;
+    }
+
+    return true;
+}
+
+shared_ptr<DeepImage> EXRFlatten::Load(const vector<string> &inputFilenames) const
+{
+    // Open each input, and set up the channels operations are interested in.
+    struct Input
+    {
+        DeepImageReader reader;
+        shared_ptr<DeepImage> image;
+        DeepFrameBuffer frameBuffer;
+        bool unpremultiply = false;
+    };
+    vector<Input> inputs(inputFilenames.size());
+
+    // Inputs are combined, so they all load the same core channels.
+    bool needsRGBA = false, needsSort = false;
+    for(size_t i = 0; i < inputs.size(); ++i)
+    {
+        Input &input = inputs[i];
+        input.image = input.reader.Open(inputFilenames[i]);
+        input.image->AddSampleCountSliceToFramebuffer(input.frameBuffer);
+        input.unpremultiply = IsArnold(input.image->header);
+        AddInputChannels(input.image, input.frameBuffer, needsRGBA, needsSort);
+    }
+
+    vector<shared_ptr<DeepImage>> images;
+    for(size_t i = 0; i < inputs.size(); ++i)
+    {
+        Input &input = inputs[i];
+        shared_ptr<DeepImage> image = input.image;
+        if(needsRGBA)
+            image->AddChannelToFramebuffer<V4f>("rgba", input.frameBuffer);
+        if(needsSort)
+            image->AddChannelToFramebuffer<float>("Z", input.frameBuffer);
+
+        // We don't actually need this right now, and it's not available for shallow renders.
+        // It'd be needed for handling volumes in deep images.
+        // image->AddChannelToFramebuffer<float>("ZBack", input.frameBuffer);
+
+        // If any channel/layer was required above that isn't in the image, print
+        // an error and stop.
+        string missing = "";
+        for(auto channel: image->missingChannels)
+        {
+            if(!missing.empty())
+                missing += ", ";
+            missing += channel;
+        }
+        if(!missing.empty())
+            throw StringException(ssprintf("%s: Missing input channels: %s", inputFilenames[i].c_str(), missing.c_str()));
+
+        // Handle unpremultiplication.  This is done for each block of scanlines as it's read.
+        // Otherwise, there's nothing to do with each block, so read the image in one go.
+        function<void(int startY, int endY)> rowsRead;
+        if(input.unpremultiply)
+        {
+            rowsRead = [&](int startY, int endY) {
+                image->UnpremultiplyChannels(startY, endY);
+            };
+        }
+        input.reader.Read(input.frameBuffer, rowsRead);
+        images.push_back(image);
+    }
+
+    // Combine the images.
+    shared_ptr<DeepImage> image;
+    if(images.size() == 1)
+        image = images[0];
+    else
+        image = DeepImageUtil::CombineImages(images);
+
+    // Sort all samples by depth.  If we want to support volumes, this is where we'd do the rest
+    // of "tidying", splitting samples where they overlap using splitVolumeSample.
+    if(needsSort)
+        DeepImageUtil::SortSamplesByDepth(image);
+
+    return image;
+}
+
+void EXRFlatten::Process(shared_ptr<DeepImage> image, const vector<string> &inputFilenames) const
+{
+    auto state = make_shared<EXROperationState>();
+    state->image = image;
+    state->inputFilenames = inputFilenames;
+
+    // Run the operations.  Each operation starts once the earlier operations it conflicts with
+    // have finished, so independent operations, like masks created from different channels or
+    // saving both flattened images and layers, run at the same time.  Operations are started
+    // in order, so the results are the same as running them one at a time.
+    //
+    // With --frame-workers, frames are already being processed in parallel, so operations
+    // just run in order.
+    bool concurrent = sharedConfig.frameWorkers <= 1 && GetThreadCount() > 1;
+    vector<EXROperation::Dependencies> dependencies(operations.size());
+    for(size_t i = 0; i < operations.size(); ++i)
+        operations[i]->GetDependencies(image, dependencies[i]);
+
+    // Find the operations that use each channel, so channels can be freed once the last of them
+    // is finished instead of being kept until we're done.  This also keeps freed channels out
+    // of CombineWaitingImages.  RGBA and Z are always kept, since they're needed to combine and
+    // sort images.
+    map<string, vector<size_t>> channelUsers;
+    for(auto it: image->channels)
+        channelUsers[it.first];
+    for(const EXROperation::Dependencies &dep: dependencies)
+    {
+        for(const string &name: dep.reads)
+            channelUsers[name];
+        for(const string &name: dep.writes)
+            channelUsers[name];
+    }
+    channelUsers.erase("rgba");
+    channelUsers.erase("Z");
+
+    for(auto &it: channelUsers)
+    {
+        for(size_t i = 0; i < operations.size(); ++i)
+        {
+            const EXROperation::Dependencies &dep = dependencies[i];
+            if(dep.readsAnyChannel || dep.reads.count(it.first) || dep.writes.count(it.first))
+                it.second.push_back(i);
+        }
+    }
+
+    vector<shared_future<void>> running(operations.size());
+    auto isFinished = [&](size_t i) {
+        return !running[i].valid() || running[i].wait_for(chrono::seconds(0)) == future_status::ready;
+    };
+
+    // Free channels that no operation at or after nextOp uses, once the operations that do use
+    // them have finished.
+    int channelsFreed = 0;
+    size_t bytesFreed = 0;
+    auto freeDeadChannels = [&](size_t nextOp) {
+        for(auto it = channelUsers.begin(); it != channelUsers.end(); )
+        {
+            const vector<size_t> &users = it->second;
+            bool dead = users.empty() || users.back() < nextOp;
+            for(size_t i = 0; dead && i < users.size(); ++i)
+                dead = isFinished(users[i]);
+            if(!dead)
+            {
+                ++it;
+                continue;
+            }
+
+            size_t bytes = state->image->RemoveChannel(it->first);
+            for(auto waitingImage: state->waitingImages)
+                waitingImage->RemoveChannel(it->first);
+            if(bytes > 0)
+            {
+                channelsFreed++;
+                bytesFreed += bytes;
+            }
+            it = channelUsers.erase(it);
+        }
+    };
+
+    for(size_t i = 0; i < operations.size(); ++i)
+    {
+        shared_ptr<EXROperation> op = operations[i];
+        for(size_t j = 0; j < i; ++j)
+        {
+            // get() rethrows any exception from the earlier operation.
+            if(running[j].valid() && dependencies[i].ConflictsWith(dependencies[j]))
+                running[j].get();
+        }
+
+        freeDeadChannels(i);
+
+        // If this op is a different type than the previous, and we have new images waiting to be
+        // merged into the main one, do so now.  Only exclusive operations add images, so nothing
+        // else is running.
+        if(i > 0 && typeid(*operations[i-1].get()) != typeid(*op.get()) && !state->waitingImages.empty())
+        {
+            // printf("Merging images\n");
+            state->CombineWaitingImages();
+        }
+
+        // Each operation running on its own thread takes that thread from the thread budget,
+        // and its ParallelFor calls share what's left, so operations running at the same time
+        // don't use more than --threads between them.  If none are left, run the operation here.
+        if(concurrent && !dependencies[i].exclusive && AcquireThreads(1) == 1)
+        {
+            running[i] = async(launch::async, [op, state] {
+                try {
+                    op->Run(state);
+                } catch(...) {
+                    ReleaseThreads(1);
+                    throw;
+                }
+                ReleaseThreads(1);
+            }).share();
+        }
+        else
+            op->Run(state);
+    }
+
+    for(auto &result: running)
+    {
+        if(result.valid())
+            result.get();
+    }
+
+    if(channelsFreed > 0)
+        printf("Freed %i %s after their last use (%.1f MB)\n",
+            channelsFreed, channelsFreed == 1? "channel":"channels", bytesFreed / (1024.0*1024.0));
+}
+
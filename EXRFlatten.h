@@ -0,0 +1,88 @@
+#ifndef EXRFlatten_h
+#define EXRFlatten_h
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+
+#include "EXROperation.h"
+
+class DeepImage;
+class OutputSink;
+
+// The exrflatten engine.  This is built as libexrflatten.a and libexrflatten.so, so other
+// programs can run operations in-process instead of running the exrflatten commandline tool.
+// Options are the same as on the commandline, without the leading --:
+//
+// EXRFlatten flatten;
+// flatten.ParseOptions({ { "input", "render.exr" }, { "save-layers", "" }, { "layer", "1=chair" } });
+// flatten.SetOutputSink(make_shared<MemoryOutputSink>());
+// flatten.Run();
+//
+// To process images as they become available, call RunFrame for each set of input files.
+// Load and Process can be called separately to process an image that's already loaded
+// without reading it again.  Call SetupThreads first when doing that, since only Run and
+// RunFrame call it.
+//
+// Errors are thrown as exceptions, usually StringException.
+class EXRFlatten
+{
+public:
+    EXRFlatten() { }
+
+    // Operations hold a reference to sharedConfig, so this can't be copied.
+    EXRFlatten(const EXRFlatten &) = delete;
+    EXRFlatten &operator=(const EXRFlatten &) = delete;
+
+    // Split commandline arguments like "--layer=1=Object" into options for ParseOptions,
+    // eg. { "layer", "1=Object" }.
+    static vector<pair<string,string>> ParseArgs(const vector<string> &args);
+
+    // Parse options in commandline order, eg. { "input", "file.exr" } for --input=file.exr,
+    // creating the operation list.
+    void ParseOptions(const vector<pair<string,string>> &options);
+
+    // Send output images to sink, instead of writing them to files.
+    void SetOutputSink(shared_ptr<OutputSink> sink);
+
+    // Make OpenEXR read and write files with the thread count set with --threads.  This
+    // is global, so it's shared by every EXRFlatten.  Calling it again without changing the
+    // thread count does nothing.
+    static void SetupThreads();
+
+    // Process the input files, or each frame if --frames was given.
+    void Run() const;
+
+    // Read and process one image from inputFilenames.
+    void RunFrame(const vector<string> &inputFilenames) const;
+
+    // Read inputFilenames and combine them into one image, loading only the channels that
+    // the operations need.
+    shared_ptr<DeepImage> Load(const vector<string> &inputFilenames) const;
+
+    // Return true if image, returned by Load for the same files, has everything these
+    // operations need.  This allows reusing an image loaded for different operations.
+    bool CanProcess(shared_ptr<const DeepImage> image) const;
+
+    // Run the operations on an image returned by Load.  This modifies the image, so to
+    // process the same image again, pass image->Clone().  inputFilenames are used to fill
+    // in output filenames.
+    void Process(shared_ptr<DeepImage> image, const vector<string> &inputFilenames) const;
+
+    typedef function<shared_ptr<EXROperation>(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments)> CreateFunc;
+
+    SharedConfig sharedConfig;
+    vector<shared_ptr<EXROperation>> operations;
+
+private:
+    // Add the channels operations need to frameBuffer, and set needsRGBA and needsSort if
+    // they need rgba or sorted samples.
+    void AddInputChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer, bool &needsRGBA, bool &needsSort) const;
+};
+
+#endif
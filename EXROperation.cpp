@@ -1,6 +1,8 @@
 #include "EXROperation.h"
 #include "DeepImage.h"
 #include "DeepImageUtil.h"
+#include <limits.h>
+#include <stdlib.h>
 
 #include <OpenEXR/ImfChannelList.h>
 
@@ -36,6 +38,120 @@ bool SharedConfig::ParseOption(string opt, string value)
         explicitIdChannel = value;
         return true;
     }
+    else if(opt == "threads")
+    {
+        int threads = atoi(value.c_str());
+        if(threads < 0)
+            throw StringException("Invalid thread count: " + value);
+        SetThreadCount(threads);
+        return true;
+    }
+    else if(opt == "compression")
+    {
+        static const map<string, Imf::Compression> compressionTypes = {
+            { "none", Imf::NO_COMPRESSION },
+            { "rle", Imf::RLE_COMPRESSION },
+            { "zips", Imf::ZIPS_COMPRESSION },
+            { "zip", Imf::ZIP_COMPRESSION },
+            { "piz", Imf::PIZ_COMPRESSION },
+            { "dwaa", Imf::DWAA_COMPRESSION },
+            { "dwab", Imf::DWAB_COMPRESSION },
+        };
+
+        auto it = compressionTypes.find(value);
+        if(it == compressionTypes.end())
+            throw StringException("Unknown compression type: " + value);
+        writeOptions.compression = it->second;
+        return true;
+    }
+    else if(opt == "half")
+    {
+        writeOptions.halfFloat = true;
+        return true;
+    }
+    else if(opt == "png-compression")
+    {
+        int level = atoi(value.c_str());
+        if(level < 0 || level > 9)
+            throw StringException("Invalid PNG compression level: " + value);
+        writeOptions.pngCompressionLevel = level;
+        return true;
+    }
+    else if(opt == "png-filter")
+    {
+        static const map<string, SimpleImage::PNGFilter> filters = {
+            { "none", SimpleImage::PNGFilter_None },
+            { "sub", SimpleImage::PNGFilter_Sub },
+            { "up", SimpleImage::PNGFilter_Up },
+            { "average", SimpleImage::PNGFilter_Average },
+            { "paeth", SimpleImage::PNGFilter_Paeth },
+            { "adaptive", SimpleImage::PNGFilter_Adaptive },
+        };
+
+        auto it = filters.find(value);
+        if(it == filters.end())
+            throw StringException("Unknown PNG filter: " + value);
+        writeOptions.pngFilter = it->second;
+        return true;
+    }
+    else if(opt == "png-16bit")
+    {
+        writeOptions.png16Bit = true;
+        return true;
+    }
+    else if(opt == "incremental")
+    {
+        writeOptions.incremental = true;
+        return true;
+    }
+    else if(opt == "frames")
+    {
+        // A list of frames or ranges, like "1001-1240" or "1,5,10-20".
+        frames.clear();
+        vector<string> ranges;
+        split(value, ",", ranges);
+        for(string range: ranges)
+        {
+            // Frame numbers are usually zero-padded, like 0001-0100, so always parse them as
+            // decimal.
+            auto parseFrame = [&value](string s) {
+                char *end;
+                long frame = strtol(s.c_str(), &end, 10);
+                if(s.empty() || *end != 0 || frame < INT_MIN || frame > INT_MAX)
+                    throw StringException("Invalid frame range: " + value);
+                return (int) frame;
+            };
+
+            // Look for the separator after the first character, so a single negative frame works.
+            size_t dash = range.find('-', 1);
+            int first = parseFrame(range.substr(0, dash));
+            int last = dash == string::npos? first:parseFrame(range.substr(dash+1));
+
+            if(last < first)
+                throw StringException("Invalid frame range: " + value);
+
+            for(int frame = first; frame <= last; ++frame)
+                frames.push_back(frame);
+        }
+
+        if(frames.empty())
+            throw StringException("Invalid frame range: " + value);
+        return true;
+    }
+    else if(opt == "frame-workers")
+    {
+        frameWorkers = atoi(value.c_str());
+        if(frameWorkers < 1)
+            throw StringException("Invalid frame worker count: " + value);
+        return true;
+    }
+    else if(opt == "no-simd")
+    {
+        // Use the plain C++ versions of functions with SIMD implementations.  This
+        // is mostly useful for comparing the two.
+        DisableSIMD();
+        return true;
+    }
 
     return false;
 }
@@ -52,6 +168,80 @@ string SharedConfig::GetIdChannel(const Imf::Header &header) const
         return "ID";
 }
 
+bool EXROperation::Dependencies::ConflictsWith(const Dependencies &other) const
+{
+    if(exclusive || other.exclusive)
+        return true;
+
+    // Two operations conflict if either one writes a channel the other reads or writes.
+    auto intersects = [](const set<string> &a, const set<string> &b) {
+        for(const string &name: a)
+            if(b.find(name) != b.end())
+                return true;
+        return false;
+    };
+
+    return intersects(writes, other.reads) || intersects(writes, other.writes) || intersects(reads, other.writes);
+}
+
+vector<string> SharedConfig::GetFrameInputFilenames(int frame) const
+{
+    vector<string> result;
+    for(string filename: inputFilenames)
+    {
+        // Replace each run of #s with the frame number, padded to the same number of digits.
+        string output;
+        for(size_t pos = 0; pos < filename.size(); )
+        {
+            size_t end = filename.find_first_not_of('#', pos);
+            if(end == string::npos)
+                end = filename.size();
+
+            if(filename[pos] != '#')
+            {
+                output += filename[pos++];
+                continue;
+            }
+
+            output += ssprintf("%0*i", int(end - pos), frame);
+            pos = end;
+        }
+        result.push_back(output);
+    }
+    return result;
+}
+
+namespace {
+    // Given a filename like "abcdef.1234.exr", return "1234".
+    string GetFrameNumberFromFilename(string s)
+    {
+        // abcdef.1234.exr -> abcdef.1234
+        s = setExtension(s, "");
+
+        auto pos = s.rfind(".");
+        if(pos == string::npos)
+            return "";
+
+        string frameString = s.substr(pos+1);
+        return frameString;
+    }
+}
+
+string EXROperationState::SubstituteInputFilename(string outputName) const
+{
+    // <inputname>: the input filename, with the directory and ".exr" removed.
+    string inputName = inputFilenames[0];
+    inputName = basename(inputName);
+    inputName = setExtension(inputName, "");
+    outputName = subst(outputName, "<inputname>", inputName);
+
+    // <frame>: the input filename's frame number, given a "abcdef.1234.exr" filename.
+    // It would be nice if there was an EXR attribute contained the frame number.
+    outputName = subst(outputName, "<frame>", GetFrameNumberFromFilename(inputFilenames[0]));
+
+    return outputName;
+}
+
 shared_ptr<DeepImage> EXROperationState::GetOutputImage()
 {
     if(newImage)
@@ -84,4 +274,50 @@ void EXROperationState::CombineWaitingImages()
 
     // Sort samples in the combined image.
     DeepImageUtil::SortSamplesByDepth(image);
+
+    InvalidateCache();
+}
+
+void EXROperationState::InvalidateCache()
+{
+    cachedImage.reset();
+    nearestSampleCache.clear();
+    sampleVisibilityCache.reset();
+}
+
+void EXROperationState::CheckCache()
+{
+    if(cachedImage == image)
+        return;
+
+    InvalidateCache();
+    cachedImage = image;
+}
+
+shared_ptr<const Imf::Array2D<int>> EXROperationState::GetNearestSamples(string idChannel, const set<int> &objectIds)
+{
+    CheckCache();
+
+    auto key = make_pair(idChannel, objectIds);
+    auto it = nearestSampleCache.find(key);
+    if(it != nearestSampleCache.end())
+        return it->second;
+
+    auto result = make_shared<Imf::Array2D<int>>();
+    DeepImageUtil::GetNearestSamples(image, image->GetChannel<uint32_t>(idChannel), objectIds, *result);
+    nearestSampleCache[key] = result;
+    return result;
+}
+
+shared_ptr<const Imf::Array2D<vector<float>>> EXROperationState::GetSampleVisibilities()
+{
+    CheckCache();
+
+    if(!sampleVisibilityCache)
+    {
+        auto result = make_shared<Imf::Array2D<vector<float>>>();
+        DeepImageUtil::GetSampleVisibilities(image, *result);
+        sampleVisibilityCache = result;
+    }
+    return sampleVisibilityCache;
 }
@@ -4,13 +4,18 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <map>
+#include <set>
 using namespace std;
 
 class DeepImage;
 #include "helpers.h"
+#include "SimpleImage.h"
+#include "OutputSink.h"
 
 #include <OpenEXR/ImfHeader.h>
 #include <OpenEXR/ImfDeepFrameBuffer.h>
+#include <OpenEXR/ImfArray.h>
 
 // Configuration settings shared by multiple EXROperations.  These can be specified
 // at any point on the commandline, and aren't order specific.  They can't be different
@@ -20,6 +25,16 @@ struct SharedConfig
     string outputPath;
     vector<string> inputFilenames;
 
+    // Frames to process from --frames.  If this is empty, inputFilenames are used as-is.
+    // Otherwise, each run of #s in input filenames is replaced with the frame number.
+    vector<int> frames;
+
+    // The number of frames to process at once, from --frame-workers.
+    int frameWorkers = 1;
+
+    // Return inputFilenames for the given frame.
+    vector<string> GetFrameInputFilenames(int frame) const;
+
     // An ID channel specified with --id.  Use GetIdChannel to get the actual
     // ID channel to use.
     string explicitIdChannel = "";
@@ -31,6 +46,13 @@ struct SharedConfig
     // that a unit is 100x bigger than we expect.  For feet, use 30.48.
     float worldSpaceScale = 1.0f;
 
+    // Settings for output files, from --compression, --half, --incremental and the --png options.
+    SimpleImage::WriteOptions writeOptions;
+
+    // Where output images are written.  Programs embedding exrflatten can replace this
+    // to receive images without writing files.
+    shared_ptr<OutputSink> outputSink = make_shared<FileOutputSink>();
+
     bool ParseOption(string opt, string value);
 
     // Given a filename, return the path to save it.
@@ -66,11 +88,39 @@ struct EXROperationState
     // The image to work with.
     shared_ptr<DeepImage> image;
 
+    // The files image was read from.  With --frames, these are the filenames for this frame.
+    vector<string> inputFilenames;
+
+    // Substitute <inputname> and <frame> in an output filename, using the first input file.
+    string SubstituteInputFilename(string outputName) const;
+
     // If an operation calls CreateNewImage, this is the image it created.
     shared_ptr<DeepImage> newImage;
 
     // All newImages that have been created, which are waiting to be merged into image.
     vector<shared_ptr<DeepImage>> waitingImages;
+
+    // Return the frontmost sample for each pixel of image, considering only samples in
+    // idChannel with an ID in objectIds.  See DeepImageUtil::GetNearestSamples.
+    //
+    // This is cached, so multiple strokes on the same objects only scan the image once.
+    shared_ptr<const Imf::Array2D<int>> GetNearestSamples(string idChannel, const set<int> &objectIds);
+
+    // Return DeepImageUtil::GetSampleVisibilities for image.  This is cached like GetNearestSamples.
+    shared_ptr<const Imf::Array2D<vector<float>>> GetSampleVisibilities();
+
+    // Discard cached data.  This happens automatically when image is replaced, but an operation
+    // that modifies Z, alpha or IDs in image directly must call this.
+    void InvalidateCache();
+
+private:
+    // Clear the cache if image has changed since it was filled.
+    void CheckCache();
+
+    // The image the cache was created for.
+    shared_ptr<const DeepImage> cachedImage;
+    map<pair<string, set<int>>, shared_ptr<const Imf::Array2D<int>>> nearestSampleCache;
+    shared_ptr<const Imf::Array2D<vector<float>>> sampleVisibilityCache;
 };
 
 class EXROperation
@@ -79,6 +129,47 @@ public:
     // Add all EXR channels needed by this operation.
     virtual void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const { };
 
+    // The channels an operation reads and writes.  Operations that don't read or write
+    // the same channels can run at the same time.
+    struct Dependencies
+    {
+        set<string> reads, writes;
+
+        // If true, this operation may change anything, such as adding samples or replacing
+        // the image, so it can't run at the same time as any other operation.
+        bool exclusive = true;
+
+        // If true, the operation didn't declare the channels it uses and may read any of them,
+        // so no channel is freed until it's finished.
+        bool readsAnyChannel = false;
+
+        // Return true if this operation has to wait for other, or the other way around.
+        bool ConflictsWith(const Dependencies &other) const;
+    };
+
+    // Declare the channels this operation reads and writes.  This is also used to free
+    // channels after the last operation that uses them.  Operations that don't override
+    // this are exclusive, and may read any channel.
+    virtual void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+    {
+        dependencies.readsAnyChannel = true;
+    }
+
+    // The core channels an operation needs.  Other channels are loaded by AddChannels.
+    struct Requirements
+    {
+        // The operation reads color or alpha from the rgba channel.
+        bool rgba = true;
+
+        // The operation needs samples sorted by depth, which also loads Z.
+        bool sorted = true;
+    };
+
+    // Declare the core channels this operation needs.  This is called after AddChannels, so
+    // it can check which channels are being loaded.  Operations that don't override this
+    // need everything.
+    virtual void GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const { }
+
     // Run the operation on the DeepImage.
     virtual void Run(shared_ptr<EXROperationState> state) const = 0;
 };
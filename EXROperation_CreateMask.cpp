@@ -1,10 +1,13 @@
 #include "EXROperation_CreateMask.h"
 #include "DeepImageUtil.h"
+#include "NormalTransform.h"
+#include "PointTree.h"
 #include "helpers.h"
 
 #include <OpenEXR/ImfMatrixAttribute.h>
 
 #include <algorithm>
+#include <mutex>
 
 using namespace Imf;
 using namespace Imath;
@@ -20,11 +23,19 @@ string CreateMask::GetSrcLayer() const
     case CreateMaskMode_FacingAngle: return "N";
     case CreateMaskMode_Depth: return "Z";
     case CreateMaskMode_Distance: return "P";
+    case CreateMaskMode_Expression: return "";
     }
     return "";
 }
 
-void CreateMask::AddLayers(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
+set<string> CreateMask::GetSrcLayers() const
+{
+    if(mode == CreateMaskMode_Expression)
+        return expression->GetChannels();
+    return { GetSrcLayer() };
+}
+
+void CreateMask::AddLayers(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
 {
     string layer = GetSrcLayer();
     switch(mode)
@@ -33,159 +44,239 @@ void CreateMask::AddLayers(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBu
     case CreateMaskMode_Distance:
     {
         image->AddChannelToFramebuffer<V3f>(layer, frameBuffer);
+        if(!pointObjectIds.empty())
+            image->AddChannelToFramebuffer<uint32_t>(sharedConfig.GetIdChannel(image->header), frameBuffer);
         break;
     }
     case CreateMaskMode_Depth:
         image->AddChannelToFramebuffer<float>(layer, frameBuffer);
         break;
+    case CreateMaskMode_Expression:
+        expression->AddChannels(image, frameBuffer);
+        break;
     }
 
     image->AddChannel<float>(outputChannelName);
 }
 
-shared_ptr<TypedDeepImageChannel<float>> CreateMask::Create(shared_ptr<DeepImage> image) const
+shared_ptr<TypedDeepImageChannel<float>> CreateMask::Create(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image) const
+{
+    CreateMasks(sharedConfig, { *this }, image);
+    return image->GetChannel<float>(outputChannelName);
+}
+
+CreateMask::Prepared CreateMask::Prepare(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image) const
 {
-    shared_ptr<TypedDeepImageChannel<float>> mask;
+    Prepared prepared;
+    prepared.output = image->AddChannel<float>(outputChannelName);
 
     switch(mode)
     {
-    case CreateMaskMode_FacingAngle: mask = CreateFacingAngle(image); break;
-    case CreateMaskMode_Depth: mask = CreateDepth(image); break;
-    case CreateMaskMode_Distance: mask = CreateDistance(image); break;
+    case CreateMaskMode_FacingAngle:
+    {
+        prepared.srcVector = image->GetChannel<V3f>(GetSrcLayer());
+
+        // Get the angle to compare the normal against.  This is usually away from the camera, but
+        // can be changed to get a mask for a different angle.
+        prepared.worldToCamera = DeepImageUtil::GetWorldToCameraMatrix(image, "facing angle mask creation");
+        prepared.towardsCamera = angle;
+        if(prepared.towardsCamera == V3f(0,0,0))
+            prepared.towardsCamera = V3f(0,0,-1);
+        prepared.towardsCamera.normalize();
+        break;
     }
-
-    if(normalize)
+    case CreateMaskMode_Depth:
+        prepared.srcFloat = image->GetChannel<float>(GetSrcLayer());
+        break;
+    case CreateMaskMode_Distance:
     {
-        float minMaskValue = 99999999.0f, maxMaskValue = -99999999.0f;
+        prepared.srcVector = image->GetChannel<V3f>(GetSrcLayer());
+        prepared.points = points;
+        if(pointObjectIds.empty())
+            break;
+
+        // Collect the positions of the samples we're measuring distance to, and build a
+        // tree containing them and any points we were given.
+        vector<V3f> objectPoints;
+        if(points)
+            objectPoints = points->GetPoints();
+
+        auto id = image->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
         for(int y = 0; y < image->height; y++)
         {
             for(int x = 0; x < image->width; x++)
             {
                 for(int s = 0; s < image->NumSamples(x, y); ++s)
                 {
-                    float value = mask->Get(x,y,s);
-                    minMaskValue = min(minMaskValue, value);
-                    maxMaskValue = max(maxMaskValue, value);
+                    if(pointObjectIds.find(id->Get(x,y,s)) != pointObjectIds.end())
+                        objectPoints.push_back(prepared.srcVector->Get(x,y,s));
                 }
             }
         }
 
-        if(minMaskValue != 99999999)
-        {
-            for(int y = 0; y < image->height; y++)
-            {
-                for(int x = 0; x < image->width; x++)
-                {
-                    for(int s = 0; s < image->NumSamples(x, y); ++s)
-                        mask->Get(x,y,s) = scale(mask->Get(x,y,s), minMaskValue, maxMaskValue, 0.0f, 1.0f);
-                }
-            }
-        }
+        prepared.points = make_shared<PointTree>(move(objectPoints));
+        break;
     }
-
-    // Clamp the mask, and optionally invert it.
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
-        {
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
-            {
-                float value = mask->Get(x,y,s);
-                if(clamp)
-                    value = ::clamp(value, 0.0f, 1.0f);
-                if(invert)
-                    value = 1.0f - value;
-
-                mask->Get(x,y,s) = value;
-            }
-        }
+    case CreateMaskMode_Expression:
+        prepared.program = expression->Compile(image);
+        break;
     }
 
-    return mask;
+    return prepared;
 }
 
-shared_ptr<TypedDeepImageChannel<float>> CreateMask::CreateFacingAngle(shared_ptr<DeepImage> image) const
+void CreateMask::CalculateRows(const Prepared &prepared, int startY, int endY, vector<V3f> &buffer) const
 {
-    auto outputMask = image->AddChannel<float>(outputChannelName);
-    auto src = image->GetChannel<V3f>(GetSrcLayer());
-    
-    // Get the angle to compare the normal against.  This is usually away from the camera, but
-    // can be changed to get a mask for a different angle.
-    M44f worldToCamera = DeepImageUtil::GetWorldToCameraMatrix(image, "facing angle mask creation");
-    V3f towardsCamera = angle;
-    if(towardsCamera == V3f(0,0,0))
-        towardsCamera = V3f(0,0,-1);
-    towardsCamera.normalize();
-
-    for(int y = 0; y < image->height; y++)
+    switch(mode)
     {
-        for(int x = 0; x < image->width; x++)
+    case CreateMaskMode_FacingAngle:
+        for(int y = startY; y < endY; y++)
         {
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
+            // Convert the row's normals to camera space all at once.
+            buffer.clear();
+            for(int x = 0; x < prepared.output->width; x++)
             {
-                // Convert the normal to camera space.
-                V3f worldSpaceNormal = src->Get(x,y,s);
-                worldSpaceNormal.normalize();
+                const V3f *samples = prepared.srcVector->GetSamples(x, y);
+                buffer.insert(buffer.end(), samples, samples + prepared.output->sampleCount[y][x]);
+            }
 
-                V3f cameraSpaceNormal;
-                worldToCamera.multDirMatrix(worldSpaceNormal, cameraSpaceNormal);
-                float angle = acos(cameraSpaceNormal.dot(towardsCamera)) * 180 / float(M_PI);
+            TransformNormals(prepared.worldToCamera, buffer.data(), buffer.data(), (int) buffer.size());
 
-                outputMask->Get(x,y,s) = scale(angle, 0.0f, 90.0f, 0.0f, 1.0f);
+            const V3f *cameraSpaceNormal = buffer.data();
+            for(int x = 0; x < prepared.output->width; x++)
+            {
+                float *output = prepared.output->GetSamples(x, y);
+                for(int s = 0; s < (int) prepared.output->sampleCount[y][x]; ++s)
+                {
+                    float angle = acos(cameraSpaceNormal->dot(prepared.towardsCamera)) * 180 / float(M_PI);
+                    output[s] = scale(angle, 0.0f, 90.0f, 0.0f, 1.0f);
+                    ++cameraSpaceNormal;
+                }
             }
         }
+        break;
+    case CreateMaskMode_Expression:
+        prepared.program->Evaluate(startY, endY, *prepared.output);
+        break;
+    default:
+        break;
     }
-    return outputMask;
 }
 
-shared_ptr<TypedDeepImageChannel<float>> CreateMask::CreateDepth(shared_ptr<DeepImage> image) const
+float CreateMask::GetValue(const Prepared &prepared, int x, int y, int s) const
 {
-    auto outputMask = image->AddChannel<float>(outputChannelName);
-    auto src = image->GetChannel<float>(GetSrcLayer());
-
-    for(int y = 0; y < image->height; y++)
+    switch(mode)
     {
-        for(int x = 0; x < image->width; x++)
+    case CreateMaskMode_Depth:
+    {
+        float depth = prepared.srcFloat->Get(x,y,s);
+        return scale(depth, minValue, maxValue, 0.0f, 1.0f);
+    }
+    case CreateMaskMode_Distance:
+    {
+        V3f samplePos = prepared.srcVector->Get(x,y,s);
+        float distance;
+        if(prepared.points == nullptr)
+            distance = (samplePos - pos).length();
+        else if(prepared.points->empty())
+            distance = maxValue; // there's nothing to measure from, so treat everything as far away
+        else
+            distance = sqrtf(prepared.points->GetNearestDistanceSquared(samplePos));
+        return scale(distance, minValue, maxValue, 0.0f, 1.0f);
+    }
+    case CreateMaskMode_FacingAngle:
+    case CreateMaskMode_Expression:
+        // These are calculated a block of rows at a time by CalculateRows, so the value is
+        // already in the output.
+        return prepared.output->Get(x,y,s);
+    }
+    return 0;
+}
+
+void CreateMask::CreateMasks(const SharedConfig &sharedConfig, const vector<CreateMask> &masks, shared_ptr<DeepImage> image)
+{
+    vector<Prepared> prepared;
+    for(const CreateMask &mask: masks)
+        prepared.push_back(mask.Prepare(sharedConfig, image));
+
+    // Calculate all masks in one pass.  Each block of rows finds the range of the masks that
+    // need normalization, and these are combined when the block is finished.
+    vector<float> minMaskValue(masks.size(), 99999999.0f), maxMaskValue(masks.size(), -99999999.0f);
+    mutex rangeLock;
+    ParallelFor(image->height, [&](int startY, int endY) {
+        vector<float> blockMin(masks.size(), 99999999.0f), blockMax(masks.size(), -99999999.0f);
+        vector<V3f> rowBuffer;
+        for(int i = 0; i < (int) masks.size(); ++i)
+            masks[i].CalculateRows(prepared[i], startY, endY, rowBuffer);
+
+        for(int y = startY; y < endY; y++)
         {
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
+            for(int x = 0; x < image->width; x++)
             {
-                float depth = src->Get(x,y,s);
-                outputMask->Get(x,y,s) = scale(depth, minValue, maxValue, 0.0f, 1.0f);
+                for(int s = 0; s < image->NumSamples(x, y); ++s)
+                {
+                    for(int i = 0; i < (int) masks.size(); ++i)
+                    {
+                        float value = masks[i].GetValue(prepared[i], x, y, s);
+                        prepared[i].output->Get(x,y,s) = value;
+
+                        if(masks[i].normalize)
+                        {
+                            blockMin[i] = min(blockMin[i], value);
+                            blockMax[i] = max(blockMax[i], value);
+                        }
+                    }
+                }
             }
         }
-    }
-    return outputMask;
-}
 
-shared_ptr<TypedDeepImageChannel<float>> CreateMask::CreateDistance(shared_ptr<DeepImage> image) const
-{
-    auto outputMask = image->AddChannel<float>(outputChannelName);
-    auto src = image->GetChannel<V3f>(GetSrcLayer());
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
+        lock_guard<mutex> lock(rangeLock);
+        for(int i = 0; i < (int) masks.size(); ++i)
+        {
+            minMaskValue[i] = min(minMaskValue[i], blockMin[i]);
+            maxMaskValue[i] = max(maxMaskValue[i], blockMax[i]);
+        }
+    });
+
+    // Normalize, clamp and invert all masks in a second pass.
+    ParallelFor(image->height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; y++)
         {
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
+            for(int x = 0; x < image->width; x++)
             {
-                V3f samplePos = src->Get(x,y,s);
-                float distance = (samplePos - pos).length();
-                outputMask->Get(x,y,s) = scale(distance, minValue, maxValue, 0.0f, 1.0f);
+                for(int s = 0; s < image->NumSamples(x, y); ++s)
+                {
+                    for(int i = 0; i < (int) masks.size(); ++i)
+                    {
+                        const CreateMask &mask = masks[i];
+                        float &value = prepared[i].output->Get(x,y,s);
+                        if(mask.normalize && minMaskValue[i] != 99999999)
+                            value = scale(value, minMaskValue[i], maxMaskValue[i], 0.0f, 1.0f);
+                        if(mask.clamp)
+                            value = ::clamp(value, 0.0f, 1.0f);
+                        if(mask.invert)
+                            value = 1.0f - value;
+                    }
+                }
             }
         }
-    }
-    return outputMask;
+    });
 }
 
-EXROperation_CreateMask::EXROperation_CreateMask(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments)
+EXROperation_CreateMask::EXROperation_CreateMask(const SharedConfig &sharedConfig_, string opt, vector<pair<string,string>> arguments):
+    sharedConfig(sharedConfig_)
 {
+    CreateMask createMask;
     if(opt == "facing")
         createMask.mode = CreateMask::CreateMaskMode_FacingAngle;
     else if(opt == "depth")
         createMask.mode = CreateMask::CreateMaskMode_Depth;
     else if(opt == "distance")
         createMask.mode = CreateMask::CreateMaskMode_Distance;
+    else if(opt == "expr")
+        createMask.mode = CreateMask::CreateMaskMode_Expression;
     else
-        throw exception("Unknown --create-mask type");
+        throw StringException("Unknown --create-mask type");
 
     // The type of the mask is in opt, which lets us check that options aren't being
     // used that don't apply to this mask type, but this isn't currently done.
@@ -223,6 +314,17 @@ EXROperation_CreateMask::EXROperation_CreateMask(const SharedConfig &sharedConfi
             createMask.angle = getVectorArg();
         else if(arg == "pos")
             createMask.pos = getVectorArg();
+        else if(arg == "points")
+            createMask.points = make_shared<PointTree>(PointTree::ReadPointFile(value));
+        else if(arg == "points-id")
+        {
+            vector<string> ids;
+            split(value, ",", ids);
+            for(string id: ids)
+                createMask.pointObjectIds.insert(atoi(id.c_str()));
+        }
+        else if(arg == "expr")
+            createMask.expression = make_shared<MaskExpression>(value);
         else
             throw StringException("Unknown create-mask option: " + arg);
     }
@@ -230,28 +332,113 @@ EXROperation_CreateMask::EXROperation_CreateMask(const SharedConfig &sharedConfi
     // Check that we received all of our required arguments.
     if(createMask.outputChannelName.empty())
         throw StringException("--create-mask: no --name was specified");
+    if(createMask.mode == CreateMask::CreateMaskMode_Expression && createMask.expression == nullptr)
+        throw StringException("--create-mask=expr: no --expr was specified");
+
+    createMasks.push_back(createMask);
 }
 
 void EXROperation_CreateMask::Run(shared_ptr<EXROperationState> state) const
 {
-    createMask.Create(state->image);
+    CreateMask::CreateMasks(sharedConfig, createMasks, state->image);
 }
 
 void EXROperation_CreateMask::AddChannels(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
 {
-    createMask.AddLayers(image, frameBuffer);
+    for(const CreateMask &createMask: createMasks)
+        createMask.AddLayers(sharedConfig, image, frameBuffer);
+}
+
+void EXROperation_CreateMask::GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+{
+    dependencies.exclusive = false;
+    for(const CreateMask &createMask: createMasks)
+    {
+        for(string layer: createMask.GetSrcLayers())
+            dependencies.reads.insert(layer);
+        if(createMask.mode == CreateMask::CreateMaskMode_Distance && !createMask.pointObjectIds.empty())
+            dependencies.reads.insert(sharedConfig.GetIdChannel(image->header));
+        dependencies.writes.insert(createMask.outputChannelName);
+    }
+}
+
+void EXROperation_CreateMask::GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const
+{
+    // Masks are computed for each sample by itself.  If a mask reads rgba or Z, AddChannels
+    // loads them.
+    requirements.rgba = false;
+    requirements.sorted = false;
+}
+
+bool EXROperation_CreateMask::Merge(const EXROperation_CreateMask &other)
+{
+    set<string> outputs;
+    for(const CreateMask &createMask: createMasks)
+        outputs.insert(createMask.outputChannelName);
+
+    for(const CreateMask &createMask: other.createMasks)
+    {
+        // If a mask reads the output of one of ours, it has to run after ours are finished.
+        for(string layer: createMask.GetSrcLayers())
+        {
+            if(outputs.find(layer) != outputs.end())
+                return false;
+        }
+
+        // If two masks write the same channel, keep them separate so the later one replaces
+        // the earlier one.
+        if(outputs.find(createMask.outputChannelName) != outputs.end())
+            return false;
+    }
+
+    createMasks.insert(createMasks.end(), other.createMasks.begin(), other.createMasks.end());
+    return true;
 }
 
+EXROperation_CreateCameraSpaceNormalMap::EXROperation_CreateCameraSpaceNormalMap(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments)
+{
+    outputChannelName = opt;
 
-#include "EXROperation.h"
-class EXROperation_CreateCameraSpaceNormalMap: public EXROperation
+    for(auto it: arguments)
+    {
+        string arg = it.first;
+        string value = it.second;
+        if(arg == "src")
+            srcLayer = value;
+        else
+            throw StringException("Unknown create-camera-space-normals option: " + arg);
+    }
+
+    if(outputChannelName.empty())
+        throw StringException("--create-camera-space-normals: no output layer was specified");
+}
+
+void EXROperation_CreateCameraSpaceNormalMap::Run(shared_ptr<EXROperationState> state) const
 {
-public:
-    EXROperation_CreateCameraSpaceNormalMap(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments);
-    void Run(shared_ptr<EXROperationState> state) const;
-    void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    shared_ptr<DeepImage> image = state->image;
+    auto src = image->GetChannel<V3f>(srcLayer);
+    if(src == nullptr)
+        throw StringException("--create-camera-space-normals: layer " + srcLayer + " doesn't exist");
 
-private:
-    string outputChannelName;
-};
+    M44f worldToCamera = DeepImageUtil::GetWorldToCameraMatrix(image, "camera space normal maps");
+    DeepImageUtil::TransformNormalMap(image, src, image->AddChannel<V3f>(outputChannelName), worldToCamera);
+}
 
+void EXROperation_CreateCameraSpaceNormalMap::GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+{
+    dependencies.exclusive = false;
+    dependencies.reads.insert(srcLayer);
+    dependencies.writes.insert(outputChannelName);
+}
+
+void EXROperation_CreateCameraSpaceNormalMap::GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const
+{
+    requirements.rgba = false;
+    requirements.sorted = false;
+}
+
+void EXROperation_CreateCameraSpaceNormalMap::AddChannels(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
+{
+    image->AddChannelToFramebuffer<V3f>(srcLayer, frameBuffer);
+    image->AddChannel<V3f>(outputChannelName);
+}
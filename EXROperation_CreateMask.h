@@ -3,12 +3,19 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <set>
 using namespace std;
 
 #include <OpenEXR/ImathVec.h>
+#include <OpenEXR/ImathMatrix.h>
 #include <OpenEXR/ImfDeepFrameBuffer.h>
 
 #include "DeepImage.h"
+#include "MaskExpression.h"
+#include "EXROperation.h"
+
+class PointTree;
 
 // This creates simple monochrome masks from various things in a deep EXR file.
 struct CreateMask
@@ -18,6 +25,7 @@ struct CreateMask
         CreateMaskMode_FacingAngle,
         CreateMaskMode_Depth,
         CreateMaskMode_Distance,
+        CreateMaskMode_Expression,
     };
     Mode mode = CreateMaskMode_FacingAngle;
 
@@ -34,6 +42,17 @@ struct CreateMask
     // CreateMaskMode_Distance: The position to measure distance from.
     Imath::V3f pos = Imath::V3f(0,0,0);
 
+    // CreateMaskMode_Distance: If set, measure the distance to the nearest of these points
+    // instead of pos.  These are loaded with --points.
+    shared_ptr<const PointTree> points;
+
+    // CreateMaskMode_Distance: If not empty, measure the distance to the nearest sample with
+    // one of these object IDs, along with any points.  Sample positions are read from srcLayer.
+    set<int> pointObjectIds;
+
+    // CreateMaskMode_Expression: The expression to evaluate.
+    shared_ptr<const MaskExpression> expression;
+
     // CreateMaskMode_Depth: minValue is mapped to 0, and maxValue is mapped to 1.
     float minValue = 0, maxValue = 1000;
 
@@ -48,29 +67,82 @@ struct CreateMask
 
     string GetSrcLayer() const;
 
+    // Return all layers this mask reads.
+    set<string> GetSrcLayers() const;
+
     // Add all layers to frameBuffer that this mask creation will need to read.
-    void AddLayers(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void AddLayers(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
 
     // Create the mask, adding it to the DeepImage.
-    shared_ptr<TypedDeepImageChannel<float>> Create(shared_ptr<DeepImage> image) const;
+    shared_ptr<TypedDeepImageChannel<float>> Create(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image) const;
+
+    // Create a list of masks in a single pass over the image.  This gives the same result
+    // as calling Create on each, as long as no mask reads a channel written by another.
+    static void CreateMasks(const SharedConfig &sharedConfig, const vector<CreateMask> &masks, shared_ptr<DeepImage> image);
 
 private:
-    shared_ptr<TypedDeepImageChannel<float>> CreateFacingAngle(shared_ptr<DeepImage> image) const;
-    shared_ptr<TypedDeepImageChannel<float>> CreateDepth(shared_ptr<DeepImage> image) const;
-    shared_ptr<TypedDeepImageChannel<float>> CreateDistance(shared_ptr<DeepImage> image) const;
+    // The channels and other data needed to calculate mask values for an image.
+    struct Prepared
+    {
+        shared_ptr<TypedDeepImageChannel<float>> output;
+        shared_ptr<const TypedDeepImageChannel<Imath::V3f>> srcVector;
+        shared_ptr<const TypedDeepImageChannel<float>> srcFloat;
+        Imath::M44f worldToCamera;
+        Imath::V3f towardsCamera;
+        shared_ptr<const MaskExpression::Program> program;
+        shared_ptr<const PointTree> points;
+    };
+
+    // Add the output channel to image, and look up everything else GetValue needs.
+    Prepared Prepare(const SharedConfig &sharedConfig, shared_ptr<DeepImage> image) const;
+
+    // Calculate mask values for rows [startY,endY), for modes that work on many samples at
+    // once.  The values are stored in the output, where GetValue reads them.  buffer is scratch
+    // space.
+    void CalculateRows(const Prepared &prepared, int startY, int endY, vector<Imath::V3f> &buffer) const;
+
+    // Return the mask value for a sample, before normalization, clamping and inversion.
+    float GetValue(const Prepared &prepared, int x, int y, int s) const;
 };
 
 // Use CreateMask to create a mask and add it as an EXR channel.
-#include "EXROperation.h"
 class EXROperation_CreateMask: public EXROperation
 {
 public:
     EXROperation_CreateMask(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments);
     void Run(shared_ptr<EXROperationState> state) const;
     void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const;
+    void GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const;
+
+    // Add the masks from other to this operation, so they're all created in one pass.  If
+    // this isn't possible because other reads or writes a channel that one of our masks
+    // writes, return false and leave this operation unchanged.
+    bool Merge(const EXROperation_CreateMask &other);
+
+private:
+    const SharedConfig &sharedConfig;
+
+    // This is usually a single mask, unless other operations were merged into it.
+    vector<CreateMask> createMasks;
+};
+
+// Convert a world space normal layer to camera space, and add it as a new layer.
+class EXROperation_CreateCameraSpaceNormalMap: public EXROperation
+{
+public:
+    EXROperation_CreateCameraSpaceNormalMap(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments);
+    void Run(shared_ptr<EXROperationState> state) const;
+    void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const;
+    void GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const;
 
 private:
-    CreateMask createMask;
+    // The world space normal layer to read.
+    string srcLayer = "N";
+
+    // The layer to output the camera space normals to.
+    string outputChannelName;
 };
 
 
@@ -3,12 +3,18 @@
 #include "DeepImageUtil.h"
 #include <OpenEXR/ImfStringAttribute.h>
 #include <OpenEXR/ImfMatrixAttribute.h>
+#include <OpenEXR/ImfIntAttribute.h>
+#include <OpenEXR/ImfFloatAttribute.h>
+
+#include <map>
+#include <mutex>
+#include <random>
 
 using namespace std;
 using namespace Imf;
 using namespace Imath;
 
-bool EXROperation_FixArnold::IsArnold(shared_ptr<DeepImage> image) const
+bool EXROperation_FixArnold::IsArnold(shared_ptr<const DeepImage> image) const
 {
     return image->header.findTypedAttribute<StringAttribute>("arnold/version") != NULL;
 };
@@ -19,24 +25,69 @@ void EXROperation_FixArnold::AddChannels(shared_ptr<DeepImage> image, Imf::DeepF
     // not add it and fix it if nobody needs it.
 }
 
-void EXROperation_FixArnold::Run(shared_ptr<EXROperationState> state) const
+void EXROperation_FixArnold::GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
 {
-    shared_ptr<DeepImage> image = state->image;
-    if(!IsArnold(image))
-        return;
+    // This is still exclusive, since it runs before anything else anyway.
+    dependencies.reads.insert("rgba");
+    dependencies.reads.insert("P");
+    dependencies.writes.insert("P");
+}
 
-    // If there's no P channel, we don't need to do this.
+void EXROperation_FixArnold::GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const
+{
+    // We only need alpha if there's a P channel to fix.  Sample order doesn't matter.
+    requirements.rgba = IsArnold(image) && image->channels.find("P") != image->channels.end();
+    requirements.sorted = false;
+}
+
+namespace {
+    // Detection results for each cache key.  Frames of a sequence rendered with the same
+    // settings will either all have this problem or all not have it, so we only need to
+    // detect it once.
+    mutex detectionCacheLock;
+    map<string, int> detectionCache;
+}
+
+string EXROperation_FixArnold::GetCacheKey(shared_ptr<const DeepImage> image) const
+{
+    // Include all Arnold attributes, except for ones that change from frame to frame
+    // without the render settings changing.
+    string key;
+    for(auto it = image->header.begin(); it != image->header.end(); ++it)
+    {
+        string name = it.name();
+        if(name.compare(0, 7, "arnold/") != 0)
+            continue;
+        if(name.compare(0, 13, "arnold/stats/") == 0 || name.compare(0, 12, "arnold/host/") == 0)
+            continue;
+
+        const Attribute &attr = it.attribute();
+        string value;
+        if(auto *stringAttr = dynamic_cast<const StringAttribute *>(&attr))
+            value = stringAttr->value();
+        else if(auto *intAttr = dynamic_cast<const IntAttribute *>(&attr))
+            value = ssprintf("%i", intAttr->value());
+        else if(auto *floatAttr = dynamic_cast<const FloatAttribute *>(&attr))
+            value = ssprintf("%.9g", floatAttr->value());
+        else
+            value = attr.typeName();
+
+        key += name + "=" + value + "\n";
+    }
+    return key;
+}
+
+EXROperation_FixArnold::Detection EXROperation_FixArnold::Detect(shared_ptr<const DeepImage> image) const
+{
     auto P = image->GetChannel<V3f>("P");
-    if(P == nullptr)
-        return;
 
     auto *worldToNDCAttr = image->header.findTypedAttribute<M44fAttribute>("worldToNDC");
     if(worldToNDCAttr == nullptr)
-        throw exception("Can't work around Arnold problems because the worldToNDC matrix attribute is missing");
+        throw StringException("Can't work around Arnold problems because the worldToNDC matrix attribute is missing");
 
     auto *worldToCameraAttr = image->header.findTypedAttribute<M44fAttribute>("worldToCamera");
     if(worldToCameraAttr == nullptr)
-        throw exception("Can't work around Arnold problems because the worldToNDC matrix attribute is missing");
+        throw StringException("Can't work around Arnold problems because the worldToNDC matrix attribute is missing");
 
     M44f worldToNDC = worldToNDCAttr->value();
 
@@ -55,56 +106,138 @@ void EXROperation_FixArnold::Run(shared_ptr<EXROperationState> state) const
 
     auto A = image->GetAlphaChannel();
 
+    // Add the screen space error of each sample in a pixel, with and without dividing by alpha.
     float errorCountDirect = 0;
     float errorCountUnpremultiplied = 0;
-    for(int y = 0; y < image->height; y++)
+    int samplesTested = 0;
+    auto testPixel = [&](int x, int y) {
+        for(int s = 0; s < image->NumSamples(x,y); ++s)
+        {
+            float alpha = A->Get(x,y,s);
+            V3f world = P->Get(x,y,s);
+            V3f worldUnpremultiplied = world / alpha;
+
+            V2f expectedPos((float) x, (float) y);
+            float error = (convertWorldToScreen(world) - expectedPos).length();
+            float errorUnpremultiplied = (convertWorldToScreen(worldUnpremultiplied) - expectedPos).length();
+
+            // Ignore world space positions at the origin.  This is what Arnold outputs for
+            // the background when it's opaque.
+            if(world.length() < 0.01f)
+                continue;
+            errorCountDirect += error;
+            errorCountUnpremultiplied += errorUnpremultiplied;
+            samplesTested++;
+        }
+    };
+
+    // One error total needs to be this many times the other for a decision.
+    const float threshold = 10;
+    auto getResult = [&] {
+        // With no samples, both totals are 0, which would look like a clear result.
+        if(samplesTested == 0)
+            return Detection_Unknown;
+        if(errorCountDirect >= errorCountUnpremultiplied*threshold)
+            return Detection_Premultiplied;
+        else if(errorCountUnpremultiplied >= errorCountDirect*threshold)
+            return Detection_NotPremultiplied;
+        else
+            return Detection_Unknown;
+    };
+
+    // Test random pixels, one from each cell of a grid per round, so the samples are spread
+    // over the image.  Stop as soon as we've tested enough samples and the result is clear.
+    // The random seed is fixed, so the result is the same every time.
+    const int cellSize = 32;
+    const int minSamples = 1000;
+    const int cellsX = (image->width + cellSize - 1) / cellSize;
+    const int cellsY = (image->height + cellSize - 1) / cellSize;
+
+    // Test at most 1/16 of the pixels this way.  If we get that far without a clear result,
+    // we'll just test everything.
+    const int maxRounds = (cellSize*cellSize) / 16;
+    mt19937 random(0);
+
+    for(int round = 0; round < maxRounds; ++round)
     {
-        for(int x = 0; x < image->width; x++)
+        for(int cellY = 0; cellY < cellsY; ++cellY)
         {
-            for(int s = 0; s < image->NumSamples(x,y); ++s)
+            for(int cellX = 0; cellX < cellsX; ++cellX)
             {
-                float alpha = A->Get(x,y,s);
-                V3f world = P->Get(x,y,s);
-                V3f worldUnpremultiplied = world / alpha;
-                    
-                V2f expectedPos((float) x, (float) y);
-                float error = (convertWorldToScreen(world) - expectedPos).length();
-                float errorUnpremultiplied = (convertWorldToScreen(worldUnpremultiplied) - expectedPos).length();
-
-                // Ignore world space positions at the origin.  This is what Arnold outputs for
-                // the background when it's opaque.
-                if(world.length() < 0.01f)
-                    continue;
-                    //printf("%f %f %f %f\n", alpha, world[0], world[1], world[2]);
-                errorCountDirect += error;
-                errorCountUnpremultiplied += errorUnpremultiplied;
+                int x = cellX*cellSize + int(random() % cellSize);
+                int y = cellY*cellSize + int(random() % cellSize);
+                if(x < image->width && y < image->height)
+                    testPixel(x, y);
             }
         }
-    }
 
-    bool isMultipliedByAlpha = false;
-    if(errorCountDirect >= errorCountUnpremultiplied*10)
-    {
-        // We have much less position error when dividing by alpha than without, so it looks
-        // like this image is multiplied by alpha.
-        isMultipliedByAlpha = true;
-        printf("Working around corrupted Arnold positional data\n");
+        if(samplesTested >= minSamples && getResult() != Detection_Unknown)
+            return getResult();
     }
-    else if(errorCountUnpremultiplied >= errorCountDirect*10)
+
+    // The sampled result wasn't conclusive, so test every sample.
+    errorCountDirect = errorCountUnpremultiplied = 0;
+    samplesTested = 0;
+    for(int y = 0; y < image->height; y++)
     {
-        // If the above didn't happen, then we should have much less error without dividing by
-        // alpha.
-        return;
+        for(int x = 0; x < image->width; x++)
+            testPixel(x, y);
     }
-    else
+
+    Detection result = getResult();
+    if(result == Detection_Unknown && samplesTested > 0)
     {
-        // If we get here, we have similar amounts of error in both, which means something unexpected
+        // We have similar amounts of error in both, which means something unexpected
         // is happening.
         printf("Warning: can't determine whether we have bad Arnold data or not (%f, %f)\n",
             errorCountDirect, errorCountUnpremultiplied);
+    }
+    return result;
+}
+
+void EXROperation_FixArnold::Run(shared_ptr<EXROperationState> state) const
+{
+    shared_ptr<DeepImage> image = state->image;
+    if(!IsArnold(image))
+        return;
+
+    // If there's no P channel, we don't need to do this.
+    auto P = image->GetChannel<V3f>("P");
+    if(P == nullptr)
         return;
+
+    // See if we've already checked an image with the same settings.
+    string cacheKey = GetCacheKey(image);
+    bool cached = false;
+    Detection detection = Detection_Unknown;
+    {
+        lock_guard<mutex> lock(detectionCacheLock);
+        auto it = detectionCache.find(cacheKey);
+        if(it != detectionCache.end())
+        {
+            cached = true;
+            detection = Detection(it->second);
+        }
     }
 
-    // Unpremultiply P.
+    if(!cached)
+    {
+        detection = Detect(image);
+
+        // Only remember a clear result.  An image with no usable samples, like an empty
+        // first frame, says nothing about later images with the same settings.
+        if(detection != Detection_Unknown)
+        {
+            lock_guard<mutex> lock(detectionCacheLock);
+            detectionCache[cacheKey] = detection;
+        }
+    }
+
+    if(detection != Detection_Premultiplied)
+        return;
+
+    // We have much less position error when dividing by alpha than without, so it looks
+    // like this image is multiplied by alpha.  Unpremultiply P.
+    printf("Working around corrupted Arnold positional data\n");
     P->UnpremultiplyChannel(image->GetAlphaChannel());
 }
@@ -3,6 +3,7 @@
 
 #include "EXROperation.h"
 #include <memory>
+#include <string>
 using namespace std;
 
 // Arnold outputs P AOVs with broken data ... sometimes.  The values seem to be multiplied
@@ -17,10 +18,26 @@ class EXROperation_FixArnold: public EXROperation
 public:
     EXROperation_FixArnold() { }
     void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const;
+    void GetRequirements(shared_ptr<const DeepImage> image, Requirements &requirements) const;
     void Run(shared_ptr<EXROperationState> state) const;
 
 private:
-    bool IsArnold(shared_ptr<DeepImage> image) const;
+    bool IsArnold(shared_ptr<const DeepImage> image) const;
+
+    enum Detection
+    {
+        Detection_Premultiplied,
+        Detection_NotPremultiplied,
+        Detection_Unknown,
+    };
+
+    // Figure out whether P in image has been multiplied by alpha.
+    Detection Detect(shared_ptr<const DeepImage> image) const;
+
+    // Return a key identifying the Arnold version and render settings used for image.
+    // Images with the same key get the same detection result.
+    string GetCacheKey(shared_ptr<const DeepImage> image) const;
 };
 
 #endif
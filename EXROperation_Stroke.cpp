@@ -16,7 +16,7 @@
 #include "EuclideanDistance.h"
 #include "DeepImageUtil.h"
 #include "SimpleImage.h"
-#include "Helpers.h"
+#include "helpers.h"
 
 using namespace std;
 using namespace Imf;
@@ -34,48 +34,34 @@ float DeepImageStroke::DistanceAndRadiusToAlpha(float distance, const Config &co
     return scale_clamp(distance, config.radius, config.radius+config.fade, 1.0f, 0.0f);
 }
 
+namespace {
+    // A stroke sample waiting to be added to the output image.
+    struct StagedSample
+    {
+        int x, y;
+        V4f rgba;
+        float Z;
+        uint32_t id;
+    };
+}
+
 void DeepImageStroke::ApplyStrokeUsingMask(const DeepImageStroke::Config &config, const SharedConfig &sharedConfig,
-    shared_ptr<const DeepImage> image, shared_ptr<DeepImage> outputImage, shared_ptr<SimpleImage> mask)
+    shared_ptr<const DeepImage> image, shared_ptr<DeepImage> outputImage,
+    const Array2D<int> &NearestSample, shared_ptr<SimpleImage> mask)
 {
     auto rgba = image->GetChannel<V4f>("rgba");
     auto id = image->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
     auto Z = image->GetChannel<float>("Z");
 
-    // Find closest sample (for our object ID) to the camera for each point.
-    Array2D<int> NearestSample;
-    NearestSample.resizeErase(image->height, image->width);
-
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
-        {
-            int &nearest = NearestSample[y][x];
-            nearest = -1;
-
-            for(int s = 0; s < image->NumSamples(x,y); ++s)
-            {
-                if(config.objectIds.find(id->Get(x,y,s)) == config.objectIds.end())
-                    continue;
-
-                if(nearest != -1)
-                {
-                    if(Z->Get(x,y,s) > Z->Get(x,y,nearest))
-                        continue;
-                }
-
-                nearest = s;
-            }
-        }
-    }
-
     // Calculate a stroke for the flattened image, and insert the stroke as deep samples, so
     // it'll get composited at the correct depth, allowing it to be obscured.
     Array2D<float> greyscale(mask->height, mask->width);
+    const float *maskAlpha = mask->GetPlane(3);
     for(int y = 0; y < mask->height; ++y)
     {
         for(int x = 0; x < mask->width; ++x)
         {
-            float alpha = mask->GetRGBA(x, y)[3];
+            float alpha = maskAlpha[y*mask->width + x];
             alpha = ::clamp(alpha, 0.0f, 1.0f);
             if(alpha < 0.001f)
                 alpha = 0;
@@ -85,112 +71,134 @@ void DeepImageStroke::ApplyStrokeUsingMask(const DeepImageStroke::Config &config
         }
     }
 
-    shared_ptr<Array2D<EuclideanDistance::DistanceResult>> EuclideanDistance = EuclideanDistance::Calculate(mask->width, mask->height, greyscale);
+    Array2D<EuclideanDistance::DistanceResult> distances;
+    EuclideanDistance::Calculate(mask->width, mask->height, greyscale, distances);
 
-    for(int y = 0; y < mask->height; ++y)
-    {
-        for(int x = 0; x < mask->width; ++x)
+    // Rows are processed in parallel.  Samples can't be added to outputImage from multiple
+    // threads, so each row stages its samples, and they're added in order at the end.  This
+    // gives the same result as adding them directly.
+    vector<vector<StagedSample>> stagedRows(mask->height);
+    ParallelFor(mask->height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; ++y)
         {
-            float distance = (*EuclideanDistance)[y][x].distance;
-            int sx = (*EuclideanDistance)[y][x].sx;
-            int sy = (*EuclideanDistance)[y][x].sy;
+            vector<StagedSample> &staged = stagedRows[y];
+            for(int x = 0; x < mask->width; ++x)
+            {
+                float distance = distances[y][x].distance;
+                int sx = distances[y][x].sx;
+                int sy = distances[y][x].sy;
 
-            float alpha = DistanceAndRadiusToAlpha(distance + 0.5f, config);
-            //if(x == TEST_X && y == TEST_Y)
-            //    printf("-> distance %.13f, alpha %.13f, source %ix%i\n", distance, alpha, sx, sy);
+                float alpha = DistanceAndRadiusToAlpha(distance + 0.5f, config);
+                //if(x == TEST_X && y == TEST_Y)
+                //    printf("-> distance %.13f, alpha %.13f, source %ix%i\n", distance, alpha, sx, sy);
 #if 0
-            image->AddSample(x, y);
-            rgba->GetLast(x,y) = V4f(distance, distance, distance, 1);
-            Z->GetLast(x,y) = 1;
-            ZBack->GetLast(x,y) = 1;
-            id->GetLast(x,y) = config.outputObjectId;
-            continue;
-#endif
-
-            // Don't add an empty sample.
-            if(alpha <= 0.00001f)
-                continue;
-
-            // sx/sy might be out of bounds.  This normally only happens if the layer is completely
-            // empty and alpha will be 0 so we won't get here, but check to be safe.
-            if(sx < 0 || sy < 0 || sx >= NearestSample.width() || sy >= NearestSample.height())
+                image->AddSample(x, y);
+                rgba->GetLast(x,y) = V4f(distance, distance, distance, 1);
+                Z->GetLast(x,y) = 1;
+                ZBack->GetLast(x,y) = 1;
+                id->GetLast(x,y) = config.outputObjectId;
                 continue;
+#endif
 
-            // SourceSample is the nearest visible pixel to this stroke, which we treat as the
-            // "source" of the stroke.  StrokeSample is the sample underneath the stroke itself,
-            // if any.
-            int SourceSample = NearestSample[sy][sx];
-            int StrokeSample = NearestSample[y][x];
-
-            // For samples that lie outside the mask, StrokeSample.zNear won't be set, and we'll
-            // use the Z distance from the source sample.  For samples that lie within the mask,
-            // eg. because there's antialiasing, use whichever is nearer, the sample under the stroke
-            // or the sample the stroke came from.  In this case, the sample under the stroke might
-            // be closer to the camera than the source sample, so if we don't do this the stroke will
-            // end up being behind the shape.
-            //
-            // Note that either of these may not actually have a sample, in which case the index will
-            // be -1 and we'll use the default.
-            float SourceSampleDistance = Z->GetWithDefault(sx, sy, SourceSample, 10000000);
-            float StrokeSampleDistance = Z->GetWithDefault(x, y, StrokeSample, 10000000);
-            float zDistance = min(SourceSampleDistance, StrokeSampleDistance);
-
-            // Bias the distance closer to the camera.  We need to subtract at least a small amount to
-            // make sure the stroke is on top of the source shape.  Subtracting more helps avoid aliasing
-            // where two stroked objects are overlapping, but too much will cause strokes to be on top
-            // of objects they shouldn't.
-            zDistance -= config.pushTowardsCamera;
-            // zDistance = 0;
-
-            /*
-             * An outer stroke is logically blended underneath the shape, and only antialiased on
-             * the outer edge of the stroke.  The inner edge where the stroke meets the shape isn't
-             * antialiased.  Instead, the antialiasing of the shape on top of it is what gives the
-             * smooth blending from the stroke to the shape.  For intersection lines, the stroke
-             * is between the source sample and samples below it.
-             *
-             * However, we want to put the stroke over the shape, not underneath it, so it can go over
-             * other stroked objects.  Deal with this by mixing the existing color over the stroke color.
-             */
-            V4f topColor(0,0,0,0);
-            for(int s = 0; s < image->NumSamples(x, y); ++s)
-            {
-                float depth = Z->Get(x,y,s);
-                if(depth > SourceSampleDistance + 0.0001f + config.pushTowardsCamera)
+                // Don't add an empty sample.
+                if(alpha <= 0.00001f)
                     continue;
 
-                V4f c = rgba->Get(x,y,s);
-                topColor = topColor*(1-c[3]);
+                // sx/sy might be out of bounds.  This normally only happens if the layer is completely
+                // empty and alpha will be 0 so we won't get here, but check to be safe.
+                if(sx < 0 || sy < 0 || sx >= NearestSample.width() || sy >= NearestSample.height())
+                    continue;
 
-                if(config.objectIds.find(id->Get(x,y,s)) != config.objectIds.end() ||
-                    id->Get(x,y,s) == config.outputObjectId)
-                    topColor += c;
-            }
+                // SourceSample is the nearest visible pixel to this stroke, which we treat as the
+                // "source" of the stroke.  StrokeSample is the sample underneath the stroke itself,
+                // if any.
+                int SourceSample = NearestSample[sy][sx];
+                int StrokeSample = NearestSample[y][x];
+
+                // For samples that lie outside the mask, StrokeSample.zNear won't be set, and we'll
+                // use the Z distance from the source sample.  For samples that lie within the mask,
+                // eg. because there's antialiasing, use whichever is nearer, the sample under the stroke
+                // or the sample the stroke came from.  In this case, the sample under the stroke might
+                // be closer to the camera than the source sample, so if we don't do this the stroke will
+                // end up being behind the shape.
+                //
+                // Note that either of these may not actually have a sample, in which case the index will
+                // be -1 and we'll use the default.
+                float SourceSampleDistance = Z->GetWithDefault(sx, sy, SourceSample, 10000000);
+                float StrokeSampleDistance = Z->GetWithDefault(x, y, StrokeSample, 10000000);
+                float zDistance = min(SourceSampleDistance, StrokeSampleDistance);
+
+                // Bias the distance closer to the camera.  We need to subtract at least a small amount to
+                // make sure the stroke is on top of the source shape.  Subtracting more helps avoid aliasing
+                // where two stroked objects are overlapping, but too much will cause strokes to be on top
+                // of objects they shouldn't.
+                zDistance -= config.pushTowardsCamera;
+                // zDistance = 0;
+
+                /*
+                 * An outer stroke is logically blended underneath the shape, and only antialiased on
+                 * the outer edge of the stroke.  The inner edge where the stroke meets the shape isn't
+                 * antialiased.  Instead, the antialiasing of the shape on top of it is what gives the
+                 * smooth blending from the stroke to the shape.  For intersection lines, the stroke
+                 * is between the source sample and samples below it.
+                 *
+                 * However, we want to put the stroke over the shape, not underneath it, so it can go over
+                 * other stroked objects.  Deal with this by mixing the existing color over the stroke color.
+                 */
+                V4f topColor(0,0,0,0);
+                for(int s = 0; s < image->NumSamples(x, y); ++s)
+                {
+                    float depth = Z->Get(x,y,s);
+                    if(depth > SourceSampleDistance + 0.0001f + config.pushTowardsCamera)
+                        continue;
 
-            // If the top color is completely opaque the stroke can't be seen at all, so
-            // don't output a sample for it.
-            if(topColor[3] >= 0.999f)
-                continue;
+                    V4f c = rgba->Get(x,y,s);
+                    topColor = topColor*(1-c[3]);
 
-            V4f strokeColor = config.strokeColor * alpha;
-            V4f mixedColor = topColor + strokeColor * (1-topColor[3]);
+                    if(config.objectIds.find(id->Get(x,y,s)) != config.objectIds.end() ||
+                        id->Get(x,y,s) == config.outputObjectId)
+                        topColor += c;
+                }
 
-            // Don't add an empty sample.
-            if(mixedColor[3] <= 0.00001f)
-                continue;
+                // If the top color is completely opaque the stroke can't be seen at all, so
+                // don't output a sample for it.
+                if(topColor[3] >= 0.999f)
+                    continue;
 
-            // Add a sample for the stroke.
-            outputImage->AddSample(x, y);
+                V4f strokeColor = config.strokeColor * alpha;
+                V4f mixedColor = topColor + strokeColor * (1-topColor[3]);
 
-            auto rgbaOut = outputImage->GetChannel<V4f>("rgba");
-            auto idOut = outputImage->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
-            auto ZBackOut = outputImage->GetChannel<float>("ZBack");
-            auto ZOut = outputImage->GetChannel<float>("Z");
+                // Don't add an empty sample.
+                if(mixedColor[3] <= 0.00001f)
+                    continue;
 
-            rgbaOut->GetLast(x,y) = mixedColor;
-            ZOut->GetLast(x,y) = zDistance;
-            ZBackOut->GetLast(x,y) = zDistance;
-            idOut->GetLast(x,y) = config.outputObjectId;
+                // Stage a sample for the stroke.
+                StagedSample sample;
+                sample.x = x;
+                sample.y = y;
+                sample.rgba = mixedColor;
+                sample.Z = zDistance;
+                sample.id = config.outputObjectId;
+                staged.push_back(sample);
+            }
+        }
+    });
+
+    // Add the staged samples.
+    auto rgbaOut = outputImage->GetChannel<V4f>("rgba");
+    auto idOut = outputImage->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
+    auto ZBackOut = outputImage->GetChannel<float>("ZBack");
+    auto ZOut = outputImage->GetChannel<float>("Z");
+    for(const auto &staged: stagedRows)
+    {
+        for(const StagedSample &sample: staged)
+        {
+            int x = sample.x, y = sample.y;
+            outputImage->AddSample(x, y);
+            rgbaOut->GetLast(x,y) = sample.rgba;
+            ZOut->GetLast(x,y) = sample.Z;
+            ZBackOut->GetLast(x,y) = sample.Z;
+            idOut->GetLast(x,y) = sample.id;
         }
     }
 }
@@ -203,7 +211,7 @@ static float CalculateDepthScale(const DeepImageStroke::Config &config, shared_p
 
     auto *worldToNDCAttr = image->header.findTypedAttribute<M44fAttribute>("worldToNDC");
     if(worldToNDCAttr == nullptr)
-        throw exception("Can't create stroke intersections because worldToNDC matrix attribute is missing");
+        throw StringException("Can't create stroke intersections because worldToNDC matrix attribute is missing");
 
     // Note that the OpenEXR ImfStandardAttributes.h header has a completely wrong
     // description of worldToNDC that could never work.  It's actually clip space,
@@ -263,10 +271,12 @@ shared_ptr<SimpleImage> DeepImageStroke::CreateIntersectionPattern(
     const DeepImageStroke::Config &config,
     const SharedConfig &sharedConfig,
     shared_ptr<const DeepImage> image,
+    const Array2D<vector<float>> &SampleVisibilities,
     shared_ptr<const TypedDeepImageChannel<float>> strokeMask,
     shared_ptr<const TypedDeepImageChannel<float>> intersectionMask)
 {
-    shared_ptr<SimpleImage> pattern = make_shared<SimpleImage>(image->width, image->height);
+    // The pattern is only used as a mask, so only store alpha.
+    shared_ptr<SimpleImage> pattern = make_shared<SimpleImage>(image->width, image->height, 1);
 
     // Create a mask using simple edge detection.
     auto id = image->GetChannel<uint32_t>(sharedConfig.GetIdChannel(image->header));
@@ -295,165 +305,165 @@ shared_ptr<SimpleImage> DeepImageStroke::CreateIntersectionPattern(
         return nullptr;
     }
 
-    Array2D<vector<float>> SampleVisibilities;
-    DeepImageUtil::GetSampleVisibilities(image, SampleVisibilities);
-
     // The number of pixels per 1cm, at a distance of 1cm from the camera.
     float pixelsPerCm = CalculateDepthScale(config, image);
 
-    for(int y = 0; y < image->height; y++)
-    {
-        for(int x = 0; x < image->width; x++)
+    // Each pixel only writes its own pattern value, so rows can run in parallel.
+    ParallelFor(image->height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; y++)
         {
-            if(!image->NumSamples(x,y))
-                continue;
+            for(int x = 0; x < image->width; x++)
+            {
+                if(!image->NumSamples(x,y))
+                    continue;
 
-            float maxDistance = 0;
+                float maxDistance = 0;
 
-            static const vector<pair<int,int>> directions = {
-                {  0, -1 },
-                { -1,  0 },
-                { +1,  0 },
-                {  0, +1 },
+                static const vector<pair<int,int>> directions = {
+                    {  0, -1 },
+                    { -1,  0 },
+                    { +1,  0 },
+                    {  0, +1 },
 
-                // We can test against diagonals, and again other samples in the same
-                // pixel, but this generally doesn't seem to make much difference.
+                    // We can test against diagonals, and again other samples in the same
+                    // pixel, but this generally doesn't seem to make much difference.
 #if 0
-                { -1, -1 },
-                { +1, -1 },
-                { -1, +1 },
-                { +1, +1 },
-                {  0,  0 },
+                    { -1, -1 },
+                    { +1, -1 },
+                    { -1, +1 },
+                    { +1, +1 },
+                    {  0,  0 },
 #endif
-            };
-
-            // Compare this pixel to each of the bordering pixels.
-            for(const auto &dir: directions)
-            {
-                int x2 = x + dir.first;
-                int y2 = y + dir.second;
-                if(x2 < 0 || y2 < 0 || x2 >= image->width || y2 >= image->height)
-                    continue;
+                };
 
-                // Compare the depth of each sample in (x,y) to each sample in (x2,y2).
-                float totalDifference = 0;
-                for(int s1 = 0; s1 < image->NumSamples(x,y); ++s1)
+                // Compare this pixel to each of the bordering pixels.
+                for(const auto &dir: directions)
                 {
-                    if(config.objectIds.find(id->Get(x,y,s1)) == config.objectIds.end())
-                        continue;
-
-                    // Skip this sample if it's completely occluded.
-                    float sampleVisibility1 = SampleVisibilities[y][x][s1] * A->Get(x,y,s1);
-                    if(sampleVisibility1 < 0.001f)
+                    int x2 = x + dir.first;
+                    int y2 = y + dir.second;
+                    if(x2 < 0 || y2 < 0 || x2 >= image->width || y2 >= image->height)
                         continue;
 
-                    float depth1 = Z->Get(x, y, s1);
-                    V3f world1 = P? P->Get(x, y, s1):V3f(0,0,0);
-                    V3f normal1 = N? N->Get(x, y, s1).normalized():V3f(1,0,0);
-
-                    // We're looking for sudden changes in depth from one pixel to the next to find
-                    // edges.  However, we need to adjust the threshold based on pixel density.  If
-                    // we're twice as far from the camera, we'll have half as many pixels, which makes
-                    // changes in depth look twice as sudden.  If we don't have enough pixels to
-                    // sample, any two neighboring pixels might look far apart.
-                    //
-                    // config.minPixelsPerCm is the minimum number of pixels that we're allowed to cross in
-                    // 1cm of world space.  If we're crossing less than that, the object is far away or the
-                    // image is low resolution, and we'll begin scaling intersectionMinDistance up, so it takes
-                    // a bigger distance before we detect an edge.
-
-                    // pixelsPerCm is at a depth of 1.  pixelsPerCm / depth is the number of pixels at depth.
-                    float pixelsPerCmAtThisDepth = pixelsPerCm / depth1;
-
-                    // If pixelsPerCmAtThisDepth >= minPixelsPerCm, then we have enough pixels and don't
-                    // need to scale, so depthScale is 1.
-                    //
-                    // If pixelsPerCmAtThisDepth is half minPixelsPerCm, then we're crossing half as many
-                    // pixels per cm as minPixelsPerCm.  depthScale is 2, so we'll double the threshold.
-                    float depthScale = max(1.0f, config.minPixelsPerCm / pixelsPerCmAtThisDepth);
-
-                    /*if(x == TEST_X && y == TEST_Y)
-                    {
-                        printf("%ix%i depth %f, pixelsPerCmAtThisDepth %f, depthScale %f\n",
-                            x, y, depth1, pixelsPerCmAtThisDepth, depthScale);
-                    }*/
-
-                    // config.intersectionMinDistance is the distance between pixels where we start to
-                    // add intersection lines, assuming the number of units per pixel is expectedPixelsPerCm.
-
-                    for(int s2 = 0; s2 < image->NumSamples(x2,y2); ++s2)
+                    // Compare the depth of each sample in (x,y) to each sample in (x2,y2).
+                    float totalDifference = 0;
+                    for(int s1 = 0; s1 < image->NumSamples(x,y); ++s1)
                     {
-                        if(config.objectIds.find(id->Get(x2,y2,s2)) == config.objectIds.end())
+                        if(config.objectIds.find(id->Get(x,y,s1)) == config.objectIds.end())
                             continue;
 
                         // Skip this sample if it's completely occluded.
-                        float sampleVisibility2 = SampleVisibilities[y2][x2][s2] * A->Get(x2,y2,s2);
-                        if(sampleVisibility2 < 0.001f)
+                        float sampleVisibility1 = SampleVisibilities[y][x][s1] * A->Get(x,y,s1);
+                        if(sampleVisibility1 < 0.001f)
                             continue;
 
-                        // Don't clear this pixel if it's further away than the source, so we clear
-                        // pixels within the nearer object and not the farther one.
-                        float depth2 = Z->Get(x2, y2, s2);
-                        if(depth2 < depth1)
-                            continue;
+                        float depth1 = Z->Get(x, y, s1);
+                        V3f world1 = P? P->Get(x, y, s1):V3f(0,0,0);
+                        V3f normal1 = N? N->Get(x, y, s1).normalized():V3f(1,0,0);
 
-                        V3f world2 = P? P->Get(x2, y2, s2):V3f(0,0,0);
-                        V3f normal2 = N? N->Get(x2, y2, s2).normalized():V3f(1,0,0);
-                        float angle = acosf(::clamp(normal1.dot(normal2), -1.0f, +1.0f)) * 180 / float(M_PI);
+                        // We're looking for sudden changes in depth from one pixel to the next to find
+                        // edges.  However, we need to adjust the threshold based on pixel density.  If
+                        // we're twice as far from the camera, we'll have half as many pixels, which makes
+                        // changes in depth look twice as sudden.  If we don't have enough pixels to
+                        // sample, any two neighboring pixels might look far apart.
+                        //
+                        // config.minPixelsPerCm is the minimum number of pixels that we're allowed to cross in
+                        // 1cm of world space.  If we're crossing less than that, the object is far away or the
+                        // image is low resolution, and we'll begin scaling intersectionMinDistance up, so it takes
+                        // a bigger distance before we detect an edge.
 
-                        // Find the world space distance between these two samples.
-                        float distance = (world2 - world1).length();
+                        // pixelsPerCm is at a depth of 1.  pixelsPerCm / depth is the number of pixels at depth.
+                        float pixelsPerCmAtThisDepth = pixelsPerCm / depth1;
 
-                        /* if(x == TEST_X && y == TEST_Y)
-                        {
-                            printf("distance (%+ix%+i) between %ix%i sample %i (depth %.1f, vis %.2f) and %ix%i sample %i (vis %.2f): depth %.1f, distance %f\n",
-                                dir.first, dir.second,
-                                x, y, s1, depth1, sampleVisibility1,
-                                x2, y2, s2, sampleVisibility2,
-                                depth2-depth1, distance);
-                        } */
-
-                        // Scale depth and normals to 0-1.
-                        float result = 1;
-                        if(config.intersectionsUseNormals && N)
-                            result *= scale_clamp(angle,
-                                config.intersectionAngleThreshold,
-                                config.intersectionAngleThreshold + config.intersectionAngleFade,
-                                0.0f, 1.0f);
-                        if(config.intersectionsUseDistance && P)
-                            result *= scale_clamp(distance,
-                                 config.intersectionMinDistance*depthScale,
-                                (config.intersectionMinDistance+config.intersectionFade) * depthScale, 0.0f, 1.0f);
-
-                        // Scale by the visibility of the pixels we're testing.
-                        result *= sampleVisibility1 * sampleVisibility2;
-
-                        // If we have a mask, apply it now like visibility.
+                        // If pixelsPerCmAtThisDepth >= minPixelsPerCm, then we have enough pixels and don't
+                        // need to scale, so depthScale is 1.
                         //
-                        // If the object ID is the same then this is an object crossing over itself, so
-                        // use the intersection mask.  If the ID is different then it's one object on top
-                        // of another, so use the stroke mask.
-                        shared_ptr<const TypedDeepImageChannel<float>> &mask =
-                            id->Get(x,y,s1) == id->Get(x2,y2,s2)? intersectionMask:strokeMask;
-                        if(mask)
-                            result *= ::clamp(mask->Get(x,y,s1), 0.0f, 1.0f);
-
-                        totalDifference += result;
+                        // If pixelsPerCmAtThisDepth is half minPixelsPerCm, then we're crossing half as many
+                        // pixels per cm as minPixelsPerCm.  depthScale is 2, so we'll double the threshold.
+                        float depthScale = max(1.0f, config.minPixelsPerCm / pixelsPerCmAtThisDepth);
+
+                        /*if(x == TEST_X && y == TEST_Y)
+                        {
+                            printf("%ix%i depth %f, pixelsPerCmAtThisDepth %f, depthScale %f\n",
+                                x, y, depth1, pixelsPerCmAtThisDepth, depthScale);
+                        }*/
+
+                        // config.intersectionMinDistance is the distance between pixels where we start to
+                        // add intersection lines, assuming the number of units per pixel is expectedPixelsPerCm.
+
+                        for(int s2 = 0; s2 < image->NumSamples(x2,y2); ++s2)
+                        {
+                            if(config.objectIds.find(id->Get(x2,y2,s2)) == config.objectIds.end())
+                                continue;
+
+                            // Skip this sample if it's completely occluded.
+                            float sampleVisibility2 = SampleVisibilities[y2][x2][s2] * A->Get(x2,y2,s2);
+                            if(sampleVisibility2 < 0.001f)
+                                continue;
+
+                            // Don't clear this pixel if it's further away than the source, so we clear
+                            // pixels within the nearer object and not the farther one.
+                            float depth2 = Z->Get(x2, y2, s2);
+                            if(depth2 < depth1)
+                                continue;
+
+                            V3f world2 = P? P->Get(x2, y2, s2):V3f(0,0,0);
+                            V3f normal2 = N? N->Get(x2, y2, s2).normalized():V3f(1,0,0);
+                            float angle = acosf(::clamp(normal1.dot(normal2), -1.0f, +1.0f)) * 180 / float(M_PI);
+
+                            // Find the world space distance between these two samples.
+                            float distance = (world2 - world1).length();
+
+                            /* if(x == TEST_X && y == TEST_Y)
+                            {
+                                printf("distance (%+ix%+i) between %ix%i sample %i (depth %.1f, vis %.2f) and %ix%i sample %i (vis %.2f): depth %.1f, distance %f\n",
+                                    dir.first, dir.second,
+                                    x, y, s1, depth1, sampleVisibility1,
+                                    x2, y2, s2, sampleVisibility2,
+                                    depth2-depth1, distance);
+                            } */
+
+                            // Scale depth and normals to 0-1.
+                            float result = 1;
+                            if(config.intersectionsUseNormals && N)
+                                result *= scale_clamp(angle,
+                                    config.intersectionAngleThreshold,
+                                    config.intersectionAngleThreshold + config.intersectionAngleFade,
+                                    0.0f, 1.0f);
+                            if(config.intersectionsUseDistance && P)
+                                result *= scale_clamp(distance,
+                                     config.intersectionMinDistance*depthScale,
+                                    (config.intersectionMinDistance+config.intersectionFade) * depthScale, 0.0f, 1.0f);
+
+                            // Scale by the visibility of the pixels we're testing.
+                            result *= sampleVisibility1 * sampleVisibility2;
+
+                            // If we have a mask, apply it now like visibility.
+                            //
+                            // If the object ID is the same then this is an object crossing over itself, so
+                            // use the intersection mask.  If the ID is different then it's one object on top
+                            // of another, so use the stroke mask.
+                            shared_ptr<const TypedDeepImageChannel<float>> &mask =
+                                id->Get(x,y,s1) == id->Get(x2,y2,s2)? intersectionMask:strokeMask;
+                            if(mask)
+                                result *= ::clamp(mask->Get(x,y,s1), 0.0f, 1.0f);
+
+                            totalDifference += result;
+                        }
                     }
-                }
 
-                // If this is a corner sample, reduce its effect based on the distance to the
-                // pixel we're testing.
-                float screenDistance = (V2f((float) x, (float) y) - V2f((float) x2, (float) y2)).length();
-                if(screenDistance >= 1)
-                    totalDifference *= 1/screenDistance;
+                    // If this is a corner sample, reduce its effect based on the distance to the
+                    // pixel we're testing.
+                    float screenDistance = (V2f((float) x, (float) y) - V2f((float) x2, (float) y2)).length();
+                    if(screenDistance >= 1)
+                        totalDifference *= 1/screenDistance;
 
-                maxDistance = max(maxDistance, totalDifference);
-            }
+                    maxDistance = max(maxDistance, totalDifference);
+                }
 
-            pattern->GetRGBA(x,y) = V4f(1,1,1,1) * maxDistance;
+                pattern->GetPlane(3)[y*image->width + x] = maxDistance;
+            }
         }
-    }
+    });
 
     return pattern;
 }
@@ -463,11 +473,14 @@ void EXROperation_Stroke::Run(shared_ptr<EXROperationState> state) const
     // Output stroke samples to an output image that we'll combine later, and not
     // directly into the image.  If multiple strokes are added, we don't want later
     // strokes to be affected by the strokes of earlier images.
-    AddStroke(strokeDesc, state->image, state->GetOutputImage());
+    AddStroke(strokeDesc, state);
 }
 
-void EXROperation_Stroke::AddStroke(const DeepImageStroke::Config &config, shared_ptr<const DeepImage> image, shared_ptr<DeepImage> outputImage) const
+void EXROperation_Stroke::AddStroke(const DeepImageStroke::Config &config, shared_ptr<EXROperationState> state) const
 {
+    shared_ptr<const DeepImage> image = state->image;
+    shared_ptr<DeepImage> outputImage = state->GetOutputImage();
+
     // The user masks that control where we apply strokes and intersection lines:
     shared_ptr<const TypedDeepImageChannel<float>> strokeVisibilityMask;
     if(!config.strokeMaskChannel.empty())
@@ -492,18 +505,23 @@ void EXROperation_Stroke::AddStroke(const DeepImageStroke::Config &config, share
     shared_ptr<SimpleImage> intersectionPattern;
     if(config.strokeIntersections)
     {
-        intersectionPattern = CreateIntersectionPattern(config, sharedConfig, image, strokeVisibilityMask, intersectionVisibilityMask);
+        intersectionPattern = CreateIntersectionPattern(config, sharedConfig, image, *state->GetSampleVisibilities(),
+            strokeVisibilityMask, intersectionVisibilityMask);
 
         // This is just for diagnostics.
         if(intersectionPattern && !config.saveIntersectionPattern.empty())
-            SimpleImage::WriteImages(config.saveIntersectionPattern, { SimpleImage::EXRLayersToWrite(intersectionPattern) });
+            sharedConfig.outputSink->WriteImages(config.saveIntersectionPattern, { SimpleImage::EXRLayersToWrite(intersectionPattern) }, sharedConfig.writeOptions);
     }
 
+    // Find the closest sample (for our object IDs) to the camera for each point.  This is shared
+    // by both passes, and by other strokes on the same objects.
+    auto nearestSamples = state->GetNearestSamples(sharedConfig.GetIdChannel(image->header), config.objectIds);
+
     // Apply the regular stroke and the intersection stroke.
     if(config.strokeOutline)
-        ApplyStrokeUsingMask(config, sharedConfig, image, outputImage, strokeMask);
+        ApplyStrokeUsingMask(config, sharedConfig, image, outputImage, *nearestSamples, strokeMask);
     if(config.strokeIntersections && intersectionPattern)
-        ApplyStrokeUsingMask(config, sharedConfig, image, outputImage, intersectionPattern);
+        ApplyStrokeUsingMask(config, sharedConfig, image, outputImage, *nearestSamples, intersectionPattern);
 
     // Make sure the output image is sorted.
     DeepImageUtil::SortSamplesByDepth(outputImage);
@@ -611,6 +629,27 @@ void EXROperation_Stroke::AddChannels(shared_ptr<DeepImage> image, DeepFrameBuff
     }
 }
 
+void EXROperation_Stroke::GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+{
+    // Strokes add a new image, so this is exclusive, but we still declare the channels
+    // we read so channels nobody else needs can be freed.
+    dependencies.reads.insert(sharedConfig.GetIdChannel(image->header));
+    dependencies.reads.insert("rgba");
+    dependencies.reads.insert("Z");
+
+    // Intersections use P and N if they're present, even if they were only loaded by
+    // another operation.
+    if(strokeDesc.strokeIntersections)
+    {
+        dependencies.reads.insert("P");
+        dependencies.reads.insert("N");
+    }
+    if(!strokeDesc.strokeMaskChannel.empty())
+        dependencies.reads.insert(strokeDesc.strokeMaskChannel);
+    if(!strokeDesc.intersectionMaskChannel.empty())
+        dependencies.reads.insert(strokeDesc.intersectionMaskChannel);
+}
+
 
 /*
  * Based on http://weber.itn.liu.se/~stegu/aadist/
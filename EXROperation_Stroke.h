@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include <OpenEXR/ImathVec.h>
+#include <OpenEXR/ImfArray.h>
 #include "DeepImage.h"
 #include "EXROperation.h"
 
@@ -57,13 +58,18 @@ namespace DeepImageStroke
     // the shape and the radius of the stroke.
     float DistanceAndRadiusToAlpha(float distance, const Config &config);
 
+    // sampleVisibilities is the result of DeepImageUtil::GetSampleVisibilities for image.
     shared_ptr<SimpleImage> CreateIntersectionPattern(
         const DeepImageStroke::Config &config, const SharedConfig &sharedConfig,
 	shared_ptr<const DeepImage> image,
+	const Imf::Array2D<vector<float>> &sampleVisibilities,
 	shared_ptr<const TypedDeepImageChannel<float>> strokeMask,
 	shared_ptr<const TypedDeepImageChannel<float>> intersectionMask);
+
+    // nearestSamples is the result of DeepImageUtil::GetNearestSamples for config.objectIds.
     void ApplyStrokeUsingMask(const DeepImageStroke::Config &config, const SharedConfig &sharedConfig,
 	shared_ptr<const DeepImage> image, shared_ptr<DeepImage> outputImage,
+	const Imf::Array2D<int> &nearestSamples,
 	shared_ptr<SimpleImage> mask);
 }
 
@@ -74,9 +80,10 @@ public:
     EXROperation_Stroke(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> args);
     void Run(shared_ptr<EXROperationState> state) const;
     void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const;
 
 private:
-    void AddStroke(const DeepImageStroke::Config &config, shared_ptr<const DeepImage> image, shared_ptr<DeepImage> outputImage) const;
+    void AddStroke(const DeepImageStroke::Config &config, shared_ptr<EXROperationState> state) const;
 
     const SharedConfig &sharedConfig;
     DeepImageStroke::Config strokeDesc;
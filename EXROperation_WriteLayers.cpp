@@ -2,6 +2,8 @@
 #include "helpers.h"
 #include "DeepImageUtil.h"
 
+#include <atomic>
+
 using namespace Imf;
 using namespace Imath;
 
@@ -21,6 +23,10 @@ EXROperation_WriteLayers::EXROperation_WriteLayers(const SharedConfig &sharedCon
         {
             outputPattern = value;
         }
+        else if(arg == "multipart")
+        {
+            multipartPattern = value;
+        }
         else if(arg == "layer")
         {
             // id=name
@@ -63,6 +69,22 @@ EXROperation_WriteLayers::EXROperation_WriteLayers(const SharedConfig &sharedCon
             throw StringException("Unknown save-layers option: " + arg);
     }
 
+    // With --frames, every frame would write the same files, and with --frame-workers they'd
+    // write them at the same time.  With --multipart, the pattern only names parts, so only
+    // the multipart filename needs to change.
+    if(!sharedConfig.frames.empty())
+    {
+        auto checkPattern = [](string option, string pattern) {
+            if(pattern.find("<frame>") == string::npos && pattern.find("<inputname>") == string::npos)
+                throw StringException("--" + option + "=" + pattern + " would be written by every frame.  Include <frame> or <inputname> in the filename.");
+        };
+
+        if(!multipartPattern.empty())
+            checkPattern("multipart", multipartPattern);
+        else
+            checkPattern("filename-pattern", outputPattern);
+    }
+
     // Apply global masks to all layers.
     for(auto &maskDesc: globalMasks)
     {
@@ -92,6 +114,22 @@ void EXROperation_WriteLayers::AddChannels(shared_ptr<DeepImage> image, DeepFram
     image->AddChannelToFramebuffer<uint32_t>(sharedConfig.GetIdChannel(image->header), frameBuffer);
 }
 
+void EXROperation_WriteLayers::GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const
+{
+    // We only read the image.  Layers are reordered in a copy.
+    dependencies.exclusive = false;
+    dependencies.reads.insert(sharedConfig.GetIdChannel(image->header));
+    dependencies.reads.insert("rgba");
+    for(auto layerDesc: layerDescs)
+    {
+        for(auto maskDesc: layerDesc.masks)
+        {
+            dependencies.reads.insert(maskDesc.maskChannel);
+            dependencies.reads.insert(maskDesc.maskName);
+        }
+    }
+}
+
 void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
 {
     shared_ptr<DeepImage> image = state->image;
@@ -155,18 +193,25 @@ void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
         if(ordered)
             newImage->order = nextOrder++;
 
-        newImage->filename = MakeOutputFilename(*newImage.get());
+        newImage->filename = MakeOutputFilename(*newImage.get(), *state);
 
         return newImage;
     };
 
-    auto addLayer = [&](shared_ptr<OutputImage> outputImage, shared_ptr<SimpleImage> imageToAdd)
+    // Layers are flattened a block of rows at a time as they're written, so we never hold
+    // the whole flattened image for every layer in memory at once.
+    auto makeLayer = [&](SimpleImage::EXRLayersToWrite::RowSource rowSource)
     {
         // Copy all image attributes, except for built-in EXR headers that we shouldn't set.
-        DeepImageUtil::CopyLayerAttributes(image->header, imageToAdd->header);
+        Header header(image->width, image->height);
+        DeepImageUtil::CopyLayerAttributes(image->header, header);
+        return SimpleImage::EXRLayersToWrite(image->width, image->height, header, rowSource);
+    };
 
+    auto addLayer = [&](shared_ptr<OutputImage> outputImage, const SimpleImage::EXRLayersToWrite &layer)
+    {
         // Add it to the layer list to be written.
-        outputImage->layers.push_back(SimpleImage::EXRLayersToWrite(imageToAdd));
+        outputImage->layers.push_back(layer);
 
         return &outputImage->layers.back();
     };
@@ -178,18 +223,8 @@ void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
             maskNames.insert(maskDesc.maskName);
     shared_ptr<DeepImage> newImage = DeepImageUtil::OrderSamplesByLayer(image, collapsedId, layerOrder, maskNames);
 
-    // Separate the image into its layers.
-    map<int,shared_ptr<SimpleImage>> separatedLayers;
     shared_ptr<const TypedDeepImageChannel<V4f>> rgba = newImage->GetChannel<V4f>("rgba");
     shared_ptr<const TypedDeepImageChannel<uint32_t>> id = newImage->GetChannel<uint32_t>("id");
-    for(auto it: layerOrder)
-    {
-        // All we need to do now is blend samples with each object ID, ignoring
-        // the others.
-        int objectId = it.first;
-        shared_ptr<SimpleImage> layerImage = make_shared<SimpleImage>(image->width, image->height);
-        separatedLayers[objectId] = DeepImageUtil::CollapseEXR(newImage, id, rgba, nullptr, { objectId });
-    }
 
     for(auto layerDesc: layerDescsCopy)
     {
@@ -203,11 +238,16 @@ void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
 
         string layerName = layerDesc.layerName;
 
-        // Create an output image named "color", and extract the layer into it.
-        auto colorImageOutput = separatedLayers.at(layerDesc.objectId);
+        // Create an output image named "color", and extract the layer into it.  All we
+        // need to do is blend samples with this object ID, ignoring the others.
+        set<int> objectIds = { layerDesc.objectId };
+        auto colorImageOutput = makeLayer([newImage, id, rgba, objectIds](int startY, int endY, V4f *pixels) {
+            DeepImageUtil::CollapseEXRRows(newImage, id, rgba, nullptr, objectIds,
+                DeepImageUtil::CollapseMode_Normal, startY, endY, pixels);
+        });
 
         // If the color layer is completely empty, don't create it.
-        if(colorImageOutput->IsEmpty())
+        if(colorImageOutput.IsEmpty())
         {
             // Skip this order number, so filenames stay consistent.
             nextOrder++;
@@ -225,27 +265,30 @@ void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
                 continue;
 
             // Extract the mask.
-            shared_ptr<SimpleImage> maskOut;
+            SimpleImage::EXRLayersToWrite::RowSource maskSource;
             if(maskDesc.maskType == MaskDesc::MaskType_CompositedRGB)
             {
-                // Apply the mask to the image into maskOut.  Use CollapseMode_Visibility
-                // when creating masks.
-                maskOut = DeepImageUtil::CollapseEXR(newImage, id, rgba, mask,
-                    { layerDesc.objectId },
-                    DeepImageUtil::CollapseMode_Visibility);
+                // Apply the mask to the image.  Use CollapseMode_Visibility when creating masks.
+                maskSource = [newImage, id, rgba, mask, objectIds](int startY, int endY, V4f *pixels) {
+                    DeepImageUtil::CollapseEXRRows(newImage, id, rgba, mask, objectIds,
+                        DeepImageUtil::CollapseMode_Visibility, startY, endY, pixels);
+                };
             }
             else
             {
                 // Output an alpha mask for MaskType_Alpha and MaskType_EXRLayer.
-                maskOut = make_shared<SimpleImage>(newImage->width, newImage->height);
                 bool useAlpha = maskDesc.maskType != MaskDesc::MaskType_Greyscale;
                 auto A = newImage->GetAlphaChannel();
-                DeepImageUtil::ExtractMask(useAlpha, true, mask, A, collapsedId, layerDesc.objectId, maskOut);
+                int objectId = layerDesc.objectId;
+                maskSource = [useAlpha, mask, A, collapsedId, objectId](int startY, int endY, V4f *pixels) {
+                    DeepImageUtil::ExtractMaskRows(useAlpha, true, mask, A, collapsedId, objectId, startY, endY, pixels);
+                };
             }
+            auto maskOut = makeLayer(maskSource);
 
             // If the baked image is completely empty, don't create it.  As an exception,
             // we do output empty masks in MaskType_EXRLayer.
-            if(maskDesc.maskType != MaskDesc::MaskType_EXRLayer && maskOut->IsEmpty())
+            if(maskDesc.maskType != MaskDesc::MaskType_EXRLayer && maskOut.IsEmpty())
                 continue;
 
             if(maskDesc.maskType == MaskDesc::MaskType_EXRLayer)
@@ -265,16 +308,58 @@ void EXROperation_WriteLayers::Run(shared_ptr<EXROperationState> state) const
         }
     }
 
-    // Write the layers.
-    for(const auto &outputImage: outputImages)
+    // If more than one image has the same filename, only the last one would have been kept,
+    // so only write that one.  Otherwise, two threads would write the same file at once.
+    vector<shared_ptr<OutputImage>> imagesToWrite;
+    set<string> filenames;
+    for(auto it = outputImages.rbegin(); it != outputImages.rend(); ++it)
     {
-        printf("Writing %s\n", outputImage->filename.c_str());
-        SimpleImage::WriteImages(outputImage->filename, outputImage->layers);
+        if(filenames.insert((*it)->filename).second)
+            imagesToWrite.insert(imagesToWrite.begin(), *it);
+    }
+
+    if(!multipartPattern.empty())
+    {
+        // Write each output as a part, named after the filename it would have had.  Part names
+        // only use the basename, so files in different directories can end up with the same
+        // name, and MultiPartOutputFile requires names to be unique.
+        string filename = sharedConfig.GetFilename(state->SubstituteInputFilename(multipartPattern));
+        vector<SimpleImage::Part> parts;
+        map<string, string> partFilenames;
+        for(const auto &outputImage: imagesToWrite)
+        {
+            SimpleImage::Part part;
+            part.name = setExtension(basename(outputImage->filename), "");
+            part.layers = outputImage->layers;
+
+            auto inserted = partFilenames.insert(make_pair(part.name, outputImage->filename));
+            if(!inserted.second)
+                throw StringException(ssprintf("--multipart: %s and %s would both be written as the part \"%s\".  "
+                    "Part names come from the filename without its directory, so the filename pattern needs to "
+                    "make the names themselves different.",
+                    inserted.first->second.c_str(), outputImage->filename.c_str(), part.name.c_str()));
+
+            parts.push_back(part);
+        }
+
+        printf("Writing %s (%i parts)\n", filename.c_str(), (int) parts.size());
+        sharedConfig.outputSink->WriteMultiPartImage(filename, parts, sharedConfig.writeOptions);
+        return;
     }
+
+    // Write the layers.  Files are written in parallel, and OpenEXR uses its own threads to
+    // compress each file.  Print the filenames first, so the output is always in the same order.
+    for(const auto &outputImage: imagesToWrite)
+        printf("Writing %s\n", outputImage->filename.c_str());
+
+    ParallelFor((int) imagesToWrite.size(), [&](int begin, int end) {
+        for(int i = begin; i < end; ++i)
+            sharedConfig.outputSink->WriteImages(imagesToWrite[i]->filename, imagesToWrite[i]->layers, sharedConfig.writeOptions);
+    }, 1);
 }
 
 // Do simple substitutions on the output filename.
-string EXROperation_WriteLayers::MakeOutputFilename(const OutputImage &layer) const
+string EXROperation_WriteLayers::MakeOutputFilename(const OutputImage &layer, const EXROperationState &state) const
 {
     string outputName = outputPattern;
 
@@ -297,25 +382,17 @@ string EXROperation_WriteLayers::MakeOutputFilename(const OutputImage &layer) co
     // filename makes filenames sort in comp order, which can be convenient.
     outputName = subst(outputName, "<order>", ssprintf("%i", layer.order));
 
-    // <inputname>: the input filename, with the directory and ".exr" removed.
-    string inputName = sharedConfig.inputFilenames[0];
-    inputName = basename(inputName);
-    inputName = setExtension(inputName, "");
-    outputName = subst(outputName, "<inputname>", inputName);
+    outputName = state.SubstituteInputFilename(outputName);
 
-    // <frame>: the input filename's frame number, given a "abcdef.1234.exr" filename.
-    // It would be nice if there was an EXR attribute contained the frame number.
-    outputName = subst(outputName, "<frame>", GetFrameNumberFromFilename(sharedConfig.inputFilenames[0]));
-
-    static bool warned = false;
-    if(!warned && outputName == originalOutputName)
+    // This is atomic, since frames can be processed in parallel with --frame-workers.
+    static atomic<bool> warned(false);
+    if(outputName == originalOutputName && !warned.exchange(true))
     {
         // If the output filename hasn't changed, there are no substitutions in it, which
         // means we'll write a single file over and over.  That's probably not what was
         // wanted.
         fprintf(stderr, "Warning: output path \"%s\" doesn't contain any substitutions, so only one file will be written.\n", outputName.c_str());
         fprintf(stderr, "Try \"%s\" instead.\n", (outputName + "_<name>.exr").c_str());
-        warned = true;
     }
 
     outputName = sharedConfig.GetFilename(outputName);
@@ -323,20 +400,6 @@ string EXROperation_WriteLayers::MakeOutputFilename(const OutputImage &layer) co
     return outputName;
 }
 
-// Given a filename like "abcdef.1234.exr", return "1234".
-string EXROperation_WriteLayers::GetFrameNumberFromFilename(string s) const
-{
-    // abcdef.1234.exr -> abcdef.1234
-    s = setExtension(s, "");
-
-    auto pos = s.rfind(".");
-    if(pos == string::npos)
-        return "";
-
-    string frameString = s.substr(pos+1);
-    return frameString;
-}
-
 void EXROperation_WriteLayers::MaskDesc::ParseOptionsString(string optionsString)
 {
     vector<string> options;
@@ -15,12 +15,17 @@ public:
     EXROperation_WriteLayers(const SharedConfig &sharedConfig, string opt, vector<pair<string,string>> arguments);
 
     void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+    void GetDependencies(shared_ptr<const DeepImage> image, Dependencies &dependencies) const;
     void Run(shared_ptr<EXROperationState> state) const;
 
 private:
     const SharedConfig &sharedConfig;
     string outputPattern = "<inputname> <ordername> <layer>.exr";
 
+    // If set, write all outputs to a single multi-part EXR with this filename pattern,
+    // instead of separate files.  Part names come from outputPattern.
+    string multipartPattern;
+
     // This represents a single output file.
     struct OutputImage
     {
@@ -70,8 +75,7 @@ private:
     // A list of (dst, src) pairs to combine layers before writing them.
     vector<pair<int,int>> combines;
 
-    string MakeOutputFilename(const OutputImage &layer) const;
-    string GetFrameNumberFromFilename(string s) const;
+    string MakeOutputFilename(const OutputImage &layer, const EXROperationState &state) const;
 };
 
 #endif
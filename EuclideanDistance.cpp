@@ -1,10 +1,16 @@
 #include "EuclideanDistance.h"
+#include "helpers.h"
 
 #include <math.h>
 #include <vector>
 
+#if defined(HAVE_X86_SIMD)
+#include <smmintrin.h>
+#endif
+
 using namespace std;
 using namespace Imf;
+using EuclideanDistance::DistanceResult;
 
 /*
  * edtaa3()
@@ -39,23 +45,48 @@ using namespace Imf;
  *
  */
 
+namespace {
+    // Everything distaa3 needs to know about the edge pixel a candidate points to.  These
+    // are always read together, so they're interleaved to make each lookup a single cache
+    // line.  a is the mask value clamped to [0,1].
+    struct EdgeInfo
+    {
+        float a;
+        float gx, gy;
+    };
+}
 
 /*
  * Compute the local gradient at edge pixels using convolution filters.
  * The gradient is computed only at edge pixels. At other places in the
  * image, it is never used, and it's mostly zero anyway.
+ *
+ * This also stores the clamped mask value for every pixel.
  */
 static void computegradient(const Array2D<float> &mask,
-           int w, int h, float *gx, float *gy)
+           int w, int h, EdgeInfo *edges)
 {
     int i,j,k;
     float glength;
+
+    for(j = 0; j < h; j++) {
+        for(i = 0; i < w; i++) {
+            k = j*w + i;
+            float a = mask[j][i];
+            if(a > 1.0f) a = 1.0f;
+            if(a < 0.0f) a = 0.0f; // Clip grayscale values outside the range [0,1]
+            edges[k].a = a;
+            edges[k].gx = 0;
+            edges[k].gy = 0;
+        }
+    }
+
 #define SQRT2 1.4142136f
     for(j = 1; j < h-1; j++) {
         for(i = 1; i < w-1; i++) { // Avoid edges where the kernels would spill over
             k = j*w + i;
             if((mask[j][i] > 0.0) && (mask[j][i]<1.0)) { // Compute gradient for edge pixels only
-                gx[k] =
+                float gx =
                     - mask[j-1][i-1]
                     - SQRT2*
                       mask[j][i-1]
@@ -64,7 +95,7 @@ static void computegradient(const Array2D<float> &mask,
                     + SQRT2*
                       mask[j][i+1]
                     + mask[j+1][i+1];
-                gy[k] =
+                float gy =
                     - mask[j-1][i-1]
                     - SQRT2*
                       mask[j-1][i]
@@ -73,12 +104,14 @@ static void computegradient(const Array2D<float> &mask,
                     + SQRT2*
                       mask[j+1][i]
                     + mask[j+1][i+1];
-                glength = gx[k]*gx[k] + gy[k]*gy[k];
+                glength = gx*gx + gy*gy;
                 if(glength > 0.0) { // Avoid division by zero
                     glength = sqrt(glength);
-                    gx[k]=gx[k]/glength;
-                    gy[k]=gy[k]/glength;
+                    gx=gx/glength;
+                    gy=gy/glength;
                 }
+                edges[k].gx = gx;
+                edges[k].gy = gy;
             }
         }
     }
@@ -126,79 +159,187 @@ static float edgedf(float gx, float gy, float a)
     }
 }
 
-static float distaa3(
-        const Array2D<float> &mask,
-        const float *gximg, const float *gyimg, int w, int c, int xc, int yc, int xi, int yi)
+/*
+ * Return the distance from (x,y) to the edge pixel (sx,sy).  This is the same
+ * metric as edtaa2, except at edges (where the distance is 0), where the local
+ * gradient is used.
+ */
+static float distaa3(const EdgeInfo *edges, int w, int sx, int sy, int x, int y)
 {
-  float di, df, dx, dy, gx, gy, a;
-  
-  int closest = c-xc-yc*w; // Index to the edge pixel pointed to from c
-
-  int closestX = closest % w; // Index to the edge pixel pointed to from c
-  int closestY = closest / w; // Index to the edge pixel pointed to from c
-  a = mask[closestY][closestX];    // Grayscale value at the edge pixel
-  gx = gximg[closest]; // X gradient component at the edge pixel
-  gy = gyimg[closest]; // Y gradient component at the edge pixel
-  
-  if(a > 1.0) a = 1.0;
-  if(a < 0.0) a = 0.0; // Clip grayscale values outside the range [0,1]
-  if(a == 0.0) return 1000000.0; // Not an object pixel, return "very far" ("don't know yet")
-
-  dx = (float)xi;
-  dy = (float)yi;
+  float di, df, dx, dy;
+
+  const EdgeInfo &edge = edges[size_t(sy)*w + sx]; // The edge pixel we're measuring from
+  if(edge.a == 0.0) return 1000000.0; // Not an object pixel, return "very far" ("don't know yet")
+
+  dx = (float)(x - sx);
+  dy = (float)(y - sy);
   di = sqrt(dx*dx + dy*dy); // Length of integer vector, like a traditional EDT
   if(di==0) { // Use local gradient only at edges
       // Estimate based on local gradient only
-      df = edgedf(gx, gy, a);
+      df = edgedf(edge.gx, edge.gy, edge.a);
   } else {
       // Estimate gradient based on direction to edge (accurate for large di)
-      df = edgedf(dx, dy, a);
+      df = edgedf(dx, dy, edge.a);
   }
-  return di + df; // Same metric as edtaa2, except at edges (where di=0)
+  return di + df;
+}
+
+/*
+ * See if the edge pixel nearest to the neighbor at index c is closer to (x,y) (at index i)
+ * than the best we've found so far.  If it is, point (x,y) at it.
+ *
+ * Unlike the original edtaa3, we store the absolute coordinates of the nearest edge pixel
+ * rather than an offset to it, so the transform can write directly into DistanceResult.
+ */
+static inline void propagate(const EdgeInfo *edges, DistanceResult *d, int w,
+    size_t i, int x, int y, size_t c, float &olddist, int &changed)
+{
+    const float epsilon = 1e-3f;
+    const int sx = d[c].sx, sy = d[c].sy;
+    float newdist = distaa3(edges, w, sx, sy, x, y);
+    if(newdist < olddist-epsilon)
+    {
+        d[i].sx = sx;
+        d[i].sy = sy;
+        d[i].distance = newdist;
+        olddist = newdist;
+        changed = 1;
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+/*
+ * distaa3() for four candidate edge pixels at once, storing the distance from (x,y)
+ * to each (sx[n],sy[n]) in result[n].  This gives the same results as distaa3,
+ * including the double precision comparison in edgedf.
+ */
+TARGET_SSE41
+static void distaa3_x4(const EdgeInfo *edges, int w, const int *sx, const int *sy, int x, int y, float *result)
+{
+    const EdgeInfo &e0 = edges[size_t(sy[0])*w + sx[0]];
+    const EdgeInfo &e1 = edges[size_t(sy[1])*w + sx[1]];
+    const EdgeInfo &e2 = edges[size_t(sy[2])*w + sx[2]];
+    const EdgeInfo &e3 = edges[size_t(sy[3])*w + sx[3]];
+
+    // Build the vectors with set rather than loading from arrays, to avoid store forwarding stalls.
+    const __m128 va = _mm_setr_ps(e0.a, e1.a, e2.a, e3.a);
+    const __m128 vgx = _mm_setr_ps(e0.gx, e1.gx, e2.gx, e3.gx);
+    const __m128 vgy = _mm_setr_ps(e0.gy, e1.gy, e2.gy, e3.gy);
+    const __m128i vsx = _mm_setr_epi32(sx[0], sx[1], sx[2], sx[3]);
+    const __m128i vsy = _mm_setr_epi32(sy[0], sy[1], sy[2], sy[3]);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+
+    __m128 dx = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_set1_epi32(x), vsx));
+    __m128 dy = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_set1_epi32(y), vsy));
+    __m128 di = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+
+    // Use the local gradient at edges (where di is 0), and the direction to the edge elsewhere.
+    __m128 atEdge = _mm_cmpeq_ps(di, zero);
+    __m128 ux = _mm_blendv_ps(dx, vgx, atEdge);
+    __m128 uy = _mm_blendv_ps(dy, vgy, atEdge);
+
+    // edgedf(ux, uy, a).  If either component is zero, the linear approximation is used.
+    __m128 linear = _mm_or_ps(_mm_cmpeq_ps(ux, zero), _mm_cmpeq_ps(uy, zero));
+    __m128 linearResult = _mm_sub_ps(half, va);
+
+    __m128 glength = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(uy, uy)));
+    ux = _mm_andnot_ps(signMask, _mm_div_ps(ux, glength));
+    uy = _mm_andnot_ps(signMask, _mm_div_ps(uy, glength));
+
+    // Move to the first octant.
+    __m128 gx1 = _mm_max_ps(ux, uy);
+    __m128 gy1 = _mm_min_ps(ux, uy);
+
+    __m128 a1 = _mm_div_ps(_mm_mul_ps(half, gy1), gx1);
+    __m128 gsum = _mm_add_ps(gx1, gy1);
+    __m128 g2 = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.0f), gx1), gy1);
+    __m128 r1 = _mm_sub_ps(_mm_mul_ps(half, gsum), _mm_sqrt_ps(_mm_mul_ps(g2, va)));
+    __m128 r2 = _mm_mul_ps(_mm_sub_ps(half, va), gx1);
+    __m128 r3 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-0.5f), gsum), _mm_sqrt_ps(_mm_mul_ps(g2, _mm_sub_ps(one, va))));
+
+    // edgedf compares a < 1.0-a1 in double precision, so do the same.
+    const __m128d oned = _mm_set1_pd(1.0);
+    __m128d lessLow = _mm_cmplt_pd(_mm_cvtps_pd(va), _mm_sub_pd(oned, _mm_cvtps_pd(a1)));
+    __m128d lessHigh = _mm_cmplt_pd(_mm_cvtps_pd(_mm_movehl_ps(va, va)), _mm_sub_pd(oned, _mm_cvtps_pd(_mm_movehl_ps(a1, a1))));
+    __m128 lessThanOneMinusA1 = _mm_shuffle_ps(_mm_castpd_ps(lessLow), _mm_castpd_ps(lessHigh), _MM_SHUFFLE(2,0,2,0));
+
+    __m128 df = _mm_blendv_ps(r3, r2, lessThanOneMinusA1);
+    df = _mm_blendv_ps(df, r1, _mm_cmplt_ps(va, a1));
+    df = _mm_blendv_ps(df, linearResult, linear);
+
+    // Pixels that aren't object pixels are "very far".
+    __m128 dist = _mm_add_ps(di, df);
+    dist = _mm_blendv_ps(dist, _mm_set1_ps(1000000.0f), _mm_cmpeq_ps(va, zero));
+    _mm_storeu_ps(result, dist);
+}
+
+/*
+ * propagate() for four neighbors.  The distances are all calculated up front, then
+ * tested in order, which gives the same result as calling propagate for each.
+ */
+static inline void propagate4(const EdgeInfo *edges, DistanceResult *d, int w,
+    size_t i, int x, int y, const size_t *c, float &olddist, int &changed)
+{
+    const float epsilon = 1e-3f;
+    int sx[4], sy[4];
+    for(int n = 0; n < 4; ++n)
+    {
+        sx[n] = d[c[n]].sx;
+        sy[n] = d[c[n]].sy;
+    }
+
+    float newdist[4];
+    distaa3_x4(edges, w, sx, sy, x, y, newdist);
+
+    for(int n = 0; n < 4; ++n)
+    {
+        if(newdist[n] < olddist-epsilon)
+        {
+            d[i].sx = sx[n];
+            d[i].sy = sy[n];
+            d[i].distance = newdist[n];
+            olddist = newdist[n];
+            changed = 1;
+        }
+    }
 }
+#else
+static inline void propagate4(const EdgeInfo *edges, DistanceResult *d, int w,
+    size_t i, int x, int y, const size_t *c, float &olddist, int &changed)
+{
+    for(int n = 0; n < 4; ++n)
+        propagate(edges, d, w, i, x, y, c[n], olddist, changed);
+}
+#endif
 
-// Shorthand macro: add ubiquitous parameters dist, gx, gy, img and w and call distaa3()
-#define DISTAA(c,xc,yc,xi,yi) (distaa3(mask, gx, gy, w, c, xc, yc, xi, yi))
+// Shorthand macros: add ubiquitous parameters and call propagate() or propagate4()
+#define PROPAGATE(c) (propagate(edges, d, w, i, x, y, (c), olddist, changed))
+#define PROPAGATE4(c) (propagate4(edges, d, w, i, x, y, (c), olddist, changed))
 
-static void edtaa3(
-    const Array2D<float> &mask,
-    const float *gx, const float *gy, int w, int h, short *distx, short *disty, float *dist)
+// If UseSIMD is true, pixels with all neighbors test all of them at once with
+// propagate4.  The result is the same either way.
+template<bool UseSIMD>
+static void edtaa3(const Array2D<float> &mask, const EdgeInfo *edges, int w, int h, DistanceResult *d)
 {
-    int x, y, i, c;
-    int offset_u, offset_ur, offset_r, offset_rd,
-        offset_d, offset_dl, offset_l, offset_lu;
-    float olddist, newdist;
-    int cdistx, cdisty, newdistx, newdisty;
-    int changed;
-    float epsilon = 1e-3f;
-
-    /* Initialize index offsets for the current image width */
-    offset_u = -w;
-    offset_ur = -w+1;
-    offset_r = 1;
-    offset_rd = w+1;
-    offset_d = w;
-    offset_dl = w-1;
-    offset_l = -1;
-    offset_lu = -w-1;
+    int x, y, changed;
+    size_t i;
+    float olddist;
 
     /* Initialize the distance images */
-    for(x = 0; x < w; ++x) {
-        for(y = 0; y < h; ++y) {
-            i = y*w + x;
-            distx[i] = 0; // At first, all pixels point to
-            disty[i] = 0; // themselves as the closest known.
+    for(y = 0; y < h; ++y) {
+        for(x = 0; x < w; ++x) {
+            i = size_t(y)*w + x;
+            d[i].sx = x; // At first, all pixels point to
+            d[i].sy = y; // themselves as the closest known.
             float value = mask[y][x];
             if(value <= 0.0)
-            {
-                dist[i]= 1000000.0; // Big value, means "not set yet"
-            }
-            else { // if (value < 1.0) {
-                dist[i] = edgedf(gx[i], gy[i], value); // Gradient-assisted estimate
-            }
-            //else {
-                //dist[i]= 0.0; // Inside the object
-            //}
+                d[i].distance = 1000000.0; // Big value, means "not set yet"
+            else
+                d[i].distance = edgedf(edges[i].gx, edges[i].gy, value); // Gradient-assisted estimate
         }
     }
 
@@ -210,404 +351,107 @@ static void edtaa3(
         /* Scan rows, except first row */
         for(y=1; y<h; y++)
         {
-
-            /* move index to leftmost pixel of current row */
-            i = y*w;
-
             /* scan right, propagate distances from above & left */
-
-            /* Leftmost pixel is special, has no left neighbors */
-            olddist = dist[i];
-            if(olddist > 0) // If non-zero distance or not set yet
+            i = size_t(y)*w;
+            for(x=0; x<w; x++, i++)
             {
-                c = i + offset_u; // Index of candidate for testing
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_ur;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
-            }
-            i++;
-
-            /* Middle pixels have all neighbors */
-            for(x=1; x<w-1; x++, i++)
-            {
-                olddist = dist[i];
+                olddist = d[i].distance;
                 if(olddist <= 0) continue; // No need to update further
 
-                c = i+offset_l;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_lu;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_u;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_ur;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
-            }
-
-            /* Rightmost pixel of row is special, has no right neighbors */
-            olddist = dist[i];
-            if(olddist > 0) // If not already zero distance
-            {
-                c = i+offset_l;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_lu;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
+                if(UseSIMD && x > 0 && x < w-1)
                 {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
+                    const size_t candidates[4] = { i-1, i-w-1, i-w, i-w+1 };
+                    PROPAGATE4(candidates);
+                    continue;
                 }
 
-                c = i+offset_u;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty+1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
+                /* Leftmost pixel has no left neighbors, rightmost has no right neighbors */
+                if(x > 0)
                 {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
+                    PROPAGATE(i-1);   // left
+                    PROPAGATE(i-w-1); // up-left
                 }
+                PROPAGATE(i-w);       // up
+                if(x < w-1)
+                    PROPAGATE(i-w+1); // up-right
             }
 
-            /* Move index to second rightmost pixel of current row. */
-            /* Rightmost pixel is skipped, it has no right neighbor. */
-            i = y*w + w-2;
-
             /* scan left, propagate distance from right */
+            /* Rightmost pixel is skipped, it has no right neighbor. */
+            i = size_t(y)*w + w-2;
             for(x=w-2; x>=0; x--, i--)
             {
-                olddist = dist[i];
+                olddist = d[i].distance;
                 if(olddist <= 0) continue; // Already zero distance
 
-                c = i+offset_r;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
+                PROPAGATE(i+1);       // right
             }
         }
 
         /* Scan rows in reverse order, except last row */
         for(y=h-2; y>=0; y--)
         {
-            /* move index to rightmost pixel of current row */
-            i = y*w + w-1;
-
             /* Scan left, propagate distances from below & right */
-
-            /* Rightmost pixel is special, has no right neighbors */
-            olddist = dist[i];
-            if(olddist > 0) // If not already zero distance
-            {
-                c = i+offset_d;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_dl;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
-            }
-            i--;
-
-            /* Middle pixels have all neighbors */
-            for(x=w-2; x>0; x--, i--)
+            i = size_t(y)*w + w-1;
+            for(x=w-1; x>=0; x--, i--)
             {
-                olddist = dist[i];
+                olddist = d[i].distance;
                 if(olddist <= 0) continue; // Already zero distance
 
-                c = i+offset_r;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
+                if(UseSIMD && x > 0 && x < w-1)
                 {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
+                    const size_t candidates[4] = { i+1, i+w+1, i+w, i+w-1 };
+                    PROPAGATE4(candidates);
+                    continue;
                 }
 
-                c = i+offset_rd;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
+                if(x < w-1)
                 {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_d;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_dl;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
-            }
-            /* Leftmost pixel is special, has no left neighbors */
-            olddist = dist[i];
-            if(olddist > 0) // If not already zero distance
-            {
-                c = i+offset_r;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_rd;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx-1;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    olddist=newdist;
-                    changed = 1;
-                }
-
-                c = i+offset_d;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx;
-                newdisty = cdisty-1;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
+                    PROPAGATE(i+1);   // right
+                    PROPAGATE(i+w+1); // down-right
                 }
+                PROPAGATE(i+w);       // down
+                if(x > 0)
+                    PROPAGATE(i+w-1); // down-left
             }
 
-            /* Move index to second leftmost pixel of current row. */
+            /* scan right, propagate distance from left */
             /* Leftmost pixel is skipped, it has no left neighbor. */
-            i = y*w + 1;
+            i = size_t(y)*w + 1;
             for(x=1; x<w; x++, i++)
             {
-                /* scan right, propagate distance from left */
-                olddist = dist[i];
+                olddist = d[i].distance;
                 if(olddist <= 0) continue; // Already zero distance
 
-                c = i+offset_l;
-                cdistx = distx[c];
-                cdisty = disty[c];
-                newdistx = cdistx+1;
-                newdisty = cdisty;
-                newdist = DISTAA(c, cdistx, cdisty, newdistx, newdisty);
-                if(newdist < olddist-epsilon)
-                {
-                    distx[i]=newdistx;
-                    disty[i]=newdisty;
-                    dist[i]=newdist;
-                    changed = 1;
-                }
+                PROPAGATE(i-1);       // left
             }
         }
     }
     while(changed); // Sweep until no more updates are made
 }
 
-shared_ptr<Array2D<EuclideanDistance::DistanceResult>> EuclideanDistance::Calculate(int width, int height,
+void EuclideanDistance::Calculate(int width, int height, const Array2D<float> &mask, Array2D<DistanceResult> &result)
+{
+    if(result.height() != height || result.width() != width)
+        result.resizeErase(height, width);
+    if(width == 0 || height == 0)
+        return;
+
+    vector<EdgeInfo> edges(size_t(width)*height);
+    computegradient(mask, width, height, edges.data());
+
+    // The transform works directly on the result, so there's no conversion at the end.
+    if(GetCPUFeatures().sse41)
+        edtaa3<true>(mask, edges.data(), width, height, &result[0][0]);
+    else
+        edtaa3<false>(mask, edges.data(), width, height, &result[0][0]);
+}
+
+shared_ptr<Array2D<DistanceResult>> EuclideanDistance::Calculate(int width, int height,
     const Array2D<float> &mask)
 {
     shared_ptr<Array2D<DistanceResult>> result = make_shared<Array2D<DistanceResult>>(height, width);
-
-    vector<float> gx(height*width), gy(height*width);
-    computegradient(mask, width, height, gx.data(), gy.data());
-    
-    vector<float> Dout(width*height);
-    vector<short> xdist(height*width); // local data
-    vector<short> ydist(height*width);
-    edtaa3(mask, gx.data(), gy.data(), width, height, xdist.data(), ydist.data(), Dout.data());
-
-    for(int y=0; y<height; y++)
-    {
-        for(int x=0; x<width; x++)
-        {
-            int i = y*width + x;
-            float distance = Dout[y*width+x];
-
-            // Coordinates of the closest pixel:
-            int srcX = x - xdist[i];
-            int srcY = y - ydist[i];
-
-            auto &r = (*result)[y][x];
-            r.sx = srcX;
-            r.sy = srcY;
-            r.distance = distance;
-        }
-    }
-
+    Calculate(width, height, mask, *result);
     return result;
 }
 
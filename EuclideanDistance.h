@@ -8,11 +8,18 @@ using namespace std;
 
 namespace EuclideanDistance {
     // Calculate euclidean distance from each pixel to the nearest pixel where the mask is 0.
+    //
+    // sx and sy are the coordinates of that pixel.  These are full ints, so they're valid for
+    // any image size.
     struct DistanceResult {
         int sx, sy;
         float distance;
     };
 
+    // Calculate into result, which will be resized to width x height if needed.  This
+    // writes directly into result without any intermediate buffers.
+    void Calculate(int width, int height, const Imf::Array2D<float> &mask, Imf::Array2D<DistanceResult> &result);
+
     shared_ptr<Imf::Array2D<DistanceResult>> Calculate(int width, int height, const Imf::Array2D<float> &mask);
 }
 
@@ -0,0 +1,365 @@
+#include "JSON.h"
+#include "helpers.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+    // Objects and arrays are parsed recursively, so limit how deeply they can be nested,
+    // so a job like [[[[...]]]] can't run the server out of stack.
+    const int MaxDepth = 128;
+
+    class Parser
+    {
+    public:
+        Parser(const string &text_): text(text_) { }
+
+        JSONValue ParseDocument()
+        {
+            JSONValue result = ParseValue();
+            SkipWhitespace();
+            if(pos != text.size())
+                Error("Unexpected data after the end of the document");
+            return result;
+        }
+
+    private:
+        const string &text;
+        size_t pos = 0;
+        int depth = 0;
+
+        void Error(string message) const
+        {
+            throw StringException(ssprintf("JSON error at offset %i: %s", (int) pos, message.c_str()));
+        }
+
+        void SkipWhitespace()
+        {
+            while(pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+                pos++;
+        }
+
+        // Consume c if it's the next character, returning true if it was.
+        bool Accept(char c)
+        {
+            SkipWhitespace();
+            if(pos >= text.size() || text[pos] != c)
+                return false;
+            pos++;
+            return true;
+        }
+
+        void Expect(char c)
+        {
+            if(!Accept(c))
+                Error(ssprintf("Expected '%c'", c));
+        }
+
+        bool AcceptWord(const char *word)
+        {
+            size_t length = strlen(word);
+            if(text.compare(pos, length, word) != 0)
+                return false;
+            pos += length;
+            return true;
+        }
+
+        JSONValue ParseValue()
+        {
+            SkipWhitespace();
+            if(pos >= text.size())
+                Error("Unexpected end of document");
+
+            char c = text[pos];
+            if(c == '{' || c == '[')
+            {
+                if(depth >= MaxDepth)
+                    Error(ssprintf("Objects and arrays are nested more than %i deep", MaxDepth));
+
+                depth++;
+                JSONValue result = c == '{'? ParseObject():ParseArray();
+                depth--;
+                return result;
+            }
+            if(c == '"')
+                return JSONValue(ParseString());
+            if(c == '-' || (c >= '0' && c <= '9'))
+                return ParseNumber();
+            if(AcceptWord("true"))
+                return JSONValue(true);
+            if(AcceptWord("false"))
+                return JSONValue(false);
+            if(AcceptWord("null"))
+                return JSONValue();
+
+            Error(ssprintf("Unexpected character '%c'", c));
+            return JSONValue();
+        }
+
+        JSONValue ParseObject()
+        {
+            JSONValue result = JSONValue::Object();
+            Expect('{');
+            if(Accept('}'))
+                return result;
+
+            do {
+                SkipWhitespace();
+                if(pos >= text.size() || text[pos] != '"')
+                    Error("Expected a string key");
+                string key = ParseString();
+                Expect(':');
+                result.Set(key, ParseValue());
+            } while(Accept(','));
+
+            Expect('}');
+            return result;
+        }
+
+        JSONValue ParseArray()
+        {
+            JSONValue result = JSONValue::Array();
+            Expect('[');
+            if(Accept(']'))
+                return result;
+
+            do {
+                result.array.push_back(ParseValue());
+            } while(Accept(','));
+
+            Expect(']');
+            return result;
+        }
+
+        JSONValue ParseNumber()
+        {
+            // Find the extent of the number, then let strtod convert it.
+            size_t start = pos;
+            if(text[pos] == '-')
+                pos++;
+            auto skipDigits = [&] {
+                size_t digitsStart = pos;
+                while(pos < text.size() && text[pos] >= '0' && text[pos] <= '9')
+                    pos++;
+                if(pos == digitsStart)
+                    Error("Invalid number");
+            };
+
+            skipDigits();
+            if(pos < text.size() && text[pos] == '.')
+            {
+                pos++;
+                skipDigits();
+            }
+            if(pos < text.size() && (text[pos] == 'e' || text[pos] == 'E'))
+            {
+                pos++;
+                if(pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
+                    pos++;
+                skipDigits();
+            }
+
+            return JSONValue(strtod(text.substr(start, pos - start).c_str(), nullptr));
+        }
+
+        int ParseHexDigits()
+        {
+            if(pos + 4 > text.size())
+                Error("Invalid \\u escape");
+
+            int result = 0;
+            for(int i = 0; i < 4; ++i)
+            {
+                char c = text[pos++];
+                result *= 16;
+                if(c >= '0' && c <= '9') result += c - '0';
+                else if(c >= 'a' && c <= 'f') result += c - 'a' + 10;
+                else if(c >= 'A' && c <= 'F') result += c - 'A' + 10;
+                else Error("Invalid \\u escape");
+            }
+            return result;
+        }
+
+        static void AppendUTF8(string &output, int codepoint)
+        {
+            if(codepoint < 0x80)
+                output += char(codepoint);
+            else if(codepoint < 0x800)
+            {
+                output += char(0xC0 | (codepoint >> 6));
+                output += char(0x80 | (codepoint & 0x3F));
+            }
+            else if(codepoint < 0x10000)
+            {
+                output += char(0xE0 | (codepoint >> 12));
+                output += char(0x80 | ((codepoint >> 6) & 0x3F));
+                output += char(0x80 | (codepoint & 0x3F));
+            }
+            else
+            {
+                output += char(0xF0 | (codepoint >> 18));
+                output += char(0x80 | ((codepoint >> 12) & 0x3F));
+                output += char(0x80 | ((codepoint >> 6) & 0x3F));
+                output += char(0x80 | (codepoint & 0x3F));
+            }
+        }
+
+        string ParseString()
+        {
+            pos++; // "
+
+            string result;
+            while(1)
+            {
+                if(pos >= text.size())
+                    Error("Unterminated string");
+
+                char c = text[pos++];
+                if(c == '"')
+                    return result;
+                if(c != '\\')
+                {
+                    result += c;
+                    continue;
+                }
+
+                if(pos >= text.size())
+                    Error("Unterminated string");
+                c = text[pos++];
+                switch(c)
+                {
+                case '"': result += '"'; break;
+                case '\\': result += '\\'; break;
+                case '/': result += '/'; break;
+                case 'b': result += '\b'; break;
+                case 'f': result += '\f'; break;
+                case 'n': result += '\n'; break;
+                case 'r': result += '\r'; break;
+                case 't': result += '\t'; break;
+                case 'u':
+                {
+                    int codepoint = ParseHexDigits();
+
+                    // Combine UTF-16 surrogate pairs.
+                    if(codepoint >= 0xD800 && codepoint < 0xDC00 && text.compare(pos, 2, "\\u") == 0)
+                    {
+                        pos += 2;
+                        int low = ParseHexDigits();
+                        if(low < 0xDC00 || low >= 0xE000)
+                            Error("Invalid surrogate pair");
+                        codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    AppendUTF8(result, codepoint);
+                    break;
+                }
+                default:
+                    Error(ssprintf("Invalid escape '\\%c'", c));
+                }
+            }
+        }
+    };
+
+    string QuoteString(const string &s)
+    {
+        string result = "\"";
+        for(char c: s)
+        {
+            switch(c)
+            {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\b': result += "\\b"; break;
+            case '\f': result += "\\f"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if((unsigned char) c < 0x20)
+                    result += ssprintf("\\u%04x", c);
+                else
+                    result += c;
+            }
+        }
+        result += "\"";
+        return result;
+    }
+}
+
+JSONValue JSONValue::Parse(const string &text)
+{
+    Parser parser(text);
+    return parser.ParseDocument();
+}
+
+const JSONValue *JSONValue::Get(const string &key) const
+{
+    for(const auto &it: object)
+    {
+        if(it.first == key)
+            return &it.second;
+    }
+    return nullptr;
+}
+
+void JSONValue::Set(const string &key, JSONValue value)
+{
+    for(auto &it: object)
+    {
+        if(it.first == key)
+        {
+            it.second = value;
+            return;
+        }
+    }
+    object.emplace_back(key, value);
+}
+
+string JSONValue::ToString() const
+{
+    switch(type)
+    {
+    case Type_Null:
+        return "null";
+    case Type_Bool:
+        return boolean? "true":"false";
+    case Type_Number:
+        // JSON has no representation for infinity or NaN.
+        if(!isfinite(number))
+            return "null";
+        if(number == floor(number) && fabs(number) < 1e15)
+            return ssprintf("%.0f", number);
+        {
+            // Use the shortest of these that reads back as the same number.
+            string result = ssprintf("%.15g", number);
+            if(strtod(result.c_str(), nullptr) != number)
+                result = ssprintf("%.17g", number);
+            return result;
+        }
+    case Type_String:
+        return QuoteString(str);
+    case Type_Array:
+    {
+        string result = "[";
+        for(size_t i = 0; i < array.size(); ++i)
+        {
+            if(i > 0)
+                result += ",";
+            result += array[i].ToString();
+        }
+        return result + "]";
+    }
+    case Type_Object:
+    {
+        string result = "{";
+        for(size_t i = 0; i < object.size(); ++i)
+        {
+            if(i > 0)
+                result += ",";
+            result += QuoteString(object[i].first) + ":" + object[i].second.ToString();
+        }
+        return result + "}";
+    }
+    }
+    return "null";
+}
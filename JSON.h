@@ -0,0 +1,55 @@
+#ifndef JSON_h
+#define JSON_h
+
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// A minimal JSON value, used for --serve job descriptions and responses.  Objects keep
+// their keys in order.
+struct JSONValue
+{
+    enum Type
+    {
+        Type_Null,
+        Type_Bool,
+        Type_Number,
+        Type_String,
+        Type_Array,
+        Type_Object,
+    };
+
+    JSONValue() { }
+    JSONValue(bool value): type(Type_Bool), boolean(value) { }
+    JSONValue(double value): type(Type_Number), number(value) { }
+    JSONValue(int value): type(Type_Number), number(value) { }
+    JSONValue(string value): type(Type_String), str(value) { }
+    JSONValue(const char *value): type(Type_String), str(value) { }
+
+    static JSONValue Array() { JSONValue result; result.type = Type_Array; return result; }
+    static JSONValue Object() { JSONValue result; result.type = Type_Object; return result; }
+
+    // Parse a JSON document.  Throws StringException on syntax errors, or if objects and
+    // arrays are nested more than 128 deep.
+    static JSONValue Parse(const string &text);
+
+    // Return the value for key in an object, or null if this isn't an object or doesn't
+    // have the key.
+    const JSONValue *Get(const string &key) const;
+
+    // Set a key in an object, replacing it if it already exists.
+    void Set(const string &key, JSONValue value);
+
+    // Return the value as compact JSON, on a single line.
+    string ToString() const;
+
+    Type type = Type_Null;
+    bool boolean = false;
+    double number = 0;
+    string str;
+    vector<JSONValue> array;
+    vector<pair<string, JSONValue>> object;
+};
+
+#endif
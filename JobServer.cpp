@@ -0,0 +1,401 @@
+#include "JobServer.h"
+#include "DeepImage.h"
+#include "EXRFlatten.h"
+#include "OutputSink.h"
+#include "helpers.h"
+
+#include <chrono>
+#include <thread>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // Connections past this are refused, so clients can't start unlimited threads.
+    const int MaxConnections = 64;
+
+    // Jobs are small, so a line longer than this is a broken client.  Refuse it instead
+    // of buffering it forever.
+    const size_t MaxLineLength = 1024*1024;
+
+    // Write images to files like FileOutputSink, and remember the filenames to report
+    // back to the client.  Independent operations can write at the same time.
+    class RecordingOutputSink: public OutputSink
+    {
+    public:
+        void WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options) override
+        {
+            files.WriteImages(filename, layers, options);
+            Record(filename);
+        }
+
+        void WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options) override
+        {
+            files.WriteMultiPartImage(filename, parts, options);
+            Record(filename);
+        }
+
+        vector<string> GetFilenames()
+        {
+            lock_guard<mutex> lock(filenamesLock);
+            return filenames;
+        }
+
+    private:
+        void Record(string filename)
+        {
+            lock_guard<mutex> lock(filenamesLock);
+            filenames.push_back(filename);
+        }
+
+        FileOutputSink files;
+        mutex filenamesLock;
+        vector<string> filenames;
+    };
+
+    // Return the size and modification time of each file, so we can tell if a cached image
+    // is out of date.  Files that can't be read are -1.
+    vector<pair<int64_t, int64_t>> GetFileVersions(const vector<string> &filenames)
+    {
+        vector<pair<int64_t, int64_t>> result;
+        for(const string &filename: filenames)
+        {
+            struct stat st;
+            if(stat(filename.c_str(), &st) == -1)
+                result.emplace_back(-1, -1);
+            else
+                result.emplace_back((int64_t) st.st_size, (int64_t) st.st_mtime);
+        }
+        return result;
+    }
+
+    size_t GetImageMemoryUsage(shared_ptr<const DeepImage> image)
+    {
+        size_t result = sizeof(unsigned int) * image->width * image->height;
+        for(auto it: image->channels)
+            result += it.second->GetMemoryUsage();
+        return result;
+    }
+
+    vector<string> GetStringArray(const JSONValue &job, string key, bool required)
+    {
+        vector<string> result;
+        const JSONValue *value = job.Get(key);
+        if(value == nullptr)
+        {
+            if(required)
+                throw StringException("The job has no \"" + key + "\"");
+            return result;
+        }
+
+        if(value->type != JSONValue::Type_Array)
+            throw StringException("\"" + key + "\" must be an array of strings");
+        for(const JSONValue &item: value->array)
+        {
+            if(item.type != JSONValue::Type_String)
+                throw StringException("\"" + key + "\" must be an array of strings");
+            result.push_back(item.str);
+        }
+        return result;
+    }
+}
+
+JobServer::JobServer(vector<pair<string,string>> options_, size_t cacheBytes):
+    options(options_),
+    maxCacheBytes(cacheBytes)
+{
+    // These are added to every job before the job's own options, so they can only be global
+    // options.  Check them now, so mistakes are reported when the server starts.
+    SharedConfig sharedConfig;
+    for(auto it: options)
+    {
+        if(it.first == "input" || it.first == "frames" || it.first == "frame-workers")
+            throw StringException("--" + it.first + " can't be used with --serve.  Give inputs with each job.");
+        if(!sharedConfig.ParseOption(it.first, it.second))
+            throw StringException("Only global options can be used with --serve: --" + it.first);
+    }
+}
+
+shared_ptr<DeepImage> JobServer::GetImage(const EXRFlatten &flatten, const vector<string> &inputFilenames, bool &cached)
+{
+    vector<pair<int64_t, int64_t>> fileVersions = GetFileVersions(inputFilenames);
+
+    // Only hold the lock while looking at the cache.  Cached images are never modified, so
+    // they can be copied, and new images loaded, while other jobs use the cache.
+    shared_ptr<const DeepImage> cachedImage;
+    {
+        lock_guard<mutex> lock(cacheLock);
+        for(auto it = cache.begin(); it != cache.end(); ++it)
+        {
+            if(it->inputFilenames != inputFilenames)
+                continue;
+
+            if(it->fileVersions == fileVersions && flatten.CanProcess(it->image))
+            {
+                // Move this entry to the front, since it's the most recently used.
+                cache.splice(cache.begin(), cache, it);
+                cachedImage = it->image;
+                break;
+            }
+
+            // The files have changed, or this job needs channels the cached image doesn't
+            // have.  Discard it and load the image again for this job.
+            cacheBytes -= it->bytes;
+            cache.erase(it);
+            break;
+        }
+    }
+
+    if(cachedImage)
+    {
+        cached = true;
+        return cachedImage->Clone();
+    }
+
+    cached = false;
+    shared_ptr<DeepImage> image = flatten.Load(inputFilenames);
+
+    CacheEntry entry;
+    entry.inputFilenames = inputFilenames;
+    entry.fileVersions = fileVersions;
+    entry.image = image;
+    entry.bytes = GetImageMemoryUsage(image);
+
+    {
+        lock_guard<mutex> lock(cacheLock);
+
+        // Another job may have loaded the same files while we were loading them.  Replace
+        // its entry with ours.
+        for(auto it = cache.begin(); it != cache.end(); ++it)
+        {
+            if(it->inputFilenames == inputFilenames)
+            {
+                cacheBytes -= it->bytes;
+                cache.erase(it);
+                break;
+            }
+        }
+
+        cacheBytes += entry.bytes;
+        cache.push_front(entry);
+
+        // Evict the least recently used images until we're within the limit.  Always keep the
+        // image we just loaded, even if it's bigger than the whole cache, so it can be reused
+        // by the next job.
+        while(cacheBytes > maxCacheBytes && cache.size() > 1)
+        {
+            cacheBytes -= cache.back().bytes;
+            cache.pop_back();
+        }
+    }
+
+    return image->Clone();
+}
+
+JSONValue JobServer::RunJob(const JSONValue &job)
+{
+    auto startTime = chrono::steady_clock::now();
+
+    JSONValue response = JSONValue::Object();
+    try {
+        if(job.type != JSONValue::Type_Object)
+            throw StringException("A job must be a JSON object");
+
+        vector<string> inputFilenames = GetStringArray(job, "inputs", true);
+        if(inputFilenames.empty())
+            throw StringException("The job has no inputs");
+
+        // Run the server's global options, then the job's inputs and options, as if they
+        // were given on the commandline.
+        vector<pair<string,string>> jobOptions = options;
+        for(string filename: inputFilenames)
+            jobOptions.emplace_back("input", filename);
+        for(auto it: EXRFlatten::ParseArgs(GetStringArray(job, "options", false)))
+        {
+            // These change settings for the whole process, so they'd affect every job after
+            // this one.  They can only be given when starting the server.
+            if(it.first == "threads" || it.first == "no-simd")
+                throw StringException("--" + it.first + " can't be used in a job.  Give it when starting the server.");
+            jobOptions.push_back(it);
+        }
+
+        EXRFlatten flatten;
+        flatten.ParseOptions(jobOptions);
+        if(!flatten.sharedConfig.frames.empty())
+            throw StringException("--frames can't be used with --serve.  Send a job for each frame.");
+
+        // Jobs call Load and Process directly instead of Run, so set up OpenEXR's threads here.
+        EXRFlatten::SetupThreads();
+
+        auto sink = make_shared<RecordingOutputSink>();
+        flatten.SetOutputSink(sink);
+
+        bool cached = false;
+        shared_ptr<DeepImage> image = GetImage(flatten, inputFilenames, cached);
+        flatten.Process(image, inputFilenames);
+
+        JSONValue files = JSONValue::Array();
+        for(string filename: sink->GetFilenames())
+            files.array.push_back(filename);
+
+        response.Set("ok", true);
+        response.Set("files", files);
+        response.Set("cached", cached);
+    } catch(const exception &e) {
+        response.Set("ok", false);
+        response.Set("error", e.what());
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - startTime;
+    response.Set("seconds", elapsed.count());
+    return response;
+}
+
+#ifdef _WIN32
+void JobServer::Serve(string socketPath)
+{
+    throw StringException("--serve isn't supported on Windows");
+}
+
+void JobServer::HandleConnection(int fd)
+{
+}
+#else
+namespace {
+    // Write all of data to fd, returning false if the connection is closed.
+    bool WriteAll(int fd, const string &data)
+    {
+        for(size_t pos = 0; pos < data.size(); )
+        {
+            ssize_t written = write(fd, data.data() + pos, data.size() - pos);
+            if(written == -1 && errno == EINTR)
+                continue;
+            if(written <= 0)
+                return false;
+            pos += written;
+        }
+        return true;
+    }
+
+    string ErrorResponse(string error)
+    {
+        JSONValue response = JSONValue::Object();
+        response.Set("ok", false);
+        response.Set("error", error);
+        return response.ToString() + "\n";
+    }
+}
+
+void JobServer::Serve(string socketPath)
+{
+    // Don't exit if a client disconnects before we send its response.
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof(addr.sun_path))
+        throw StringException("Socket path is too long: " + socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    // Remove a socket left behind by a previous server.  Don't delete anything that isn't a socket.
+    struct stat st;
+    if(lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socketPath.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd == -1)
+        throw StringException(ssprintf("Error creating socket: %s", strerror(errno)));
+
+    if(::bind(listenFd, (sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenFd, SOMAXCONN) == -1)
+    {
+        int error = errno;
+        close(listenFd);
+        throw StringException(ssprintf("Error listening on %s: %s", socketPath.c_str(), strerror(error)));
+    }
+
+    printf("Listening on %s\n", socketPath.c_str());
+    fflush(stdout);
+
+    while(1)
+    {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if(fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            int error = errno;
+            close(listenFd);
+            throw StringException(ssprintf("Error accepting connection: %s", strerror(error)));
+        }
+
+        if(connections >= MaxConnections)
+        {
+            WriteAll(fd, ErrorResponse(ssprintf("Too many connections (%i)", MaxConnections)));
+            close(fd);
+            continue;
+        }
+
+        connections++;
+        thread([this, fd] {
+            HandleConnection(fd);
+            close(fd);
+            connections--;
+        }).detach();
+    }
+}
+
+void JobServer::HandleConnection(int fd)
+{
+    string buffer;
+    char data[4096];
+    while(1)
+    {
+        ssize_t bytes = read(fd, data, sizeof(data));
+        if(bytes == -1 && errno == EINTR)
+            continue;
+        if(bytes <= 0)
+            return;
+        buffer.append(data, bytes);
+
+        // Run each complete line as a job.
+        size_t end;
+        while((end = buffer.find('\n')) != string::npos)
+        {
+            string line = buffer.substr(0, end);
+            buffer.erase(0, end+1);
+            if(line.find_first_not_of(" \t\r") == string::npos)
+                continue;
+
+            string output;
+            try {
+                output = RunJob(JSONValue::Parse(line)).ToString() + "\n";
+            } catch(const exception &e) {
+                // The job wasn't valid JSON.
+                output = ErrorResponse(e.what());
+            }
+
+            if(!WriteAll(fd, output))
+                return;
+        }
+
+        // We can't find the start of the next job without reading the rest of this one,
+        // so close the connection.
+        if(buffer.size() > MaxLineLength)
+        {
+            WriteAll(fd, ErrorResponse(ssprintf("The job is longer than %i bytes", (int) MaxLineLength)));
+            return;
+        }
+    }
+}
+#endif
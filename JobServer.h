@@ -0,0 +1,81 @@
+#ifndef JobServer_h
+#define JobServer_h
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "JSON.h"
+
+class DeepImage;
+class EXRFlatten;
+
+// Run exrflatten as a long-running server with --serve, so jobs don't pay for starting
+// a process and reading their inputs each time.  Clients connect to a Unix socket and
+// send one JSON job per line.  Options are the same as on the commandline:
+//
+// {"inputs": ["render.exr"], "options": ["--save-layers", "--layer=1000=Object"]}
+//
+// A JSON response is sent back for each job, also on one line:
+//
+// {"ok": true, "files": ["render_Object.exr"], "cached": true, "seconds": 0.25}
+// {"ok": false, "error": "render.exr: Missing input channels: P"}
+//
+// Loaded images are kept in an LRU cache, so jobs that run different operations on the
+// same inputs don't read them again.  A cached image is reused if its files haven't
+// changed and it has the channels the new job needs.  Otherwise, it's loaded again.
+//
+// Each connection has its own thread, so jobs from different connections run at the same
+// time, sharing the --threads budget.  Jobs on one connection run in the order they arrive.
+class JobServer
+{
+public:
+    // options are global commandline options used by every job, like --output.  Cached
+    // images are evicted when they use more than cacheBytes.
+    JobServer(vector<pair<string,string>> options, size_t cacheBytes);
+
+    // Listen on socketPath and run jobs.  This only returns if there's an error.
+    void Serve(string socketPath);
+
+    // Run a job, and return its response.  This can be called directly to use the cache
+    // without a socket.
+    JSONValue RunJob(const JSONValue &job);
+
+private:
+    struct CacheEntry
+    {
+        vector<string> inputFilenames;
+
+        // The size and modification time of each input when it was read.
+        vector<pair<int64_t, int64_t>> fileVersions;
+
+        // The image as returned by Load.  Jobs process a copy.
+        shared_ptr<const DeepImage> image;
+        size_t bytes = 0;
+    };
+
+    // Return a copy of the image for inputFilenames, from the cache if possible.  cached is
+    // set to true if it came from the cache.  This can be called by several jobs at once.
+    shared_ptr<DeepImage> GetImage(const EXRFlatten &flatten, const vector<string> &inputFilenames, bool &cached);
+
+    void HandleConnection(int fd);
+
+    vector<pair<string,string>> options;
+
+    // Cached images, with the most recently used first.  These are protected by cacheLock.
+    mutex cacheLock;
+    list<CacheEntry> cache;
+    size_t cacheBytes = 0, maxCacheBytes = 0;
+
+    // The number of open connections, each with its own thread.
+    atomic<int> connections{0};
+};
+
+#endif
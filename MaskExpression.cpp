@@ -0,0 +1,682 @@
+#include "MaskExpression.h"
+#include "DeepImage.h"
+#include "DeepImageUtil.h"
+#include "helpers.h"
+
+#include <map>
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <OpenEXR/ImfChannelList.h>
+
+#if defined(HAVE_X86_SIMD)
+#include <xmmintrin.h>
+#endif
+
+using namespace Imf;
+using namespace Imath;
+
+struct MaskExpression::Node
+{
+    enum Type
+    {
+        Type_Number,
+        Type_Channel,
+        Type_Swizzle,
+        Type_Call,
+        Type_Binary,
+        Type_Negate,
+    };
+    Type type = Type_Number;
+
+    // Type_Number: the number.
+    float value = 0;
+
+    // Type_Channel: the channel name.  Type_Swizzle: the components, eg. "xyz".
+    // Type_Call: the function name.
+    string name;
+
+    // Type_Binary: the operator, + - * or /.
+    char op = 0;
+
+    // Type_Binary: the left and right side.  Type_Call: the arguments.  Type_Swizzle
+    // and Type_Negate: the value.
+    vector<shared_ptr<const Node>> args;
+};
+
+namespace {
+    typedef shared_ptr<const MaskExpression::Node> NodePtr;
+
+    // A simple recursive descent parser for expressions.
+    class Parser
+    {
+    public:
+        Parser(const string &str_): str(str_) { }
+
+        NodePtr Parse()
+        {
+            NodePtr result = ParseExpression();
+            SkipWhitespace();
+            if(pos != str.size())
+                Error("unexpected text");
+            return result;
+        }
+
+    private:
+        const string &str;
+        size_t pos = 0;
+
+        void Error(string message) const
+        {
+            throw StringException(ssprintf("Error in expression \"%s\" at position %i: %s",
+                str.c_str(), int(pos)+1, message.c_str()));
+        }
+
+        void SkipWhitespace()
+        {
+            while(pos < str.size() && isspace((unsigned char) str[pos]))
+                ++pos;
+        }
+
+        bool Accept(char c)
+        {
+            SkipWhitespace();
+            if(pos >= str.size() || str[pos] != c)
+                return false;
+            ++pos;
+            return true;
+        }
+
+        void Expect(char c)
+        {
+            if(!Accept(c))
+                Error(ssprintf("expected '%c'", c));
+        }
+
+        string ReadIdentifier()
+        {
+            SkipWhitespace();
+            size_t start = pos;
+            while(pos < str.size() && (isalnum((unsigned char) str[pos]) || str[pos] == '_'))
+                ++pos;
+            return str.substr(start, pos-start);
+        }
+
+        static NodePtr MakeNode(MaskExpression::Node::Type type, vector<NodePtr> args, string name = "", char op = 0)
+        {
+            auto node = make_shared<MaskExpression::Node>();
+            node->type = type;
+            node->args = args;
+            node->name = name;
+            node->op = op;
+            return node;
+        }
+
+        // expression: term (('+' | '-') term)*
+        NodePtr ParseExpression()
+        {
+            NodePtr node = ParseTerm();
+            while(1)
+            {
+                if(Accept('+'))
+                    node = MakeNode(MaskExpression::Node::Type_Binary, { node, ParseTerm() }, "", '+');
+                else if(Accept('-'))
+                    node = MakeNode(MaskExpression::Node::Type_Binary, { node, ParseTerm() }, "", '-');
+                else
+                    return node;
+            }
+        }
+
+        // term: unary (('*' | '/') unary)*
+        NodePtr ParseTerm()
+        {
+            NodePtr node = ParseUnary();
+            while(1)
+            {
+                if(Accept('*'))
+                    node = MakeNode(MaskExpression::Node::Type_Binary, { node, ParseUnary() }, "", '*');
+                else if(Accept('/'))
+                    node = MakeNode(MaskExpression::Node::Type_Binary, { node, ParseUnary() }, "", '/');
+                else
+                    return node;
+            }
+        }
+
+        // unary: ('-' | '+') unary | postfix
+        NodePtr ParseUnary()
+        {
+            if(Accept('-'))
+                return MakeNode(MaskExpression::Node::Type_Negate, { ParseUnary() });
+            if(Accept('+'))
+                return ParseUnary();
+            return ParsePostfix();
+        }
+
+        // postfix: primary ('.' swizzle)*
+        NodePtr ParsePostfix()
+        {
+            NodePtr node = ParsePrimary();
+            while(Accept('.'))
+            {
+                string components = ReadIdentifier();
+                if(components.empty())
+                    Error("expected components after '.'");
+                node = MakeNode(MaskExpression::Node::Type_Swizzle, { node }, components);
+            }
+            return node;
+        }
+
+        // primary: number | '(' expression ')' | function '(' arguments ')' | channel
+        NodePtr ParsePrimary()
+        {
+            SkipWhitespace();
+            if(pos >= str.size())
+                Error("unexpected end of expression");
+
+            if(Accept('('))
+            {
+                NodePtr node = ParseExpression();
+                Expect(')');
+                return node;
+            }
+
+            char c = str[pos];
+            if(isdigit((unsigned char) c) || c == '.')
+            {
+                const char *start = str.c_str() + pos;
+                char *end;
+                double value = strtod(start, &end);
+                if(end == start)
+                    Error("invalid number");
+                pos += end - start;
+
+                auto node = make_shared<MaskExpression::Node>();
+                node->type = MaskExpression::Node::Type_Number;
+                node->value = float(value);
+                return node;
+            }
+
+            string name = ReadIdentifier();
+            if(name.empty())
+                Error(ssprintf("unexpected '%c'", c));
+
+            // If this is followed by parentheses, it's a function call.  Otherwise, it's a channel.
+            if(!Accept('('))
+                return MakeNode(MaskExpression::Node::Type_Channel, {}, name);
+
+            vector<NodePtr> args;
+            if(!Accept(')'))
+            {
+                do {
+                    args.push_back(ParseExpression());
+                } while(Accept(','));
+                Expect(')');
+            }
+            return MakeNode(MaskExpression::Node::Type_Call, args, name);
+        }
+    };
+
+    void GetChannelsInNode(const MaskExpression::Node &node, set<string> &channels)
+    {
+        if(node.type == MaskExpression::Node::Type_Channel)
+            channels.insert(node.name);
+        for(auto arg: node.args)
+            GetChannelsInNode(*arg, channels);
+    }
+
+    // Compile nodes to a program.  Each value is a list of registers, one per component.
+    // Registers are never reused, so every instruction writes a new register.
+    class Compiler
+    {
+    public:
+        typedef MaskExpression::Program Program;
+        typedef vector<int> Value;
+
+        Compiler(const string &expression_, shared_ptr<DeepImage> image_, Program &program_):
+            expression(expression_), image(image_), program(program_)
+        {
+        }
+
+        Value Compile(const MaskExpression::Node &node)
+        {
+            switch(node.type)
+            {
+            case MaskExpression::Node::Type_Number:
+                return { Constant(node.value) };
+
+            case MaskExpression::Node::Type_Channel:
+                return Channel(node.name);
+
+            case MaskExpression::Node::Type_Swizzle:
+            {
+                Value value = Compile(*node.args[0]);
+                if(node.name.size() > 4)
+                    Error("too many components in ." + node.name);
+
+                Value result;
+                for(char c: node.name)
+                {
+                    int component = -1;
+                    switch(c)
+                    {
+                    case 'x': case 'r': component = 0; break;
+                    case 'y': case 'g': component = 1; break;
+                    case 'z': case 'b': component = 2; break;
+                    case 'w': case 'a': component = 3; break;
+                    default: Error("invalid component in ." + node.name);
+                    }
+
+                    if(component >= (int) value.size())
+                        Error(ssprintf(".%s used on a value with %i components", node.name.c_str(), (int) value.size()));
+                    result.push_back(value[component]);
+                }
+                return result;
+            }
+
+            case MaskExpression::Node::Type_Negate:
+                return Componentwise(Program::Op_Neg, { Compile(*node.args[0]) });
+
+            case MaskExpression::Node::Type_Binary:
+            {
+                Value a = Compile(*node.args[0]);
+                Value b = Compile(*node.args[1]);
+                switch(node.op)
+                {
+                case '+': return Componentwise(Program::Op_Add, { a, b });
+                case '-': return Componentwise(Program::Op_Sub, { a, b });
+                case '*': return Componentwise(Program::Op_Mul, { a, b });
+                case '/': return Componentwise(Program::Op_Div, { a, b });
+                }
+                break;
+            }
+
+            case MaskExpression::Node::Type_Call:
+                return Call(node);
+            }
+
+            Error("internal error");
+            return {};
+        }
+
+    private:
+        const string &expression;
+        shared_ptr<DeepImage> image;
+        Program &program;
+
+        // Registers for each constant and channel component, so each is only loaded once.
+        map<float, int> constantRegisters;
+        map<pair<string,int>, int> inputRegisters;
+
+        void Error(string message) const
+        {
+            throw StringException(ssprintf("Error in expression \"%s\": %s", expression.c_str(), message.c_str()));
+        }
+
+        int Constant(float value)
+        {
+            auto it = constantRegisters.find(value);
+            if(it != constantRegisters.end())
+                return it->second;
+
+            int reg = program.registerCount++;
+            program.constants.push_back(make_pair(reg, value));
+            constantRegisters[value] = reg;
+            return reg;
+        }
+
+        Value Channel(string name)
+        {
+            shared_ptr<const DeepImageChannel> channel = image->GetBaseChannel(name);
+            if(channel == nullptr)
+                Error("channel " + name + " doesn't exist");
+            if(channel->GetPixelType() != FLOAT && channel->GetPixelType() != UINT)
+                Error("channel " + name + " has an unsupported type");
+
+            Value result;
+            for(int component = 0; component < channel->GetElementCount(); ++component)
+            {
+                auto key = make_pair(name, component);
+                auto it = inputRegisters.find(key);
+                if(it != inputRegisters.end())
+                {
+                    result.push_back(it->second);
+                    continue;
+                }
+
+                Program::Input input;
+                input.channel = channel;
+                input.component = component;
+                input.reg = program.registerCount++;
+                program.inputs.push_back(input);
+                inputRegisters[key] = input.reg;
+                result.push_back(input.reg);
+            }
+            return result;
+        }
+
+        int Emit(Program::Op op, int a, int b = -1, int c = -1)
+        {
+            Program::Instruction instruction;
+            instruction.op = op;
+            instruction.dst = program.registerCount++;
+            instruction.a = a;
+            instruction.b = b;
+            instruction.c = c;
+            program.instructions.push_back(instruction);
+            return instruction.dst;
+        }
+
+        // Apply op to each component of args.  Single values are applied to every component,
+        // so vec3 * float multiplies each component by the float.
+        Value Componentwise(Program::Op op, vector<Value> args)
+        {
+            int size = 1;
+            for(const Value &arg: args)
+                size = max(size, (int) arg.size());
+            for(const Value &arg: args)
+            {
+                if(arg.size() != 1 && arg.size() != size)
+                    Error(ssprintf("can't combine values with %i and %i components", (int) arg.size(), size));
+            }
+
+            auto component = [&](int arg, int i) {
+                if(arg >= (int) args.size())
+                    return -1;
+                return args[arg].size() == 1? args[arg][0]:args[arg][i];
+            };
+
+            Value result;
+            for(int i = 0; i < size; ++i)
+                result.push_back(Emit(op, component(0, i), component(1, i), component(2, i)));
+            return result;
+        }
+
+        Value Dot(const Value &a, const Value &b)
+        {
+            if(a.size() != b.size())
+                Error(ssprintf("dot() of values with %i and %i components", (int) a.size(), (int) b.size()));
+
+            int result = Emit(Program::Op_Mul, a[0], b[0]);
+            for(int i = 1; i < (int) a.size(); ++i)
+                result = Emit(Program::Op_Add, result, Emit(Program::Op_Mul, a[i], b[i]));
+            return { result };
+        }
+
+        Value Call(const MaskExpression::Node &node)
+        {
+            const string &name = node.name;
+            vector<Value> args;
+            for(auto arg: node.args)
+                args.push_back(Compile(*arg));
+
+            auto checkArgs = [&](int count) {
+                if(args.size() != count)
+                    Error(ssprintf("%s() takes %i arguments", name.c_str(), count));
+            };
+
+            if(name == "min" || name == "max")
+            {
+                checkArgs(2);
+                return Componentwise(name == "min"? Program::Op_Min:Program::Op_Max, args);
+            }
+            else if(name == "abs" || name == "sqrt")
+            {
+                checkArgs(1);
+                return Componentwise(name == "abs"? Program::Op_Abs:Program::Op_Sqrt, args);
+            }
+            else if(name == "clamp")
+            {
+                // clamp(x, low, high)
+                checkArgs(3);
+                Value low = Componentwise(Program::Op_Max, { args[0], args[1] });
+                return Componentwise(Program::Op_Min, { low, args[2] });
+            }
+            else if(name == "smoothstep")
+            {
+                // smoothstep(edge0, edge1, x)
+                checkArgs(3);
+                return Componentwise(Program::Op_Smoothstep, args);
+            }
+            else if(name == "mix")
+            {
+                // mix(a, b, t) = a + (b-a)*t
+                checkArgs(3);
+                Value delta = Componentwise(Program::Op_Sub, { args[1], args[0] });
+                Value scaled = Componentwise(Program::Op_Mul, { delta, args[2] });
+                return Componentwise(Program::Op_Add, { args[0], scaled });
+            }
+            else if(name == "dot")
+            {
+                checkArgs(2);
+                return Dot(args[0], args[1]);
+            }
+            else if(name == "length")
+            {
+                checkArgs(1);
+                return Componentwise(Program::Op_Sqrt, { Dot(args[0], args[0]) });
+            }
+            else if(name == "normalize")
+            {
+                checkArgs(1);
+                Value length = Componentwise(Program::Op_Sqrt, { Dot(args[0], args[0]) });
+                return Componentwise(Program::Op_Div, { args[0], length });
+            }
+            else if(name == "vec2" || name == "vec3" || name == "vec4")
+            {
+                int size = name[3] - '0';
+                Value result;
+                for(const Value &arg: args)
+                    result.insert(result.end(), arg.begin(), arg.end());
+
+                // vec3(1) is the same as vec3(1,1,1).
+                if(result.size() == 1)
+                    result.resize(size, result[0]);
+                if(result.size() != size)
+                    Error(ssprintf("%s() given %i components", name.c_str(), (int) result.size()));
+                return result;
+            }
+
+            Error("unknown function " + name + "()");
+            return {};
+        }
+    };
+}
+
+MaskExpression::MaskExpression(string expression_):
+    expression(expression_)
+{
+    Parser parser(expression);
+    root = parser.Parse();
+}
+
+set<string> MaskExpression::GetChannels() const
+{
+    set<string> result;
+    GetChannelsInNode(*root, result);
+    return result;
+}
+
+void MaskExpression::AddChannels(shared_ptr<DeepImage> image, DeepFrameBuffer &frameBuffer) const
+{
+    for(string name: GetChannels())
+    {
+        // Don't add channels that already exist, like rgba or other masks.
+        if(image->GetBaseChannel(name) != nullptr)
+            continue;
+
+        // Load the channel based on the number of channels in its layer.  If it's a UINT
+        // channel, like object IDs, load it as uint32_t, so other operations reading it
+        // as an ID can share it.
+        vector<string> channelsInLayer = DeepImageUtil::GetChannelsInLayer(image->header, name);
+        const Channel *exrChannel = channelsInLayer.size() == 1? image->header.channels().findChannel(channelsInLayer[0]):nullptr;
+        if(exrChannel != nullptr && exrChannel->type == UINT)
+            image->AddChannelToFramebuffer<uint32_t>(name, frameBuffer);
+        else if(channelsInLayer.size() == 3)
+            image->AddChannelToFramebuffer<V3f>(name, frameBuffer);
+        else if(channelsInLayer.size() == 4)
+            image->AddChannelToFramebuffer<V4f>(name, frameBuffer);
+        else
+            image->AddChannelToFramebuffer<float>(name, frameBuffer);
+    }
+}
+
+shared_ptr<const MaskExpression::Program> MaskExpression::Compile(shared_ptr<DeepImage> image) const
+{
+    auto program = make_shared<Program>();
+    Compiler compiler(expression, image, *program);
+    vector<int> result = compiler.Compile(*root);
+    if(result.size() != 1)
+        throw StringException(ssprintf("Error in expression \"%s\": the result has %i components, but a mask needs 1",
+            expression.c_str(), (int) result.size()));
+
+    program->resultRegister = result[0];
+    return program;
+}
+
+namespace {
+    // Samples are evaluated in batches of BatchSize.  Each register holds one value for each
+    // sample in the batch.
+    const int BatchSize = 256;
+
+    // Run one instruction on a whole batch.  The loops always cover the full batch, even if
+    // fewer samples are loaded, so their trip count is a constant multiple of the vector
+    // width and GCC's -O2 cost model will vectorize them.  Unused lanes hold stale values,
+    // and their results are ignored.
+    //
+    // Instructions always write to a new register, so dst never aliases an operand, and
+    // __restrict lets the compiler vectorize without runtime overlap checks.
+    void RunInstruction(MaskExpression::Program::Op op, float *__restrict dst,
+        const float *__restrict a, const float *__restrict b, const float *__restrict c)
+    {
+        typedef MaskExpression::Program Program;
+        switch(op)
+        {
+        case Program::Op_Add: for(int i = 0; i < BatchSize; ++i) dst[i] = a[i] + b[i]; break;
+        case Program::Op_Sub: for(int i = 0; i < BatchSize; ++i) dst[i] = a[i] - b[i]; break;
+        case Program::Op_Mul: for(int i = 0; i < BatchSize; ++i) dst[i] = a[i] * b[i]; break;
+        case Program::Op_Div: for(int i = 0; i < BatchSize; ++i) dst[i] = a[i] / b[i]; break;
+        case Program::Op_Min: for(int i = 0; i < BatchSize; ++i) dst[i] = b[i] < a[i]? b[i]:a[i]; break;
+        case Program::Op_Max: for(int i = 0; i < BatchSize; ++i) dst[i] = a[i] < b[i]? b[i]:a[i]; break;
+        case Program::Op_Neg: for(int i = 0; i < BatchSize; ++i) dst[i] = -a[i]; break;
+        case Program::Op_Abs: for(int i = 0; i < BatchSize; ++i) dst[i] = fabsf(a[i]); break;
+        case Program::Op_Sqrt:
+#if defined(HAVE_X86_SIMD)
+            // sqrtf can set errno, so the compiler won't vectorize it.  SSE is always available
+            // on x86, so this doesn't need a CPU check.
+            for(int i = 0; i < BatchSize; i += 4)
+                _mm_storeu_ps(dst + i, _mm_sqrt_ps(_mm_loadu_ps(a + i)));
+#else
+            for(int i = 0; i < BatchSize; ++i) dst[i] = sqrtf(a[i]);
+#endif
+            break;
+        case Program::Op_Smoothstep:
+#if defined(HAVE_X86_SIMD)
+            {
+                // GCC won't if-convert the clamp at -O2, so this is written with SSE.
+                const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+                const __m128 two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+                for(int i = 0; i < BatchSize; i += 4)
+                {
+                    __m128 edge0 = _mm_loadu_ps(a + i);
+                    __m128 t = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(c + i), edge0), _mm_sub_ps(_mm_loadu_ps(b + i), edge0));
+                    t = _mm_min_ps(one, _mm_max_ps(zero, t)); // NaN passes through, like min/max
+                    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t))));
+                }
+            }
+#else
+            for(int i = 0; i < BatchSize; ++i)
+            {
+                float t = (c[i] - a[i]) / (b[i] - a[i]);
+                t = min(max(t, 0.0f), 1.0f);
+                dst[i] = t*t*(3 - 2*t);
+            }
+#endif
+            break;
+        }
+    }
+}
+
+void MaskExpression::Program::Evaluate(int startY, int endY, TypedDeepImageChannel<float> &output) const
+{
+    // Registers are zeroed, so lanes past the end of a partial batch hold valid floats.
+    vector<float> registers(registerCount * BatchSize);
+    auto getRegister = [&registers](int reg) {
+        return reg == -1? nullptr:registers.data() + reg*BatchSize;
+    };
+
+    // Constant registers never change, so they only need to be filled once.
+    for(auto constant: constants)
+    {
+        float *reg = getRegister(constant.first);
+        fill(reg, reg + BatchSize, constant.second);
+    }
+
+    struct InputData
+    {
+        const char * const *pixels;
+        int stride, offset;
+        bool isUint;
+        float *reg;
+    };
+    vector<InputData> inputData;
+    for(const Input &input: inputs)
+    {
+        InputData data;
+        data.pixels = input.channel->GetSamplesBlind();
+        data.stride = input.channel->GetBytesPerSample();
+        data.offset = input.component * input.channel->GetBytesPerElement();
+        data.isUint = input.channel->GetPixelType() == UINT;
+        data.reg = getRegister(input.reg);
+        inputData.push_back(data);
+    }
+
+    // Batches can span rows, so each sample remembers its pixel.  pixel is the index of the
+    // pixel in the image, y*width + x.
+    size_t batchPixel[BatchSize];
+    int batchSample[BatchSize];
+    int count = 0;
+
+    float **outputPixels = (float **) output.GetSamplesBlind();
+
+    auto runBatch = [&] {
+        // Load inputs for each sample in the batch.
+        for(const InputData &input: inputData)
+        {
+            for(int i = 0; i < count; ++i)
+            {
+                const char *p = input.pixels[batchPixel[i]] + batchSample[i] * input.stride + input.offset;
+                input.reg[i] = input.isUint? float(*(const uint32_t *) p):*(const float *) p;
+            }
+        }
+
+        for(const Instruction &instruction: instructions)
+        {
+            RunInstruction(instruction.op, getRegister(instruction.dst),
+                getRegister(instruction.a), getRegister(instruction.b), getRegister(instruction.c));
+        }
+
+        const float *result = getRegister(resultRegister);
+        for(int i = 0; i < count; ++i)
+            outputPixels[batchPixel[i]][batchSample[i]] = result[i];
+        count = 0;
+    };
+
+    for(int y = startY; y < endY; y++)
+    {
+        for(int x = 0; x < output.width; x++)
+        {
+            size_t pixel = size_t(y) * output.width + x;
+            for(int s = 0; s < (int) output.sampleCount[y][x]; ++s)
+            {
+                batchPixel[count] = pixel;
+                batchSample[count] = s;
+                if(++count == BatchSize)
+                    runBatch();
+            }
+        }
+    }
+
+    if(count > 0)
+        runBatch();
+}
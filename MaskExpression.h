@@ -0,0 +1,99 @@
+#ifndef MaskExpression_h
+#define MaskExpression_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <set>
+using namespace std;
+
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+
+class DeepImage;
+class DeepImageChannel;
+template<typename T> class TypedDeepImageChannel;
+
+// A small expression language for creating masks from deep channels, used by
+// --create-mask=expr.  For example:
+//
+// clamp(dot(normalize(N), vec3(0,1,0)), 0, 1) * smoothstep(1000, 100, Z)
+//
+// Values are floats or vectors of up to 4 components.  Channels are referenced by name,
+// and vector components can be selected with swizzles, like rgba.a or P.xz.  Arithmetic
+// on a vector and a float applies the float to each component.
+//
+// Expressions are compiled to a flat list of instructions on scalar registers, with vectors
+// split into one register per component.  Each instruction runs over a whole batch of samples
+// at once, so the inner loops are vectorized.
+class MaskExpression
+{
+public:
+    struct Node;
+
+    // A compiled expression, which can be evaluated for an image.  This is created by Compile.
+    struct Program
+    {
+        // Evaluate the expression for every sample in rows [startY,endY), storing the results
+        // in output.  This can be called from multiple threads at once.  Batches span rows, so
+        // evaluate as many rows at once as possible.
+        void Evaluate(int startY, int endY, TypedDeepImageChannel<float> &output) const;
+
+        enum Op
+        {
+            Op_Add,
+            Op_Sub,
+            Op_Mul,
+            Op_Div,
+            Op_Min,
+            Op_Max,
+            Op_Neg,
+            Op_Abs,
+            Op_Sqrt,
+            Op_Smoothstep,
+        };
+
+        // dst = op(a, b, c).  Unused operands are -1.
+        struct Instruction
+        {
+            Op op;
+            int dst, a, b, c;
+        };
+
+        // A channel component that's loaded into a register for each batch.
+        struct Input
+        {
+            shared_ptr<const DeepImageChannel> channel;
+            int component;
+            int reg;
+        };
+
+        vector<Instruction> instructions;
+        vector<Input> inputs;
+
+        // Registers that hold a constant value.  These are never written by instructions.
+        vector<pair<int, float>> constants;
+
+        int registerCount = 0;
+        int resultRegister = 0;
+    };
+
+    // Parse an expression.  Throws StringException on syntax errors.
+    MaskExpression(string expression);
+
+    // Return the names of all channels read by the expression.
+    set<string> GetChannels() const;
+
+    // Add the channels read by this expression to frameBuffer, so they're loaded.  Channels
+    // that already exist in the image aren't added.
+    void AddChannels(shared_ptr<DeepImage> image, Imf::DeepFrameBuffer &frameBuffer) const;
+
+    // Compile the expression for the channels in image.  Throws StringException if a channel
+    // doesn't exist, or if the expression doesn't make sense for the channel types.
+    shared_ptr<const Program> Compile(shared_ptr<DeepImage> image) const;
+
+private:
+    string expression;
+    shared_ptr<const Node> root;
+};
+
+#endif
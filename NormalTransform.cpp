@@ -0,0 +1,104 @@
+#include "NormalTransform.h"
+#include "helpers.h"
+
+#include <limits>
+
+#if defined(HAVE_X86_SIMD)
+#include <smmintrin.h>
+#endif
+
+using namespace std;
+using namespace Imath;
+
+namespace
+{
+    void TransformNormalsScalar(const M44f &matrix, const V3f *input, V3f *output, int count)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            // We're working with normal maps, and Arnold doesn't always output normalized
+            // normals due to a bug, so normalize first.
+            V3f vec = input[i];
+            vec.normalize();
+            matrix.multDirMatrix(vec, output[i]);
+        }
+    }
+
+#if defined(HAVE_X86_SIMD)
+    // Transform vectors four at a time.  The vectors are transposed so each register holds
+    // one component of all four, and each operation is done in the same order as the scalar
+    // code so the results are identical.
+    TARGET_SSE41
+    void TransformNormalsSSE41(const M44f &matrix, const V3f *input, V3f *output, int count)
+    {
+        const __m128 m00 = _mm_set1_ps(matrix[0][0]), m01 = _mm_set1_ps(matrix[0][1]), m02 = _mm_set1_ps(matrix[0][2]);
+        const __m128 m10 = _mm_set1_ps(matrix[1][0]), m11 = _mm_set1_ps(matrix[1][1]), m12 = _mm_set1_ps(matrix[1][2]);
+        const __m128 m20 = _mm_set1_ps(matrix[2][0]), m21 = _mm_set1_ps(matrix[2][1]), m22 = _mm_set1_ps(matrix[2][2]);
+
+        // V3f::normalize uses a slower path for vectors this short to avoid underflow, and
+        // leaves zero-length vectors alone.  Vectors like these are handled by the scalar code.
+        const __m128 minLength2 = _mm_set1_ps(2 * numeric_limits<float>::min());
+
+        int i = 0;
+        for(; i + 4 <= count; i += 4)
+        {
+            // a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3
+            const float *in = (const float *) &input[i];
+            __m128 a = _mm_loadu_ps(in + 0);
+            __m128 b = _mm_loadu_ps(in + 4);
+            __m128 c = _mm_loadu_ps(in + 8);
+
+            __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,0,3,2)); // x2 y2 z2 x3
+            __m128 u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1,0,2,1)); // y0 z0 y1 z1
+            __m128 q = _mm_shuffle_ps(b, c, _MM_SHUFFLE(3,2,0,3)); // y2 y1 y3 z3
+            __m128 x = _mm_shuffle_ps(a, t, _MM_SHUFFLE(3,0,3,0));
+            __m128 y = _mm_shuffle_ps(u, q, _MM_SHUFFLE(2,0,2,0));
+            __m128 z = _mm_shuffle_ps(u, c, _MM_SHUFFLE(3,0,3,1));
+
+            __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+            if(_mm_movemask_ps(_mm_cmplt_ps(length2, minLength2)) != 0)
+            {
+                TransformNormalsScalar(matrix, &input[i], &output[i], 4);
+                continue;
+            }
+
+            __m128 length = _mm_sqrt_ps(length2);
+            x = _mm_div_ps(x, length);
+            y = _mm_div_ps(y, length);
+            z = _mm_div_ps(z, length);
+
+            __m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m00), _mm_mul_ps(y, m10)), _mm_mul_ps(z, m20));
+            __m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m01), _mm_mul_ps(y, m11)), _mm_mul_ps(z, m21));
+            __m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m02), _mm_mul_ps(y, m12)), _mm_mul_ps(z, m22));
+
+            // Transpose back.
+            __m128 xyLow = _mm_unpacklo_ps(rx, ry);  // x0 y0 x1 y1
+            __m128 xyHigh = _mm_unpackhi_ps(rx, ry); // x2 y2 x3 y3
+            __m128 zx0 = _mm_shuffle_ps(rz, xyLow, _MM_SHUFFLE(2,2,0,0));  // z0 z0 x1 x1
+            __m128 yz1 = _mm_shuffle_ps(xyLow, rz, _MM_SHUFFLE(1,1,3,3));  // y1 y1 z1 z1
+            __m128 zx2 = _mm_shuffle_ps(rz, xyHigh, _MM_SHUFFLE(2,2,2,2)); // z2 z2 x3 x3
+            __m128 yz3 = _mm_shuffle_ps(xyHigh, rz, _MM_SHUFFLE(3,3,3,3)); // y3 y3 z3 z3
+
+            float *out = (float *) &output[i];
+            _mm_storeu_ps(out + 0, _mm_shuffle_ps(xyLow, zx0, _MM_SHUFFLE(2,0,1,0)));
+            _mm_storeu_ps(out + 4, _mm_shuffle_ps(yz1, xyHigh, _MM_SHUFFLE(1,0,2,0)));
+            _mm_storeu_ps(out + 8, _mm_shuffle_ps(zx2, yz3, _MM_SHUFFLE(2,0,2,0)));
+        }
+
+        TransformNormalsScalar(matrix, &input[i], &output[i], count - i);
+    }
+#endif
+}
+
+void TransformNormals(const M44f &matrix, const V3f *input, V3f *output, int count)
+{
+#if defined(HAVE_X86_SIMD)
+    if(GetCPUFeatures().sse41)
+    {
+        TransformNormalsSSE41(matrix, input, output, count);
+        return;
+    }
+#endif
+
+    TransformNormalsScalar(matrix, input, output, count);
+}
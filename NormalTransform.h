@@ -0,0 +1,13 @@
+#ifndef NormalTransform_h
+#define NormalTransform_h
+
+#include <OpenEXR/ImathVec.h>
+#include <OpenEXR/ImathMatrix.h>
+
+// Normalize each of count vectors in input, transform it by matrix with multDirMatrix, and
+// store the result in output.  This gives the same results as calling normalize() and
+// multDirMatrix on each vector, but works on several vectors at once when SIMD is available.
+// input and output can be the same array.
+void TransformNormals(const Imath::M44f &matrix, const Imath::V3f *input, Imath::V3f *output, int count);
+
+#endif
@@ -0,0 +1,77 @@
+#include "OutputSink.h"
+
+#include <cstring>
+
+void FileOutputSink::WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options)
+{
+    SimpleImage::WriteImages(filename, layers, options);
+}
+
+void FileOutputSink::WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options)
+{
+    SimpleImage::WriteMultiPartImage(filename, parts, options);
+}
+
+void MemoryOStream::write(const char c[], int n)
+{
+    // &data[pos] is out of range if pos is at the end, so don't index it for empty writes.
+    if(n <= 0)
+        return;
+
+    // OpenEXR seeks back to fill in the line offset table, so this can overwrite data
+    // as well as append.
+    if(pos + n > (Imf::Int64) data.size())
+        data.resize(size_t(pos + n));
+    memcpy(&data[size_t(pos)], c, n);
+    pos += n;
+}
+
+void MemoryOutputSink::WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options)
+{
+    MemoryOStream stream(filename);
+    SimpleImage::WriteImages(stream, layers, options);
+    AddFile(filename, stream.data);
+}
+
+void MemoryOutputSink::WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options)
+{
+    MemoryOStream stream(filename);
+    SimpleImage::WriteMultiPartImage(stream, parts, options);
+    AddFile(filename, stream.data);
+}
+
+void MemoryOutputSink::AddFile(string filename, vector<char> &data)
+{
+    lock_guard<mutex> guard(lock);
+    files[filename].swap(data);
+}
+
+map<string, vector<char>> MemoryOutputSink::GetFiles() const
+{
+    lock_guard<mutex> guard(lock);
+    return files;
+}
+
+bool MemoryOutputSink::TakeFile(string filename, vector<char> &data)
+{
+    lock_guard<mutex> guard(lock);
+    auto it = files.find(filename);
+    if(it == files.end())
+        return false;
+
+    data.swap(it->second);
+    files.erase(it);
+    return true;
+}
+
+void CallbackOutputSink::WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options)
+{
+    SimpleImage::Part part;
+    part.layers = layers;
+    callback(filename, { part });
+}
+
+void CallbackOutputSink::WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options)
+{
+    callback(filename, parts);
+}
@@ -0,0 +1,95 @@
+#ifndef OutputSink_h
+#define OutputSink_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+using namespace std;
+
+#include <OpenEXR/ImfIO.h>
+
+#include "SimpleImage.h"
+
+// Where output images go.  Operations write their results through SharedConfig::outputSink
+// instead of to files directly.  By default this writes files, but programs embedding
+// exrflatten can keep images in memory, or receive the layers without encoding them at all.
+//
+// The filenames passed to sinks are the output paths that would be written, and their
+// extension selects the format.  Sinks may be called from multiple threads at once.
+class OutputSink
+{
+public:
+    virtual ~OutputSink() { }
+
+    virtual void WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options) = 0;
+    virtual void WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options) = 0;
+};
+
+// Write images to files.  This is the default.
+class FileOutputSink: public OutputSink
+{
+public:
+    void WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options) override;
+    void WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options) override;
+};
+
+// An OStream that writes to memory.
+class MemoryOStream: public Imf::OStream
+{
+public:
+    MemoryOStream(string filename): OStream(filename.c_str()) { }
+
+    void write(const char c[], int n) override;
+    Imf::Int64 tellp() override { return pos; }
+    void seekp(Imf::Int64 newPos) override { pos = newPos; }
+
+    // The data written so far.
+    vector<char> data;
+
+private:
+    Imf::Int64 pos = 0;
+};
+
+// Encode images to memory instead of writing files.  This saves writing and re-reading
+// files when the output is used right away.
+class MemoryOutputSink: public OutputSink
+{
+public:
+    void WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options) override;
+    void WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options) override;
+
+    // Return the encoded files written so far, by filename.
+    map<string, vector<char>> GetFiles() const;
+
+    // Remove and return a file, or return false if it hasn't been written.
+    bool TakeFile(string filename, vector<char> &data);
+
+private:
+    void AddFile(string filename, vector<char> &data);
+
+    mutable mutex lock;
+    map<string, vector<char>> files;
+};
+
+// Pass layers to a callback without encoding them.
+//
+// Streamed layers reference the image being processed, so they must be read during the
+// callback, with EXRLayersToWrite::GetRows.
+class CallbackOutputSink: public OutputSink
+{
+public:
+    // Single-part images are passed as one part with an empty name.
+    typedef function<void(string filename, const vector<SimpleImage::Part> &parts)> Callback;
+
+    CallbackOutputSink(Callback callback_): callback(callback_) { }
+
+    void WriteImages(string filename, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options) override;
+    void WriteMultiPartImage(string filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options) override;
+
+private:
+    Callback callback;
+};
+
+#endif
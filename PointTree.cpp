@@ -0,0 +1,120 @@
+#include "PointTree.h"
+#include "helpers.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+
+#include <OpenEXR/ImathBox.h>
+
+using namespace Imath;
+
+namespace
+{
+    // Ranges this small are scanned directly instead of being split further.
+    const int LeafSize = 8;
+}
+
+PointTree::PointTree(vector<V3f> points_):
+    points(move(points_))
+{
+    splitAxis.resize(points.size());
+    Build(0, (int) points.size());
+}
+
+void PointTree::Build(int begin, int end)
+{
+    if(end - begin <= LeafSize)
+        return;
+
+    // Split on the axis where the points are most spread out.
+    Box3f bounds;
+    for(int i = begin; i < end; ++i)
+        bounds.extendBy(points[i]);
+    int axis = bounds.majorAxis();
+
+    int mid = (begin + end) / 2;
+    nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end, [axis](const V3f &lhs, const V3f &rhs) {
+        return lhs[axis] < rhs[axis];
+    });
+    splitAxis[mid] = uint8_t(axis);
+
+    Build(begin, mid);
+    Build(mid + 1, end);
+}
+
+float PointTree::GetNearestDistanceSquared(V3f pos) const
+{
+    float bestDistanceSquared = numeric_limits<float>::infinity();
+    Search(0, (int) points.size(), pos, bestDistanceSquared);
+    return bestDistanceSquared;
+}
+
+void PointTree::Search(int begin, int end, const V3f &pos, float &bestDistanceSquared) const
+{
+    if(end - begin <= LeafSize)
+    {
+        for(int i = begin; i < end; ++i)
+            bestDistanceSquared = min(bestDistanceSquared, (points[i] - pos).length2());
+        return;
+    }
+
+    int mid = (begin + end) / 2;
+    const V3f &median = points[mid];
+    bestDistanceSquared = min(bestDistanceSquared, (median - pos).length2());
+
+    // Search the side pos is on first.  The other side only needs to be searched if the
+    // splitting plane is closer than the nearest point found so far.
+    int axis = splitAxis[mid];
+    float planeDistance = pos[axis] - median[axis];
+    if(planeDistance < 0)
+    {
+        Search(begin, mid, pos, bestDistanceSquared);
+        if(planeDistance*planeDistance < bestDistanceSquared)
+            Search(mid + 1, end, pos, bestDistanceSquared);
+    }
+    else
+    {
+        Search(mid + 1, end, pos, bestDistanceSquared);
+        if(planeDistance*planeDistance < bestDistanceSquared)
+            Search(begin, mid, pos, bestDistanceSquared);
+    }
+}
+
+vector<V3f> PointTree::ReadPointFile(string path)
+{
+    ifstream file(path);
+    if(!file)
+        throw StringException("Couldn't read point file: " + path);
+
+    vector<V3f> result;
+    string line;
+    int lineNumber = 0;
+    while(getline(file, line))
+    {
+        ++lineNumber;
+        replace(line.begin(), line.end(), ',', ' ');
+        replace(line.begin(), line.end(), '\t', ' ');
+        replace(line.begin(), line.end(), '\r', ' ');
+
+        vector<string> parts;
+        split(line, " ", parts);
+        if(parts.empty() || parts[0][0] == '#')
+            continue;
+
+        if(parts.size() != 3)
+            throw StringException(ssprintf("%s:%i: expected three coordinates", path.c_str(), lineNumber));
+
+        V3f point;
+        for(int i = 0; i < 3; ++i)
+        {
+            char *end;
+            point[i] = strtof(parts[i].c_str(), &end);
+            if(*end != 0)
+                throw StringException(ssprintf("%s:%i: invalid coordinate \"%s\"", path.c_str(), lineNumber, parts[i].c_str()));
+        }
+        result.push_back(point);
+    }
+
+    return result;
+}
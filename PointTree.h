@@ -0,0 +1,47 @@
+#ifndef PointTree_h
+#define PointTree_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+using namespace std;
+
+#include <OpenEXR/ImathVec.h>
+
+// A k-d tree for finding the nearest of a set of points.  This is used by distance masks
+// to measure the distance to a point cloud instead of a single point.
+//
+// The tree is stored implicitly: each range of points is split at its median, which is
+// stored in the middle of the range, with the points on each side in the two halves.
+// This needs no memory beyond the points themselves and one axis per point.
+class PointTree
+{
+public:
+    PointTree(vector<Imath::V3f> points);
+
+    bool empty() const { return points.empty(); }
+    int size() const { return (int) points.size(); }
+
+    // Return the points in the tree.  These are in tree order, not the order they were given.
+    const vector<Imath::V3f> &GetPoints() const { return points; }
+
+    // Return the squared distance from pos to the nearest point.  The tree must not be
+    // empty.  This can be called from multiple threads at once.
+    float GetNearestDistanceSquared(Imath::V3f pos) const;
+
+    // Read a list of points from a text file, with one point per line.  Coordinates can be
+    // separated by spaces, tabs or commas, and lines starting with # are ignored.  Throws
+    // StringException if the file can't be read or a line isn't a point.
+    static vector<Imath::V3f> ReadPointFile(string path);
+
+private:
+    void Build(int begin, int end);
+    void Search(int begin, int end, const Imath::V3f &pos, float &bestDistanceSquared) const;
+
+    vector<Imath::V3f> points;
+
+    // The axis each range was split on, stored at the index of its median.
+    vector<uint8_t> splitAxis;
+};
+
+#endif
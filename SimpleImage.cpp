@@ -1,168 +1,324 @@
 #include "SimpleImage.h"
+#include "NormalTransform.h"
 #include "helpers.h"
 
 #include <OpenEXR/ImfChannelList.h>
 #include <OpenEXR/ImfFrameBuffer.h>
 #include <OpenEXR/ImfOutputFile.h>
+#include <OpenEXR/ImfMultiPartOutputFile.h>
+#include <OpenEXR/ImfOutputPart.h>
+#include <OpenEXR/ImfPartType.h>
+#include <OpenEXR/ImfIO.h>
+#include <OpenEXR/half.h>
 
 #include <png.h>
 #include <zlib.h>
 
+#include <ctype.h>
+#include <math.h>
+
 #include <algorithm>
+#include <fstream>
+#include <mutex>
 using namespace std;
 
+#if defined(HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 using namespace Imf;
 using namespace Imath;
 
-SimpleImage::SimpleImage(int width_, int height_):
+SimpleImage::SimpleImage(int width_, int height_, int channels):
     header(width_, height_)
 {
     width = width_;
     height = height_;
-    data.resize(width*height, V4f(0,0,0,0));
+
+    // Masks only have an alpha plane.
+    for(int c = channels == 1? 3:0; c < 4; ++c)
+        planes[c].resize(width*height, 0.0f);
 }
 
-SimpleImage::SimpleImage(const SimpleImage &cpy)
+void SimpleImage::SetRows(int startY, int endY, const V4f *pixels)
 {
-    width = cpy.width;
-    height = cpy.height;
-    data = cpy.data;
-    header = cpy.header;
+    int offset = startY * width;
+    int count = (endY - startY) * width;
+    for(int c = IsMask()? 3:0; c < 4; ++c)
+    {
+        float *plane = planes[c].data() + offset;
+        for(int i = 0; i < count; ++i)
+            plane[i] = pixels[i][c];
+    }
 }
 
 void SimpleImage::SetColor(V4f color)
 {
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-            GetRGBA(x, y) = color;
-    }
+    for(int c = IsMask()? 3:0; c < 4; ++c)
+        fill(planes[c].begin(), planes[c].end(), color[c]);
 }
 
+// These only change color, so they do nothing for masks.
 void SimpleImage::LinearToSRGB()
 {
-    for(int y = 0; y < height; y++)
+    if(IsMask())
+        return;
+
+    const float *alpha = planes[3].data();
+    for(int c = 0; c < 3; ++c)
     {
-        for(int x = 0; x < width; ++x)
+        float *plane = planes[c].data();
+        for(int i = 0; i < width*height; ++i)
         {
-            int offset = y*width + x;
-            float alpha = data[offset].w;
-            for(int c = 0; c < 4; ++c)
-            {
-                float value = data[offset][c];
+            float value = plane[i];
 
-                if(c != 3)
-                {
-                    // Unpremultiply:
-                    if(alpha > 0.0001f)
-                        value /= alpha;
+            // Unpremultiply:
+            if(alpha[i] > 0.0001f)
+                value /= alpha[i];
 
-                    value = ::LinearToSRGB(value);
-                }
-                else
-                    value = 1;
-
-                data[offset][c] = value;
-            }
+            plane[i] = ::LinearToSRGB(value);
         }
     }
+
+    fill(planes[3].begin(), planes[3].end(), 1.0f);
 }
 
 void SimpleImage::SRGBToLinear()
 {
-    for(int y = 0; y < height; y++)
+    if(IsMask())
+        return;
+
+    const float *alpha = planes[3].data();
+    for(int c = 0; c < 3; ++c)
     {
-        for(int x = 0; x < width; ++x)
+        float *plane = planes[c].data();
+        for(int i = 0; i < width*height; ++i)
         {
-            int offset = y*width + x;
-            float alpha = data[offset].w;
-            for(int c = 0; c < 4; ++c)
-            {
-                float value = data[offset][c];
-
-                if(c != 3)
-                {
-                    // Premultiply:
-                    value *= alpha;
-
-                    value = ::SRGBToLinear(value);
-                }
+            // Premultiply:
+            float value = plane[i] * alpha[i];
 
-                data[offset][c] = value;
-            }
+            plane[i] = ::SRGBToLinear(value);
         }
     }
 }
 
 void SimpleImage::Premultiply()
 {
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; ++x)
-        {
-            V4f &value = GetRGBA(x, y);
+    if(IsMask())
+        return;
 
-            value.x *= value.w;
-            value.y *= value.w;
-            value.z *= value.w;
-        }
+    const float *alpha = planes[3].data();
+    for(int c = 0; c < 3; ++c)
+    {
+        float *plane = planes[c].data();
+        for(int i = 0; i < width*height; ++i)
+            plane[i] *= alpha[i];
     }
 }
 
 void SimpleImage::Unpremultiply()
 {
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; ++x)
-        {
-            V4f &value = GetRGBA(x, y);
-            if(value.w < 0.00001f)
-                continue;
+    if(IsMask())
+        return;
 
-            value.x /= value.w;
-            value.y /= value.w;
-            value.z /= value.w;
-        }
+    const float *alpha = planes[3].data();
+    for(int c = 0; c < 3; ++c)
+    {
+        float *plane = planes[c].data();
+        for(int i = 0; i < width*height; ++i)
+            plane[i] = alpha[i] < 0.00001f? plane[i]:(plane[i] / alpha[i]);
     }
 }
 
 void SimpleImage::TransformNormalMap(M44f matrix)
 {
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
+    if(IsMask())
+        return;
+
+    ParallelFor(height, [&](int startY, int endY) {
+        vector<V3f> row(width);
+        for(int y = startY; y < endY; y++)
         {
             // This is a 3-channel vector map encoded in a 4-channel RGBA image.
             // The alpha channel is unused and should be left unchanged.
-            V4f &value = GetRGBA(x, y);
-
-            V3f vec;
-            vec.x = value.x;
-            vec.y = value.y;
-            vec.z = value.z;
-
-            // We're working with normal maps, and Arnold doesn't always output normalized
-            // normals due to a bug, so normalize now.
-            vec.normalize();
-
-            V3f result;
-            matrix.multDirMatrix(vec, result);
-            value.x = vec.x;
-            value.y = vec.y;
-            value.z = vec.z;
+            float *r = &planes[0][y*width], *g = &planes[1][y*width], *b = &planes[2][y*width];
+            for(int x = 0; x < width; x++)
+                row[x] = V3f(r[x], g[x], b[x]);
+
+            TransformNormals(matrix, row.data(), row.data(), width);
+
+            for(int x = 0; x < width; x++)
+            {
+                r[x] = row[x].x;
+                g[x] = row[x].y;
+                b[x] = row[x].z;
+            }
         }
-    }
+    });
 }
 
 namespace {
-    void WritePNG(string filename, SimpleImage::EXRLayersToWrite layer)
+    // Lookup tables from int(value * (size-1)) of a linear value in [0,1] to an 8-bit or
+    // 16-bit sRGB value.  The 8-bit table gives the same result as FloatToInt(LinearToSRGB(value)).
+    //
+    // Near black, sRGB is 12.92 times steeper than linear, so the 16-bit table needs many
+    // more entries than 65536 for neighbouring entries to be less than one code apart.  With
+    // 2^20 entries, they're at most 0.81 codes apart.  It's calculated from the sRGB formula
+    // rather than from GetLinearToSRGBTable, which only has 65536 entries.
+    const vector<uint8_t> &GetSRGB8Table()
+    {
+        static const vector<uint8_t> table = [] {
+            const vector<float> &srgb = GetLinearToSRGBTable();
+            vector<uint8_t> result(srgb.size());
+            for(int i = 0; i < (int) srgb.size(); ++i)
+                result[i] = FloatToInt(min(max(srgb[i], 0.0f), 1.0f));
+            return result;
+        }();
+        return table;
+    }
+
+    const vector<uint16_t> &GetSRGB16Table()
+    {
+        static const vector<uint16_t> table = [] {
+            const int size = 1 << 20;
+            vector<uint16_t> result(size);
+            for(int i = 0; i < size; ++i)
+            {
+                double value = i / double(size - 1);
+                double srgb = value <= 0.0031308? value * 12.92:1.055*pow(value, 1/2.4) - 0.055;
+                result[i] = uint16_t(min(max(srgb, 0.0), 1.0) * 65535.0 + 0.5);
+            }
+            return result;
+        }();
+        return table;
+    }
+
+    inline void QuantizeAlpha(float alpha, uint8_t &output) { output = FloatToInt(min(max(alpha, 0.0f), 1.0f)); }
+    inline void QuantizeAlpha(float alpha, uint16_t &output) { output = uint16_t(min(max(alpha, 0.0f), 1.0f) * 65535.0f + 0.5f); }
+
+    // Convert pixels [x,width) of a row.  This is used for the whole row without SSE, and for
+    // the pixels left over after groups of 4 with it.
+    template<typename T>
+    void QuantizePixels(const float *const channels[4], int x, int width, const T *srgbTable, float tableScale, T *output)
     {
-        shared_ptr<const SimpleImage> image = layer.image;
+        for(; x < width; ++x)
+        {
+            float alpha = channels[3][x];
+            for(int c = 0; c < 3; ++c)
+            {
+                float value = channels[c][x];
+                if(alpha > 0.0001f)
+                    value /= alpha;
 
-        FILE *f = fopen(filename.c_str(), "wb");
-        if(!f)
-            throw StringException("Error opening output file.");
+                // Clamp, and make NaNs 0.
+                value = value > 0? min(value, 1.0f):0.0f;
+                output[x*4+c] = srgbTable[int(value * tableScale)];
+            }
+            QuantizeAlpha(alpha, output[x*4+3]);
+        }
+    }
 
+#if defined(HAVE_X86_SIMD)
+    // Unpremultiply and clamp 4 pixels at a time from each plane with SSE.  The table lookups
+    // are still done one at a time, since there's no SSE gather.
+    template<typename T>
+    TARGET_SSE41
+    void QuantizeRowSSE41(const float *const channels[4], int width, const T *srgbTable, float tableScale, T *output)
+    {
+        const __m128 minAlpha = _mm_set1_ps(0.0001f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(tableScale);
+        int x = 0;
+        for(; x + 4 <= width; x += 4)
+        {
+            __m128 alpha = _mm_loadu_ps(channels[3] + x);
+            __m128 hasAlpha = _mm_cmpgt_ps(alpha, minAlpha);
+            for(int c = 0; c < 3; ++c)
+            {
+                __m128 color = _mm_loadu_ps(channels[c] + x);
+                color = _mm_blendv_ps(color, _mm_div_ps(color, alpha), hasAlpha);
+
+                // _mm_max_ps returns the second argument if the first is NaN, so NaNs become 0.
+                color = _mm_min_ps(_mm_max_ps(color, zero), one);
+                __m128i index = _mm_cvttps_epi32(_mm_mul_ps(color, scale));
+
+                output[x*4+0+c] = srgbTable[_mm_extract_epi32(index, 0)];
+                output[x*4+4+c] = srgbTable[_mm_extract_epi32(index, 1)];
+                output[x*4+8+c] = srgbTable[_mm_extract_epi32(index, 2)];
+                output[x*4+12+c] = srgbTable[_mm_extract_epi32(index, 3)];
+            }
+
+            for(int i = 0; i < 4; ++i)
+                QuantizeAlpha(channels[3][x+i], output[(x+i)*4+3]);
+        }
+
+        QuantizePixels(channels, x, width, srgbTable, tableScale, output);
+    }
+#endif
+
+    // Convert a row of premultiplied linear pixels to unpremultiplied, interleaved sRGB for a PNG.
+    template<typename T>
+    void QuantizeRow(const float *const channels[4], int width, const T *srgbTable, float tableScale, T *output)
+    {
+#if defined(HAVE_X86_SIMD)
+        if(GetCPUFeatures().sse41)
+        {
+            QuantizeRowSSE41(channels, width, srgbTable, tableScale, output);
+            return;
+        }
+#endif
+
+        QuantizePixels(channels, 0, width, srgbTable, tableScale, output);
+    }
+
+    // Convert and write rows to a PNG.  Rows are converted in parallel in blocks, and
+    // each block is written after it's converted.
+    template<typename T>
+    void WritePNGRows(png_structp png, const SimpleImage::EXRLayersToWrite &layer, const vector<T> &srgbTable)
+    {
+        const int rowsPerBlock = 64;
+        const int width = layer.width;
+        const float tableScale = float(srgbTable.size() - 1);
+        SimpleImage::EXRLayersToWrite::RowBuffer rowBuffer;
+        vector<T> block(rowsPerBlock * width * 4);
+        vector<png_bytep> rows(rowsPerBlock);
+        for(int startY = 0; startY < layer.height; startY += rowsPerBlock)
+        {
+            int count = min(rowsPerBlock, layer.height - startY);
+            auto pixels = layer.GetRows(startY, startY + count, rowBuffer);
+            ParallelFor(count, [&](int begin, int end) {
+                for(int i = begin; i < end; ++i)
+                {
+                    const float *row[4];
+                    for(int c = 0; c < 4; ++c)
+                        row[c] = pixels.channels[c] + i * width;
+                    QuantizeRow(row, width, srgbTable.data(), tableScale, &block[i * width * 4]);
+                }
+            });
+
+            for(int i = 0; i < count; ++i)
+                rows[i] = (png_bytep) &block[i * width * 4];
+            png_write_rows(png, rows.data(), count);
+        }
+    }
+
+    // libpng callbacks to write to an OStream.  Exceptions can't be thrown through libpng,
+    // so errors are passed back with png_error.
+    void WritePNGData(png_structp png, png_bytep data, png_size_t length)
+    {
+        OStream *stream = (OStream *) png_get_io_ptr(png);
+        try {
+            stream->write((const char *) data, (int) length);
+        } catch(exception &) {
+            png_error(png, "Error writing output file.");
+        }
+    }
+
+    void FlushPNGData(png_structp png) { }
+
+    void WritePNG(OStream &stream, SimpleImage::EXRLayersToWrite layer, const SimpleImage::WriteOptions &options)
+    {
         png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
         if (!png)
             throw StringException("Error writing output file.");
@@ -174,120 +330,482 @@ namespace {
         if (setjmp(png_jmpbuf(png)))
             throw StringException("Error writing output file.");
 
-        png_init_io(png, f);
+        png_set_write_fn(png, &stream, WritePNGData, FlushPNGData);
 
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, image->width, image->height, 8,
+        // Output is RGBA format, with 8 or 16 bits per channel.
+        png_set_IHDR(png, info, layer.width, layer.height, options.png16Bit? 16:8,
             PNG_COLOR_TYPE_RGBA,
             PNG_INTERLACE_NONE,
             PNG_COMPRESSION_TYPE_DEFAULT,
             PNG_FILTER_TYPE_DEFAULT
         );
-        // XXX compression level for both png and exr
-        png_set_compression_level(png, Z_NO_COMPRESSION);
-        png_set_filter(png, 0, PNG_NO_FILTERS);
+        png_set_compression_level(png, options.pngCompressionLevel);
+
+        int filters = PNG_FILTER_NONE;
+        switch(options.pngFilter)
+        {
+        case SimpleImage::PNGFilter_None: filters = PNG_FILTER_NONE; break;
+        case SimpleImage::PNGFilter_Sub: filters = PNG_FILTER_SUB; break;
+        case SimpleImage::PNGFilter_Up: filters = PNG_FILTER_UP; break;
+        case SimpleImage::PNGFilter_Average: filters = PNG_FILTER_AVG; break;
+        case SimpleImage::PNGFilter_Paeth: filters = PNG_FILTER_PAETH; break;
+        case SimpleImage::PNGFilter_Adaptive: filters = PNG_ALL_FILTERS; break;
+        }
+        png_set_filter(png, 0, filters);
         png_write_info(png, info);
 
-        // Interleave the channels and output the data.
-        vector<uint8_t> row(image->width*4, 1);
-        for(int y = 0; y < image->height; y++)
+        if(options.png16Bit)
+        {
+            // PNG is big-endian.  Have libpng swap our native 16-bit values.
+            png_set_swap(png);
+            WritePNGRows(png, layer, GetSRGB16Table());
+        }
+        else
+            WritePNGRows(png, layer, GetSRGB8Table());
+
+        png_write_end(png, NULL);
+        png_destroy_write_struct(&png, &info);
+    }
+}
+
+namespace {
+#if defined(HAVE_X86_SIMD)
+    TARGET_F16C
+    void FloatToHalfF16C(const float *src, half *dst, int count)
+    {
+        int i = 0;
+        for(; i + 4 <= count; i += 4)
+        {
+            __m128i result = _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storel_epi64((__m128i *) (dst + i), result);
+        }
+
+        for(; i < count; ++i)
+            dst[i] = src[i];
+    }
+#endif
+
+    // Convert count floats to half floats.  This rounds the same way as half's constructor.
+    void FloatToHalf(const float *src, half *dst, int count)
+    {
+#if defined(HAVE_X86_SIMD)
+        if(GetCPUFeatures().f16c)
         {
-            for(int x = 0; x < image->width; ++x)
+            FloatToHalfF16C(src, dst, count);
+            return;
+        }
+#endif
+
+        for(int i = 0; i < count; ++i)
+            dst[i] = src[i];
+    }
+
+    // Half float images are converted and written this many scanlines at a time, so we never
+    // need a converted copy of the whole image.  This is a multiple of the number of lines
+    // every compression method compresses together, so OpenEXR always receives whole chunks
+    // that it can compress in parallel.
+    const int LinesPerBlock = 256;
+}
+
+namespace {
+    // Create the header for an EXR file or part containing layers.
+    Header MakeHeader(const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options)
+    {
+        // Use the first image's headers as a template.
+        Header header(layers[0].GetHeader());
+
+        PixelType pixelType = options.halfFloat? HALF:FLOAT;
+        for(const SimpleImage::EXRLayersToWrite &layer: layers)
+        {
+            for(string channel: layer.GetChannelNames())
+                header.channels().insert(channel, Channel(pixelType));
+        }
+
+        header.compression() = options.compression;
+        return header;
+    }
+
+    // Write the pixels of layers to file, which is an OutputFile or OutputPart created with
+    // a header from MakeHeader.
+    template<typename File>
+    void WriteLayerPixels(File &file, const vector<SimpleImage::EXRLayersToWrite> &layers, const SimpleImage::WriteOptions &options)
+    {
+        // Write a block of scanlines at a time.  Each layer's rows are read in place or
+        // generated into a buffer, and converted to half floats if needed.  This only keeps
+        // one block of each layer in memory at a time.
+        int height = layers[0].height;
+        vector<SimpleImage::EXRLayersToWrite::RowBuffer> rowBuffers(layers.size());
+        vector<vector<half>> halfBuffers(layers.size() * 4);
+        for(int startY = 0; startY < height; startY += LinesPerBlock)
+        {
+            int lines = min(LinesPerBlock, height - startY);
+
+            FrameBuffer frameBuffer;
+            for(int i = 0; i < (int) layers.size(); ++i)
             {
-                int offset = y*image->width + x;
-                float alpha = image->data[offset].w;
-                for(int c = 0; c < 4; ++c)
+                const SimpleImage::EXRLayersToWrite &layer = layers[i];
+                auto rows = layer.GetRows(startY, startY + lines, rowBuffers[i]);
+
+                // The slice bases are the address of pixel 0,0, which is before the buffer for
+                // blocks after the first.  OpenEXR only accesses the lines we're writing.
+                ptrdiff_t firstPixel = ptrdiff_t(startY) * layer.width;
+                const char *planes[4] = { nullptr, nullptr, nullptr, nullptr };
+                if(!options.halfFloat)
                 {
-                    float value = image->data[offset][c];
+                    for(int c: layer.GetChannelIndices())
+                        planes[c] = (const char *) (rows.channels[c] - firstPixel);
+                    layer.AddToFrameBuffer(frameBuffer, FLOAT, planes, sizeof(float));
+                    continue;
+                }
+
+                // Convert only the channels we're writing to half floats.
+                for(int c: layer.GetChannelIndices())
+                {
+                    vector<half> &buffer = halfBuffers[i*4 + c];
+                    buffer.resize(lines * layer.width);
+                    FloatToHalf(rows.channels[c], buffer.data(), lines * layer.width);
+                    planes[c] = (const char *) (buffer.data() - firstPixel);
+                }
+                layer.AddToFrameBuffer(frameBuffer, HALF, planes, sizeof(half));
+            }
 
-                    if(c != 3)
-                    {
-                        // Unpremultiply:
-                        if(alpha > 0.0001f)
-                            value /= alpha;
+            file.setFrameBuffer(frameBuffer);
+            file.writePixels(lines);
+        }
+    }
+}
 
-                        value = LinearToSRGB(value);
-                    }
+// Incremental writes:
+namespace {
+    // An OStream that hashes everything written to it, so we can hash a header the way
+    // it'll be written to the file.
+    class HashOStream: public OStream
+    {
+    public:
+        HashOStream(): OStream("hash") { }
+        void write(const char c[], int n) { hash = HashBytes(c, n, hash); pos += n; }
+        Int64 tellp() { return pos; }
+        void seekp(Int64 newPos) { pos = newPos; }
 
-                    // 32-bit -> 8-bit:
-                    value = min(max(value, 0.0f), 1.0f);
-                    uint8_t output = FloatToInt(value);
-                    row[x*4+c] = output;
-                }
+        uint64_t hash = 0;
+        Int64 pos = 0;
+    };
+
+    uint64_t HashHeader(const Header &header, uint64_t hash)
+    {
+        HashOStream stream;
+        stream.hash = hash;
+        header.writeTo(stream);
+        return stream.hash;
+    }
+
+    // Hash the pixels of each layer.  Layers with a RowSource are generated a block at a time,
+    // the same as when they're written.
+    uint64_t HashLayerPixels(const vector<SimpleImage::EXRLayersToWrite> &layers, uint64_t hash)
+    {
+        SimpleImage::EXRLayersToWrite::RowBuffer buffer;
+        for(const auto &layer: layers)
+        {
+            for(int startY = 0; startY < layer.height; startY += LinesPerBlock)
+            {
+                int endY = min(startY + LinesPerBlock, layer.height);
+                auto rows = layer.GetRows(startY, endY, buffer);
+                for(int c: layer.GetChannelIndices())
+                    hash = HashBytes(rows.channels[c], (endY - startY) * layer.width * sizeof(float), hash);
             }
-            png_write_row(png, row.data());
+        }
+        return hash;
+    }
+
+    // An OStream that writes to a file.
+    class FileOStream: public OStream
+    {
+    public:
+        FileOStream(string filename):
+            OStream(filename.c_str()),
+            file(filename, ios::binary)
+        {
+            if(!file)
+                throw StringException("Error opening output file: " + filename);
         }
 
-        png_write_end(png, NULL);
+        void write(const char c[], int n)
+        {
+            file.write(c, n);
+            if(!file)
+                throw StringException(string("Error writing output file: ") + fileName());
+        }
+
+        Int64 tellp() { return file.tellp(); }
+        void seekp(Int64 pos) { file.seekp(pos); }
+
+    private:
+        ofstream file;
+    };
+
+    bool IsPNG(const string &filename)
+    {
+        string extension = getExtension(filename);
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension == "png";
+    }
+
+    void CheckLayers(const string &filename, const vector<SimpleImage::EXRLayersToWrite> &layers)
+    {
+        if(layers.size() == 0)
+            throw StringException("Can't write an image with no layers.");
+        if(IsPNG(filename) && layers.size() > 1)
+            throw StringException("Can't write a PNG with multiple layers");
+    }
+
+    // Make the header for each part of a multi-part file.
+    vector<Header> MakePartHeaders(const string &filename, const vector<SimpleImage::Part> &parts, const SimpleImage::WriteOptions &options)
+    {
+        if(parts.size() == 0)
+            throw StringException("Can't write an image with no parts.");
+        if(IsPNG(filename))
+            throw StringException("Can't write a PNG with multiple parts");
+
+        vector<Header> headers;
+        for(const SimpleImage::Part &part: parts)
+        {
+            if(part.layers.size() == 0)
+                throw StringException("Can't write an image part with no layers.");
+
+            Header header = MakeHeader(part.layers, options);
+            header.setName(part.name);
+            header.setType(SCANLINEIMAGE);
+            headers.push_back(header);
+        }
+        return headers;
+    }
+
+    mutex writeStatsLock;
+    SimpleImage::WriteStats writeStats;
+
+    // Write filename with write().  If options.incremental is set, only do this if getHash
+    // returns a different hash than the last time the file was written.
+    //
+    // The hash is stored in filename.hash with the size of the file we wrote.  If the file
+    // has been replaced with one of a different size, we'll write it even if the hash matches.
+    void WriteIfChanged(string filename, const SimpleImage::WriteOptions &options,
+        function<uint64_t()> getHash, function<void()> write)
+    {
+        if(!options.incremental)
+        {
+            write();
+            return;
+        }
 
+        uint64_t hash = getHash();
+        string hashFilename = filename + ".hash";
+        int64_t existingSize = GetFileSize(filename);
+        if(existingSize >= 0)
+        {
+            unsigned long long savedHash = 0;
+            long long savedSize = -1;
+            FILE *f = fopen(hashFilename.c_str(), "r");
+            if(f != nullptr)
+            {
+                if(fscanf(f, "%llx %lld", &savedHash, &savedSize) != 2)
+                    savedSize = -1;
+                fclose(f);
+            }
+
+            if(savedHash == hash && savedSize == existingSize)
+            {
+                lock_guard<mutex> lock(writeStatsLock);
+                writeStats.filesSkipped++;
+                writeStats.bytesSkipped += existingSize;
+                return;
+            }
+        }
+
+        // Remove the old hash before writing, so if the write fails we won't think a
+        // partial file is up to date.
+        remove(hashFilename.c_str());
+
+        write();
+
+        int64_t size = GetFileSize(filename);
+        FILE *f = fopen(hashFilename.c_str(), "w");
+        if(f == nullptr)
+            throw StringException("Couldn't write " + hashFilename);
+        fprintf(f, "%016llx %lld\n", (unsigned long long) hash, (long long) size);
         fclose(f);
+
+        lock_guard<mutex> lock(writeStatsLock);
+        writeStats.filesWritten++;
+        writeStats.bytesWritten += size;
     }
 }
 
-void SimpleImage::WriteImages(string filename, vector<EXRLayersToWrite> layers)
+SimpleImage::WriteStats SimpleImage::GetWriteStats()
 {
-    if(layers.size() == 0)
-        throw StringException("Can't write an image with no layers.");
+    lock_guard<mutex> lock(writeStatsLock);
+    return writeStats;
+}
 
-    if(!stricmp(getExtension(filename).c_str(), "png"))
-    {
-        if(layers.size() > 1)
-            throw StringException("Can't write a PNG with multiple layers");
+void SimpleImage::WriteImages(string filename, vector<EXRLayersToWrite> layers, const WriteOptions &options)
+{
+    CheckLayers(filename, layers);
+
+    WriteIfChanged(filename, options, [&] {
+        if(!IsPNG(filename))
+            return HashLayerPixels(layers, HashHeader(MakeHeader(layers, options), 0));
+
+        // Hash the PNG settings along with the pixels.
+        int settings[] = { layers[0].width, layers[0].height, options.pngCompressionLevel, options.pngFilter, options.png16Bit };
+        return HashLayerPixels(layers, HashBytes(settings, sizeof(settings)));
+    }, [&] {
+        FileOStream stream(filename);
+        WriteImages(stream, layers, options);
+    });
+}
+
+void SimpleImage::WriteImages(OStream &stream, vector<EXRLayersToWrite> layers, const WriteOptions &options)
+{
+    CheckLayers(stream.fileName(), layers);
 
-        WritePNG(filename, layers[0]);
+    if(IsPNG(stream.fileName()))
+    {
+        WritePNG(stream, layers[0], options);
         return;
     }
 
-    // Use the first image's headers as a template.
-    Header headerCopy(layers[0].image->header);
+    OutputFile file(stream, MakeHeader(layers, options));
+    WriteLayerPixels(file, layers, options);
+}
+
+void SimpleImage::WriteMultiPartImage(string filename, vector<Part> parts, const WriteOptions &options)
+{
+    vector<Header> headers = MakePartHeaders(filename, parts, options);
+
+    WriteIfChanged(filename, options, [&] {
+        uint64_t hash = 0;
+        for(int i = 0; i < (int) parts.size(); ++i)
+            hash = HashLayerPixels(parts[i].layers, HashHeader(headers[i], hash));
+        return hash;
+    }, [&] {
+        FileOStream stream(filename);
+        WriteMultiPartImage(stream, parts, options);
+    });
+}
 
-    FrameBuffer frameBuffer;
+void SimpleImage::WriteMultiPartImage(OStream &stream, vector<Part> parts, const WriteOptions &options)
+{
+    vector<Header> headers = MakePartHeaders(stream.fileName(), parts, options);
 
-    for(const EXRLayersToWrite &layer: layers)
+    // Parts are written one at a time, since MultiPartOutputFile only lets one part write
+    // to the file at once.  The lines of each part are still compressed in parallel by
+    // OpenEXR's thread pool.
+    MultiPartOutputFile file(stream, headers.data(), (int) headers.size());
+    for(int i = 0; i < (int) parts.size(); ++i)
     {
-        shared_ptr<const SimpleImage> image = layer.image; 
+        OutputPart part(file, i);
+        WriteLayerPixels(part, parts[i].layers, options);
+    }
+}
 
-        // If we have a layer name, output eg. "layerName.R".  Otherwise, output just "R".
-        string layerPrefix = "";
-        if(!layer.layerName.empty())
-        {
-            layerPrefix = layer.layerName;
-            layerPrefix += ".";
-        }
+vector<string> SimpleImage::EXRLayersToWrite::GetChannelNames() const
+{
+    // If we have a layer name, output eg. "layerName.R".  Otherwise, output just "R".
+    string layerPrefix = "";
+    if(!layerName.empty())
+    {
+        layerPrefix = layerName;
+        layerPrefix += ".";
+    }
+
+    if(alphaOnly)
+        return { layerPrefix + "Y" };
+    else
+        return { layerPrefix + "R", layerPrefix + "G", layerPrefix + "B", layerPrefix + "A" };
+}
+
+vector<int> SimpleImage::EXRLayersToWrite::GetChannelIndices() const
+{
+    if(alphaOnly)
+        return { 3 };
+    else
+        return { 0, 1, 2, 3 };
+}
+
+void SimpleImage::EXRLayersToWrite::AddToFrameBuffer(FrameBuffer &frameBuffer, PixelType type, const char *const planes[4], size_t valueSize) const
+{
+    // Each channel is a contiguous slice of its own plane.
+    vector<string> channels = GetChannelNames();
+    vector<int> indices = GetChannelIndices();
+    for(int i = 0; i < (int) channels.size(); ++i)
+        frameBuffer.insert(channels[i], Slice(type, (char *) planes[indices[i]], valueSize, valueSize * width));
+}
 
-        if(layer.alphaOnly)
+SimpleImage::EXRLayersToWrite::Rows SimpleImage::EXRLayersToWrite::GetRows(int startY, int endY, RowBuffer &buffer) const
+{
+    Rows rows;
+    int offset = startY * width;
+    int count = (endY - startY) * width;
+    if(image)
+    {
+        rows.channels[3] = image->GetPlane(3) + offset;
+        if(!image->IsMask())
         {
-            headerCopy.channels().insert(layerPrefix + "Y", Channel(FLOAT));
-            frameBuffer.insert(layerPrefix + "Y", Slice(FLOAT, (char *) &(image->data[0].w), sizeof(V4f), sizeof(V4f) * image->width));
+            for(int c = 0; c < 3; ++c)
+                rows.channels[c] = image->GetPlane(c) + offset;
+            return rows;
         }
-        else
+
+        // Masks don't store color, so point the color channels at a plane of ones.
+        buffer.planes[0].assign(count, 1.0f);
+        for(int c = 0; c < 3; ++c)
+            rows.channels[c] = buffer.planes[0].data();
+        return rows;
+    }
+
+    // Generate the rows, and split them into planes.
+    buffer.pixels.resize(count);
+    for(int c = 0; c < 4; ++c)
+        buffer.planes[c].resize(count);
+
+    ParallelFor(endY - startY, [&](int begin, int end) {
+        rowSource(startY + begin, startY + end, &buffer.pixels[begin * width]);
+        for(int c = 0; c < 4; ++c)
         {
-            headerCopy.channels().insert(layerPrefix + "R", Channel(FLOAT));
-            headerCopy.channels().insert(layerPrefix + "G", Channel(FLOAT));
-            headerCopy.channels().insert(layerPrefix + "B", Channel(FLOAT));
-            headerCopy.channels().insert(layerPrefix + "A", Channel(FLOAT));
-
-            frameBuffer.insert(layerPrefix + "R", Slice(FLOAT, (char *) &(image->data[0].x), sizeof(V4f), sizeof(V4f) * image->width));
-            frameBuffer.insert(layerPrefix + "G", Slice(FLOAT, (char *) &(image->data[0].y), sizeof(V4f), sizeof(V4f) * image->width));
-            frameBuffer.insert(layerPrefix + "B", Slice(FLOAT, (char *) &(image->data[0].z), sizeof(V4f), sizeof(V4f) * image->width));
-            frameBuffer.insert(layerPrefix + "A", Slice(FLOAT, (char *) &(image->data[0].w), sizeof(V4f), sizeof(V4f) * image->width));
+            float *plane = buffer.planes[c].data();
+            for(int i = begin * width; i < end * width; ++i)
+                plane[i] = buffer.pixels[i][c];
         }
-    }
+    });
+
+    for(int c = 0; c < 4; ++c)
+        rows.channels[c] = buffer.planes[c].data();
+    return rows;
+}
 
-    // Use PIZ.  It's much faster to write than deflate.
-    headerCopy.compression() = PIZ_COMPRESSION;
+bool SimpleImage::EXRLayersToWrite::IsEmpty() const
+{
+    if(image)
+        return image->IsEmpty();
 
-    OutputFile file(filename.c_str(), headerCopy);
-    file.setFrameBuffer(frameBuffer);
-    file.writePixels(layers[0].image->height);
+    const int rowsPerBlock = 64;
+    RowBuffer buffer;
+    for(int startY = 0; startY < height; startY += rowsPerBlock)
+    {
+        int endY = min(startY + rowsPerBlock, height);
+        const float *alpha = GetRows(startY, endY, buffer).channels[3];
+        for(int i = 0; i < (endY - startY) * width; ++i)
+            if(alpha[i] > 0.0001)
+                return false;
+    }
+
+    return true;
 }
 
 bool SimpleImage::IsEmpty() const
 {
-    for(int y = 0; y < height; y++)
-        for(int x = 0; x < width; x++)
-            if(GetRGBA(x, y)[3] > 0.0001)
-                return false;
+    for(float alpha: planes[3])
+        if(alpha > 0.0001)
+            return false;
 
     return true;
 }
@@ -4,34 +4,63 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <OpenEXR/ImathVec.h>
 #include <OpenEXR/ImfHeader.h>
+#include <OpenEXR/ImfCompression.h>
+#include <OpenEXR/ImfFrameBuffer.h>
 #include <OpenEXR/ImathMatrix.h>
+#include <OpenEXR/ImfIO.h>
 
 using namespace std;
 
 // A simple container for an output EXR containing only RGBA data.
 //
+// Pixels are stored planar, with each channel in its own contiguous array, so per-channel
+// loops vectorize and each channel can be written to an EXR without striding.
+//
 // This can also be used to hold a mask, in which case the data will be
-// in A, and R, G, and B will be 1.
+// in A, and R, G, and B will be 1.  If the image is created with only one channel,
+// only A is stored.
 class SimpleImage
 {
 public:
-    vector<Imath::V4f> data;
     int width, height;
     Imf::Header header;
 
-    SimpleImage(int width, int height);
-    SimpleImage(const SimpleImage &cpy);
+    // Create an RGBA image, or a mask with only an alpha channel if channels is 1.
+    SimpleImage(int width, int height, int channels=4);
+
+    // Return true if this is a mask that only stores alpha.
+    bool IsMask() const { return planes[0].empty(); }
+
+    // Return a channel's plane of width*height values, or null for the color channels of a mask.
+    float *GetPlane(int channel) { return planes[channel].empty()? nullptr:planes[channel].data(); }
+    const float *GetPlane(int channel) const { return const_cast<SimpleImage *>(this)->GetPlane(channel); }
 
-    const Imath::V4f &GetRGBA(int x, int y) const { return const_cast<SimpleImage *>(this)->GetRGBA(x, y); }
+    Imath::V4f GetRGBA(int x, int y) const
+    {
+        const int pixelIdx = x + y*width;
+        float alpha = planes[3][pixelIdx];
+        if(IsMask())
+            return Imath::V4f(1, 1, 1, alpha);
+        return Imath::V4f(planes[0][pixelIdx], planes[1][pixelIdx], planes[2][pixelIdx], alpha);
+    }
 
-    Imath::V4f &GetRGBA(int x, int y)
+    // Set a pixel.  For masks, only alpha is stored.
+    void SetRGBA(int x, int y, Imath::V4f color)
     {
-	const int pixelIdx = x + y*width;
-	return data[pixelIdx];
+        const int pixelIdx = x + y*width;
+        planes[3][pixelIdx] = color.w;
+        if(IsMask())
+            return;
+        for(int c = 0; c < 3; ++c)
+            planes[c][pixelIdx] = color[c];
     }
 
+    // Set rows [startY,endY) from interleaved RGBA pixels.
+    void SetRows(int startY, int endY, const Imath::V4f *pixels);
+
     void SetColor(Imath::V4f color);
 
     // Convert between linear color and sRGB in-place.
@@ -47,21 +76,137 @@ public:
     class EXRLayersToWrite
     {
     public:
-        EXRLayersToWrite(shared_ptr<const SimpleImage> image_): image(image_) { }
+        EXRLayersToWrite(shared_ptr<const SimpleImage> image_):
+            image(image_), width(image_->width), height(image_->height) { }
+
+        // Generate rows [startY,endY) of pixels.  This may be called from multiple threads
+        // at once for different rows.
+        typedef function<void(int startY, int endY, Imath::V4f *pixels)> RowSource;
+
+        // Create a layer whose pixels are generated by rowSource a block of rows at a time
+        // as the file is written, so the whole image is never in memory.
+        EXRLayersToWrite(int width_, int height_, const Imf::Header &header_, RowSource rowSource_):
+            width(width_), height(height_), header(header_), rowSource(rowSource_) { }
 
-        // The source image.
+        // The source image, or null if this layer uses a RowSource.
         shared_ptr<const SimpleImage> image; 
 
+        int width, height;
+
+        // The header to use for layers with a RowSource.  Use GetHeader.
+        Imf::Header header;
+        RowSource rowSource;
+
+        const Imf::Header &GetHeader() const { return image? image->header:header; }
+
+        // A block of rows, with each channel in its own plane.  channels[c] points to
+        // (endY-startY)*width values.
+        struct Rows
+        {
+            const float *channels[4];
+        };
+
+        // Storage used by GetRows for rows that aren't read in place.
+        struct RowBuffer
+        {
+            vector<Imath::V4f> pixels;
+            vector<float> planes[4];
+        };
+
+        // Return rows [startY,endY).  Rows of an image are returned in place.  Otherwise,
+        // they're generated and split into planes in buffer in parallel.
+        Rows GetRows(int startY, int endY, RowBuffer &buffer) const;
+
+        // Return true if this layer is completely transparent.  For layers with a RowSource,
+        // this generates rows until it finds a visible pixel.
+        bool IsEmpty() const;
+
         // The layer name to write this as, or blank for no layer.
         string layerName;
 
         // If false, write RGBA.  Otherwise, write only alpha as a luminance channel (Y).
         bool alphaOnly = false;
+
+        // Return the EXR channels this layer is written to.
+        vector<string> GetChannelNames() const;
+
+        // Return the RGBA channel index written to each channel in GetChannelNames.
+        vector<int> GetChannelIndices() const;
+
+        // Add slices for this layer's channels to frameBuffer.  planes[c] points to pixel 0,0
+        // of channel c with the given type, and valueSize is the size of one value.  Only the
+        // channels in GetChannelIndices are used.
+        void AddToFrameBuffer(Imf::FrameBuffer &frameBuffer, Imf::PixelType type, const char *const planes[4], size_t valueSize) const;
+    };
+
+    // The row filter to use for PNG files.  Adaptive lets libpng choose a filter for each row.
+    enum PNGFilter
+    {
+        PNGFilter_None,
+        PNGFilter_Sub,
+        PNGFilter_Up,
+        PNGFilter_Average,
+        PNGFilter_Paeth,
+        PNGFilter_Adaptive,
+    };
+
+    // Settings for writing images.
+    struct WriteOptions
+    {
+        // EXR compression.  PIZ is the default, since it's much faster to write than ZIP.
+        Imf::Compression compression = Imf::PIZ_COMPRESSION;
+
+        // If true, write EXR channels as 16-bit half floats instead of 32-bit floats.
+        bool halfFloat = false;
+
+        // The zlib compression level for PNGs, from 0 to 9.  The default writes
+        // uncompressed data, which is fastest.
+        int pngCompressionLevel = 0;
+        PNGFilter pngFilter = PNGFilter_None;
+
+        // If true, write 16-bit PNGs instead of 8-bit.
+        bool png16Bit = false;
+
+        // If true, hash the output and compare it with the hash stored in a ".hash" sidecar
+        // file next to the output.  If the file on disk is unchanged, don't rewrite it.
+        bool incremental = false;
     };
-    static void WriteImages(string filename, vector<EXRLayersToWrite> layers);
+
+    // Totals for files written by WriteImages and WriteMultiPartImage, so --incremental
+    // can report what it skipped.  These are for the whole process and are never reset, so
+    // take the difference to count a single run.  This is thread-safe.
+    struct WriteStats
+    {
+        int filesWritten = 0, filesSkipped = 0;
+        int64_t bytesWritten = 0, bytesSkipped = 0;
+    };
+    static WriteStats GetWriteStats();
+
+    static void WriteImages(string filename, vector<EXRLayersToWrite> layers, const WriteOptions &options);
+    static void WriteImages(string filename, vector<EXRLayersToWrite> layers) { WriteImages(filename, layers, WriteOptions()); }
+
+    // Write an image to a stream instead of a file.  The format is chosen by the extension
+    // of stream.fileName().  --incremental only applies when writing files.
+    static void WriteImages(Imf::OStream &stream, vector<EXRLayersToWrite> layers, const WriteOptions &options);
+
+    // A part of a multi-part EXR file, containing one or more layers.
+    struct Part
+    {
+        // The part name, which must be unique within the file.
+        string name;
+        vector<EXRLayersToWrite> layers;
+    };
+
+    // Write a multi-part EXR file, with each part containing a list of layers.
+    static void WriteMultiPartImage(string filename, vector<Part> parts, const WriteOptions &options);
+    static void WriteMultiPartImage(Imf::OStream &stream, vector<Part> parts, const WriteOptions &options);
 
     // Return true if this image is completely transparent.
     bool IsEmpty() const;
+
+private:
+    // R, G, B and A planes.  The color planes are empty for masks.
+    vector<float> planes[4];
 };
 
 #endif
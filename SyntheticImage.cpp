@@ -0,0 +1,230 @@
+#include "SyntheticImage.h"
+#include "DeepImage.h"
+#include "helpers.h"
+
+#include <algorithm>
+#include <math.h>
+
+#include <OpenEXR/ImathMatrix.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+#include <OpenEXR/ImfDeepScanLineOutputFile.h>
+#include <OpenEXR/ImfMatrixAttribute.h>
+#include <OpenEXR/ImfPartType.h>
+
+using namespace Imf;
+using namespace Imath;
+
+namespace {
+    // A small, fast generator (splitmix64).  Every pixel seeds its own generator from its
+    // coordinates, so images come out the same no matter how rows are split across threads.
+    class Random
+    {
+    public:
+        Random(uint64_t seed, uint64_t a, uint64_t b, uint64_t c)
+        {
+            state = seed;
+            state = Next() ^ a;
+            state = Next() ^ b;
+            state = Next() ^ c;
+        }
+
+        uint64_t Next()
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        // Return a float in [0,1).
+        float Float() { return (Next() >> 40) / float(1 << 24); }
+
+        // Return an int in [low,high].
+        int Int(int low, int high) { return low + int(Next() % uint64_t(high - low + 1)); }
+
+    private:
+        uint64_t state;
+    };
+
+    // Objects are laid out in square tiles of this many pixels, so masks and strokes have
+    // edges to find, and don't see noise.
+    const int tileSize = 64;
+
+    // The sample layers of each tile have their own object ID and facing direction.
+    struct Surface
+    {
+        int objectId;
+        V3f normal;
+    };
+
+    Surface GetSurface(const SyntheticImage::Config &config, int x, int y, int layer)
+    {
+        Random random(config.seed, x / tileSize, y / tileSize, 0x100000000ull + layer);
+
+        Surface result;
+        result.objectId = random.Int(1, max(config.idCount, 1));
+
+        // Point roughly towards the camera, which looks down +Z.
+        V3f normal(random.Float()*2-1, random.Float()*2-1, -1);
+        result.normal = normal.normalized();
+        return result;
+    }
+
+    // Return the EXR channel names for a channel in the image.
+    vector<string> GetEXRChannelNames(string name, const DeepImageChannel &channel)
+    {
+        if(name == "rgba")
+            return { "R", "G", "B", "A" };
+
+        int count = channel.GetElementCount();
+        if(count == 1)
+            return { name };
+
+        const char *suffixes = count == 3? "XYZ":"RGBA";
+        vector<string> result;
+        for(int i = 0; i < count; ++i)
+            result.push_back(name + "." + suffixes[i]);
+        return result;
+    }
+}
+
+shared_ptr<DeepImage> SyntheticImage::Create(const Config &config)
+{
+    if(config.width < 1 || config.height < 1)
+        throw StringException("Synthetic images must be at least 1x1");
+    if(config.minSamples < 0 || config.maxSamples < config.minSamples)
+        throw StringException("Invalid synthetic sample count range");
+
+    auto image = make_shared<DeepImage>(config.width, config.height);
+    image->header = Header(config.width, config.height);
+
+    // Choose sample counts first, since channels allocate their storage up front.
+    ParallelFor(config.height, [&](int startY, int endY) {
+        for(int y = startY; y < endY; y++)
+        {
+            for(int x = 0; x < config.width; x++)
+            {
+                Random random(config.seed, x, y, 0);
+                bool empty = random.Float() < config.emptyFraction;
+                image->sampleCount[y][x] = empty? 0:random.Int(config.minSamples, config.maxSamples);
+            }
+        }
+    });
+
+    auto rgba = image->AddChannel<V4f>("rgba");
+    auto Z = image->AddChannel<float>("Z");
+    auto ZBack = image->AddChannel<float>("ZBack");
+    auto id = image->AddChannel<uint32_t>("id");
+    auto P = config.positions? image->AddChannel<V3f>("P"):nullptr;
+    auto N = config.normals? image->AddChannel<V3f>("N"):nullptr;
+
+    ParallelFor(config.height, [&](int startY, int endY) {
+        vector<int> order;
+        for(int y = startY; y < endY; y++)
+        {
+            for(int x = 0; x < config.width; x++)
+            {
+                int count = image->NumSamples(x, y);
+                Random random(config.seed, x, y, 1);
+
+                // Store the layers of this pixel in a random order, since renderers don't
+                // output samples sorted.
+                order.resize(count);
+                for(int s = 0; s < count; ++s)
+                    order[s] = s;
+                for(int s = count-1; s > 0; --s)
+                    swap(order[s], order[random.Int(0, s)]);
+
+                // Screen position in NDC, for P.
+                float ndcX = (x + 0.5f) / config.width * 2 - 1;
+                float ndcY = 1 - (y + 0.5f) / config.height * 2;
+
+                for(int s = 0; s < count; ++s)
+                {
+                    int layer = order[s];
+                    Surface surface = GetSurface(config, x, y, layer);
+
+                    // Layers are spaced out in depth, so they don't overlap unless they're volumes.
+                    float depth = 10 + layer*5 + random.Float();
+                    float alpha = 0.25f + random.Float()*0.75f;
+                    V4f color(random.Float(), random.Float(), random.Float(), 1);
+
+                    rgba->Get(x,y,s) = color * alpha;
+                    Z->Get(x,y,s) = depth;
+                    ZBack->Get(x,y,s) = depth;
+                    if(random.Float() < config.volumeFraction)
+                        ZBack->Get(x,y,s) += 1 + random.Float()*3;
+                    id->Get(x,y,s) = surface.objectId;
+
+                    if(P)
+                        P->Get(x,y,s) = V3f(ndcX * depth, ndcY * depth, depth);
+                    if(N)
+                        N->Get(x,y,s) = surface.normal;
+                }
+            }
+        }
+    });
+
+    // Add the channels to the header, as if the image had been read from a file.
+    for(auto it: image->channels)
+    {
+        for(string name: GetEXRChannelNames(it.first, *it.second))
+            image->header.channels().insert(name, Channel(it.second->GetPixelType()));
+    }
+
+    // The camera is at the origin looking down +Z, and worldToNDC is a perspective projection
+    // with a 90 degree field of view.
+    image->header.insert("worldToCamera", M44fAttribute(M44f()));
+    image->header.insert("worldToNDC", M44fAttribute(M44f(
+        1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 1,
+        0, 0, 0, 0)));
+
+    return image;
+}
+
+void SyntheticImage::Write(shared_ptr<const DeepImage> image, string filename, Compression compression)
+{
+    // Use the image's channels, not the header's channel list, in case channels have been
+    // added or removed since it was created.
+    Header header = image->header;
+    header.channels() = ChannelList();
+    header.compression() = compression;
+    header.setType(DEEPSCANLINE);
+
+    DeepFrameBuffer frameBuffer;
+    frameBuffer.insertSampleCountSlice(Slice(UINT, (char *) &image->sampleCount[0][0],
+        sizeof(unsigned int), sizeof(unsigned int) * image->width));
+
+    // DeepSlice can't take an offset into each sample, so vector components after the first
+    // need their own arrays of pointers, like TypedDeepImageChannel::AddToFramebuffer.
+    vector<shared_ptr<Array2D<const char *>>> componentPointers;
+    for(auto it: image->channels)
+    {
+        const DeepImageChannel &channel = *it.second;
+        vector<string> names = GetEXRChannelNames(it.first, channel);
+        for(int c = 0; c < (int) names.size(); ++c)
+        {
+            const char * const*pointers = channel.GetSamplesBlind();
+            if(c > 0)
+            {
+                auto component = make_shared<Array2D<const char *>>(image->height, image->width);
+                const char **out = &(*component)[0][0];
+                for(int i = 0; i < image->width * image->height; ++i)
+                    out[i] = pointers[i] + c * channel.GetBytesPerElement();
+                componentPointers.push_back(component);
+                pointers = out;
+            }
+
+            header.channels().insert(names[c], Channel(channel.GetPixelType()));
+            frameBuffer.insert(names[c], DeepSlice(channel.GetPixelType(), (char *) pointers,
+                sizeof(char *), sizeof(char *) * image->width, channel.GetBytesPerSample()));
+        }
+    }
+
+    DeepScanLineOutputFile file(filename.c_str(), header);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(image->height);
+}
@@ -0,0 +1,51 @@
+#ifndef SyntheticImage_h
+#define SyntheticImage_h
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+using namespace std;
+
+#include <OpenEXR/ImfCompression.h>
+
+class DeepImage;
+
+// Generate synthetic deep images, for benchmarking without renders.  The same config
+// always generates the same image.
+namespace SyntheticImage
+{
+    struct Config
+    {
+        int width = 1920, height = 1080;
+
+        // The number of samples in each pixel is chosen uniformly from [minSamples,maxSamples].
+        int minSamples = 1, maxSamples = 8;
+
+        // The fraction of pixels with no samples at all.
+        float emptyFraction = 0.1f;
+
+        // Samples are given object IDs from 1 to idCount.
+        int idCount = 4;
+
+        // The fraction of samples that are volumes, with ZBack behind Z.  Other samples have
+        // ZBack equal to Z.
+        float volumeFraction = 0;
+
+        // Whether to add P (world space position) and N (world space normal) channels.
+        bool positions = true;
+        bool normals = true;
+
+        uint64_t seed = 1;
+    };
+
+    // Create an image with rgba, Z, ZBack and id channels, and P and N if enabled.  Samples
+    // are in random depth order, like a render that hasn't been sorted.  The header has
+    // worldToCamera and worldToNDC matrices, so operations that need a camera work.
+    shared_ptr<DeepImage> Create(const Config &config);
+
+    // Write an image from Create to a deep scanline EXR.
+    void Write(shared_ptr<const DeepImage> image, string filename, Imf::Compression compression = Imf::ZIPS_COMPRESSION);
+}
+
+#endif
@@ -0,0 +1,411 @@
+// Benchmark the core routines of libexrflatten on synthetic deep images.
+//
+// Each benchmark prints one line of JSON, so results can be collected and compared between
+// builds:
+//
+// {"name":"SortSamplesByDepth","iterations":5,"seconds":0.121,"bestSeconds":0.118,
+//  "samples":9331200,"bytes":335923200,"samplesPerSecond":79078000,"MBPerSecond":2714.9}
+//
+// "samples" is the number of deep samples each iteration processes, or pixels for
+// routines that work on flat images.  "bytes" is the size of the data it reads.  Rates use
+// the fastest iteration.  Only the routine itself is timed, not copying its inputs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "DeepImage.h"
+#include "DeepImageUtil.h"
+#include "EuclideanDistance.h"
+#include "EXRFlatten.h"
+#include "EXROperation_Stroke.h"
+#include "JSON.h"
+#include "OutputSink.h"
+#include "SimpleImage.h"
+#include "SyntheticImage.h"
+#include "helpers.h"
+
+using namespace std;
+using namespace Imf;
+using namespace Imath;
+
+namespace {
+    struct BenchmarkConfig
+    {
+        SyntheticImage::Config image;
+        int iterations = 5;
+
+        // Where to write the temporary file for DeepImageReader.
+        string outputPath = ".";
+
+        // Benchmarks to run.  If empty, run all of them.
+        vector<string> only;
+
+        // Also time EuclideanDistance::Calculate on a 16K x 8K mask, which needs a few GB
+        // of memory.
+        bool largeMask = false;
+    };
+
+    int64_t CountSamples(shared_ptr<const DeepImage> image)
+    {
+        int64_t result = 0;
+        for(int y = 0; y < image->height; y++)
+            for(int x = 0; x < image->width; x++)
+                result += image->NumSamples(x, y);
+        return result;
+    }
+
+    int64_t GetImageBytes(shared_ptr<const DeepImage> image)
+    {
+        int64_t result = 0;
+        for(auto it: image->channels)
+            result += it.second->GetMemoryUsage();
+        return result;
+    }
+
+    // Return a width x height mask of scattered antialiased discs, with 1 inside them.
+    void CreateDiscMask(int width, int height, Array2D<float> &mask)
+    {
+        mask.resizeErase(height, width);
+        for(int y = 0; y < height; ++y)
+            for(int x = 0; x < width; ++x)
+                mask[y][x] = 0;
+
+        mt19937 random(0);
+        for(int disc = 0; disc < 64; ++disc)
+        {
+            float cx = float(random() % width), cy = float(random() % height);
+            float radius = float(16 + random() % 512);
+            for(int y = max(0, int(cy-radius-1)); y < min(height, int(cy+radius+2)); ++y)
+            {
+                for(int x = max(0, int(cx-radius-1)); x < min(width, int(cx+radius+2)); ++x)
+                {
+                    float d = sqrtf((x-cx)*(x-cx) + (y-cy)*(y-cy));
+                    mask[y][x] = max(mask[y][x], min(max(radius - d, 0.0f), 1.0f));
+                }
+            }
+        }
+    }
+
+    // Return true if the benchmark name was selected with --only.  Benchmarks with variants
+    // are named like "SimpleImage::WriteImages/zip/half", and can be selected by any prefix
+    // that ends at a /.
+    bool ShouldRun(const BenchmarkConfig &config, string name)
+    {
+        if(config.only.empty())
+            return true;
+
+        for(string only: config.only)
+        {
+            if(name == only || name.compare(0, only.size() + 1, only + "/") == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Run func iterations times and print its timing.  setup is called before each iteration
+    // to prepare its inputs, and isn't timed.
+    void Benchmark(const BenchmarkConfig &config, string name, int64_t samples, int64_t bytes,
+        function<void()> setup, function<void()> func)
+    {
+        if(!ShouldRun(config, name))
+            return;
+
+        double totalSeconds = 0, bestSeconds = 0;
+        for(int i = 0; i < config.iterations; ++i)
+        {
+            if(setup)
+                setup();
+
+            auto startTime = chrono::steady_clock::now();
+            func();
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - startTime;
+
+            totalSeconds += elapsed.count();
+            if(i == 0 || elapsed.count() < bestSeconds)
+                bestSeconds = elapsed.count();
+        }
+
+        JSONValue result = JSONValue::Object();
+        result.Set("name", name);
+        result.Set("iterations", config.iterations);
+        result.Set("seconds", totalSeconds / config.iterations);
+        result.Set("bestSeconds", bestSeconds);
+        result.Set("samples", double(samples));
+        result.Set("bytes", double(bytes));
+        result.Set("samplesPerSecond", bestSeconds > 0? samples / bestSeconds:0.0);
+        result.Set("MBPerSecond", bestSeconds > 0? bytes / bestSeconds / (1024*1024):0.0);
+        printf("%s\n", result.ToString().c_str());
+        fflush(stdout);
+    }
+
+    void RunBenchmarks(const BenchmarkConfig &config)
+    {
+        shared_ptr<const DeepImage> image = SyntheticImage::Create(config.image);
+        int64_t samples = CountSamples(image);
+        int64_t bytes = GetImageBytes(image);
+        int width = image->width, height = image->height;
+        int64_t pixels = int64_t(width) * height;
+
+        // Most operations run on sorted images, like they do in exrflatten.
+        shared_ptr<DeepImage> sorted = image->Clone();
+        DeepImageUtil::SortSamplesByDepth(sorted);
+
+        SharedConfig sharedConfig;
+        auto id = sorted->GetChannel<uint32_t>("id");
+        auto rgba = sorted->GetChannel<V4f>("rgba");
+
+        // Read the image back from a file.
+        if(ShouldRun(config, "DeepImageReader"))
+        {
+            string filename = config.outputPath + "/exrbench-temp.exr";
+            SyntheticImage::Write(image, filename);
+            int64_t fileSize = GetFileSize(filename);
+
+            Benchmark(config, "DeepImageReader", samples, fileSize, nullptr, [&] {
+                DeepImageReader reader;
+                shared_ptr<DeepImage> loaded = reader.Open(filename);
+                DeepFrameBuffer frameBuffer;
+                loaded->AddSampleCountSliceToFramebuffer(frameBuffer);
+                loaded->AddChannelToFramebuffer<V4f>("rgba", frameBuffer);
+                loaded->AddChannelToFramebuffer<float>("Z", frameBuffer);
+                loaded->AddChannelToFramebuffer<float>("ZBack", frameBuffer);
+                loaded->AddChannelToFramebuffer<uint32_t>("id", frameBuffer);
+                if(config.image.positions)
+                    loaded->AddChannelToFramebuffer<V3f>("P", frameBuffer);
+                if(config.image.normals)
+                    loaded->AddChannelToFramebuffer<V3f>("N", frameBuffer);
+                reader.Read(frameBuffer);
+            });
+
+            remove(filename.c_str());
+        }
+
+        shared_ptr<DeepImage> copy;
+        Benchmark(config, "SortSamplesByDepth", samples, bytes,
+            [&] { copy = image->Clone(); },
+            [&] { DeepImageUtil::SortSamplesByDepth(copy); });
+
+        vector<shared_ptr<DeepImage>> inputs;
+        Benchmark(config, "CombineImages", samples*2, bytes*2,
+            [&] { inputs = { image->Clone(), image->Clone() }; },
+            [&] { DeepImageUtil::CombineImages(inputs); });
+        inputs.clear();
+        copy.reset();
+
+        // Reverse the order of object IDs.
+        map<int,int> layerOrder;
+        for(int i = 1; i <= config.image.idCount; ++i)
+            layerOrder[i] = config.image.idCount - i;
+        Benchmark(config, "OrderSamplesByLayer", samples, bytes, nullptr, [&] {
+            DeepImageUtil::OrderSamplesByLayer(sorted, id, layerOrder, {});
+        });
+
+        shared_ptr<SimpleImage> flat;
+        Benchmark(config, "CollapseEXR", samples, bytes, nullptr, [&] {
+            flat = DeepImageUtil::CollapseEXR(sorted, id, rgba, nullptr, { 1 });
+        });
+
+        // A mask channel to extract, using each sample's alpha.
+        auto mask = sorted->AddChannel<float>("mask");
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++)
+                for(int s = 0; s < sorted->NumSamples(x, y); ++s)
+                    mask->Get(x,y,s) = rgba->Get(x,y,s)[3];
+
+        auto alpha = sorted->GetAlphaChannel();
+        Benchmark(config, "ExtractMask", samples, bytes, nullptr, [&] {
+            auto layer = make_shared<SimpleImage>(width, height);
+            DeepImageUtil::ExtractMask(false, true, mask, alpha, id, 1, layer);
+        });
+
+        // Find the distance to the nearest pixel of object 1.
+        if(ShouldRun(config, "EuclideanDistance::Calculate"))
+        {
+            Array2D<float> distanceMask(height, width);
+            for(int y = 0; y < height; y++)
+            {
+                for(int x = 0; x < width; x++)
+                {
+                    int count = sorted->NumSamples(x, y);
+                    bool inside = count > 0 && id->Get(x, y, count-1) == 1;
+                    distanceMask[y][x] = inside? 0.0f:1.0f;
+                }
+            }
+
+            Array2D<EuclideanDistance::DistanceResult> distances;
+            Benchmark(config, "EuclideanDistance::Calculate", pixels, pixels * sizeof(float), nullptr, [&] {
+                EuclideanDistance::Calculate(width, height, distanceMask, distances);
+            });
+        }
+
+        if(config.largeMask && ShouldRun(config, "EuclideanDistance::Calculate/large-mask"))
+        {
+            const int maskWidth = 16384, maskHeight = 8192;
+            const int64_t maskPixels = int64_t(maskWidth) * maskHeight;
+            Array2D<float> distanceMask;
+            CreateDiscMask(maskWidth, maskHeight, distanceMask);
+
+            Array2D<EuclideanDistance::DistanceResult> distances;
+            Benchmark(config, "EuclideanDistance::Calculate/large-mask", maskPixels, maskPixels * sizeof(float), nullptr, [&] {
+                EuclideanDistance::Calculate(maskWidth, maskHeight, distanceMask, distances);
+            });
+        }
+
+        if(ShouldRun(config, "CreateIntersectionPattern") && (config.image.positions || config.image.normals))
+        {
+            DeepImageStroke::Config strokeConfig;
+            strokeConfig.objectIds = { 1 };
+            strokeConfig.strokeIntersections = true;
+            strokeConfig.intersectionsUseDistance = config.image.positions;
+            strokeConfig.intersectionsUseNormals = config.image.normals;
+
+            Array2D<vector<float>> visibilities;
+            DeepImageUtil::GetSampleVisibilities(sorted, visibilities);
+            Benchmark(config, "CreateIntersectionPattern", samples, bytes, nullptr, [&] {
+                DeepImageStroke::CreateIntersectionPattern(strokeConfig, sharedConfig, sorted, visibilities, nullptr, nullptr);
+            });
+        }
+
+        // Encode the flattened image to memory, so disk speed isn't measured.  Write it with
+        // an alpha-only mask layer, like --save-layers output, with each compression type as
+        // both float and half, and as a PNG.
+        if(ShouldRun(config, "SimpleImage::WriteImages"))
+        {
+            if(flat == nullptr)
+                flat = DeepImageUtil::CollapseEXR(sorted, id, rgba, nullptr, { 1 });
+
+            vector<SimpleImage::EXRLayersToWrite> layers = { SimpleImage::EXRLayersToWrite(flat), SimpleImage::EXRLayersToWrite(flat) };
+            layers[1].layerName = "mask";
+            layers[1].alphaOnly = true;
+
+            vector<pair<string, Compression>> compressionTypes = {
+                { "none", NO_COMPRESSION }, { "rle", RLE_COMPRESSION }, { "zips", ZIPS_COMPRESSION },
+                { "zip", ZIP_COMPRESSION }, { "piz", PIZ_COMPRESSION }, { "dwaa", DWAA_COMPRESSION },
+                { "dwab", DWAB_COMPRESSION },
+            };
+
+            for(auto compression: compressionTypes)
+            {
+                for(bool halfFloat: { false, true })
+                {
+                    SimpleImage::WriteOptions options = sharedConfig.writeOptions;
+                    options.compression = compression.second;
+                    options.halfFloat = halfFloat;
+
+                    string name = "SimpleImage::WriteImages/" + compression.first + (halfFloat? "/half":"/float");
+                    Benchmark(config, name, pixels, pixels * 5 * sizeof(float), nullptr, [&] {
+                        MemoryOStream stream("exrbench.exr");
+                        SimpleImage::WriteImages(stream, layers, options);
+                    });
+                }
+            }
+
+            // PNGs only hold one layer, so just write the color layer, with a few settings
+            // from fastest to smallest.
+            struct PNGTest
+            {
+                string name;
+                int level;
+                SimpleImage::PNGFilter filter;
+            };
+            vector<PNGTest> pngTests = {
+                { "level0", 0, SimpleImage::PNGFilter_None },
+                { "level1", 1, SimpleImage::PNGFilter_None },
+                { "level1-up", 1, SimpleImage::PNGFilter_Up },
+                { "level1-paeth", 1, SimpleImage::PNGFilter_Paeth },
+                { "level6-adaptive", 6, SimpleImage::PNGFilter_Adaptive },
+            };
+
+            for(const PNGTest &test: pngTests)
+            {
+                for(bool sixteenBit: { false, true })
+                {
+                    SimpleImage::WriteOptions options = sharedConfig.writeOptions;
+                    options.pngCompressionLevel = test.level;
+                    options.pngFilter = test.filter;
+                    options.png16Bit = sixteenBit;
+
+                    string name = "SimpleImage::WriteImages/png/" + test.name + (sixteenBit? "/16bit":"/8bit");
+                    Benchmark(config, name, pixels, pixels * 4 * sizeof(float), nullptr, [&] {
+                        MemoryOStream stream("exrbench.png");
+                        SimpleImage::WriteImages(stream, { layers[0] }, options);
+                    });
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    try {
+        BenchmarkConfig config;
+        string generateFilename;
+        for(auto it: EXRFlatten::ParseArgs(vector<string>(argv + 1, argv + argc)))
+        {
+            string opt = it.first, value = it.second;
+            if(opt == "width")
+                config.image.width = atoi(value.c_str());
+            else if(opt == "height")
+                config.image.height = atoi(value.c_str());
+            else if(opt == "min-samples")
+                config.image.minSamples = atoi(value.c_str());
+            else if(opt == "max-samples")
+                config.image.maxSamples = atoi(value.c_str());
+            else if(opt == "empty")
+                config.image.emptyFraction = (float) atof(value.c_str());
+            else if(opt == "ids")
+                config.image.idCount = atoi(value.c_str());
+            else if(opt == "volume")
+                config.image.volumeFraction = (float) atof(value.c_str());
+            else if(opt == "no-p")
+                config.image.positions = false;
+            else if(opt == "no-n")
+                config.image.normals = false;
+            else if(opt == "seed")
+                config.image.seed = strtoull(value.c_str(), nullptr, 10);
+            else if(opt == "iterations")
+                config.iterations = max(atoi(value.c_str()), 1);
+            else if(opt == "threads")
+                SetThreadCount(atoi(value.c_str()));
+            else if(opt == "output")
+                config.outputPath = value;
+            else if(opt == "only")
+                config.only.push_back(value);
+            else if(opt == "large-mask")
+                config.largeMask = true;
+            else if(opt == "generate")
+                generateFilename = value;
+            else
+                throw StringException("Unknown option: --" + opt);
+        }
+
+        // Write EXRs with the same thread count as everything else.
+        EXRFlatten::SetupThreads();
+
+        // With --generate, just write the image, so it can be used with exrflatten.
+        if(!generateFilename.empty())
+        {
+            SyntheticImage::Write(SyntheticImage::Create(config.image), generateFilename);
+            return 0;
+        }
+
+        RunBenchmarks(config);
+    }
+    catch(const exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
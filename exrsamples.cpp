@@ -2,8 +2,10 @@
 
 #include <limits.h>
 #include <assert.h>
+#include <math.h>
 
 #include <algorithm>
+#include <limits>
 using namespace std;
 
 // http://www.openexr.com/TechnicalIntroduction.pdf:
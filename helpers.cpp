@@ -1,9 +1,24 @@
 #include "helpers.h"
 #include <stdarg.h>
+#include <math.h>
 
 #include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <fstream>
+#include <cstring>
 using namespace std;
 
+#if defined(HAVE_X86_SIMD)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
 void make_swaps(vector<int> order, vector<pair<int,int>> &swaps)
 {
     // order[0] is the index in the old list of the new list's first value.
@@ -164,11 +179,54 @@ string setExtension(string path, const string &ext)
     return path + ext;
 }
 
-float LinearToSRGB(float value)
+int64_t GetFileSize(const string &path)
+{
+    ifstream file(path, ios::binary | ios::ate);
+    if(!file)
+        return -1;
+    return (int64_t) file.tellg();
+}
+
+// This is MurmurHash64A, chained through the seed.
+uint64_t HashBytes(const void *data, size_t size, uint64_t hash)
 {
-    static vector<float> table;
-    if(table.empty())
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    hash ^= size * m;
+
+    const uint8_t *p = (const uint8_t *) data;
+    for(; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        hash ^= k;
+        hash *= m;
+    }
+
+    if(size > 0)
     {
+        uint64_t k = 0;
+        memcpy(&k, p, size);
+        hash ^= k;
+        hash *= m;
+    }
+
+    hash ^= hash >> r;
+    hash *= m;
+    hash ^= hash >> r;
+    return hash;
+}
+
+const vector<float> &GetLinearToSRGBTable()
+{
+    // This is initialized on first use.  Static initialization is thread-safe, so this can
+    // be called by images being written in parallel.
+    static const vector<float> table = [] {
         vector<float> new_table;
         new_table.resize(65536);
         for(int i = 0; i < new_table.size(); i++)
@@ -181,8 +239,15 @@ float LinearToSRGB(float value)
                 output = 1.055f*powf(value, 1/2.4f) - 0.055f;
             new_table[i] = output;
         }
-        table = new_table;
-    }
+        return new_table;
+    }();
+
+    return table;
+}
+
+float LinearToSRGB(float value)
+{
+    const vector<float> &table = GetLinearToSRGBTable();
 
     if(value < 0) return 0;
     if(value > 1) return 1;
@@ -192,9 +257,7 @@ float LinearToSRGB(float value)
 
 float SRGBToLinear(float value)
 {
-    static vector<float> table;
-    if(table.empty())
-    {
+    static const vector<float> table = [] {
         vector<float> new_table;
         new_table.resize(65536);
 
@@ -209,11 +272,182 @@ float SRGBToLinear(float value)
             new_table[i] = output;
         }
 
-        table = new_table;
-    }
+        return new_table;
+    }();
 
     if(value < 0) return 0;
     if(value > 1) return 1;
     int idx = int(value * 65535);
     return table[idx];
-}
\ No newline at end of file
+}
+
+namespace {
+    CPUFeatures DetectCPUFeatures()
+    {
+        CPUFeatures result;
+#if defined(HAVE_X86_SIMD)
+        unsigned int ecx = 0;
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        ecx = info[2];
+#else
+        unsigned int eax, ebx, edx;
+        if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return result;
+#endif
+        result.sse41 = (ecx & (1 << 19)) != 0;
+
+        // AVX also needs the OS to save YMM registers, which is indicated by OSXSAVE
+        // and XCR0.  F16C uses YMM registers, so it has the same requirement.
+        bool osSavesYMM = false;
+        if(ecx & (1 << 27))
+        {
+#if defined(_MSC_VER)
+            unsigned long long xcr0 = _xgetbv(0);
+#else
+            unsigned int xcr0Low, xcr0High;
+            __asm__("xgetbv" : "=a" (xcr0Low), "=d" (xcr0High) : "c" (0));
+            unsigned long long xcr0 = xcr0Low;
+#endif
+            osSavesYMM = (xcr0 & 6) == 6;
+        }
+        result.avx = osSavesYMM && (ecx & (1 << 28)) != 0;
+        result.f16c = result.avx && (ecx & (1 << 29)) != 0;
+#endif
+        return result;
+    }
+
+    bool simdDisabled = false;
+}
+
+const CPUFeatures &GetCPUFeatures()
+{
+    static const CPUFeatures features = DetectCPUFeatures();
+    static const CPUFeatures none;
+    return simdDisabled? none:features;
+}
+
+void DisableSIMD()
+{
+    simdDisabled = true;
+}
+
+namespace {
+    int threadCount = 0;
+
+    // This is set while running ParallelFor tasks, so nested calls don't start more threads.
+    thread_local bool inParallelFor = false;
+
+    // The number of threads taken with AcquireThreads.  This counts threads in use rather
+    // than threads available, so it stays right if SetThreadCount is called.
+    mutex threadBudgetLock;
+    int threadsInUse = 0;
+}
+
+int AcquireThreads(int count)
+{
+    lock_guard<mutex> lock(threadBudgetLock);
+    int available = max(0, GetThreadCount() - 1 - threadsInUse);
+    count = max(0, min(count, available));
+    threadsInUse += count;
+    return count;
+}
+
+void ReleaseThreads(int count)
+{
+    lock_guard<mutex> lock(threadBudgetLock);
+    threadsInUse -= count;
+}
+
+void SetThreadCount(int count)
+{
+    threadCount = count;
+}
+
+int GetThreadCount()
+{
+    if(threadCount > 0)
+        return threadCount;
+
+    // hardware_concurrency can return 0 if it doesn't know.
+    return max((int) thread::hardware_concurrency(), 1);
+}
+
+void ParallelFor(int count, function<void(int begin, int end)> func, int blockSize, int threads)
+{
+    if(count <= 0)
+        return;
+
+    bool useBudget = threads <= 0;
+    if(threads <= 0)
+        threads = GetThreadCount();
+    if(threads <= 1 || inParallelFor)
+    {
+        func(0, count);
+        return;
+    }
+
+    // Use several blocks per thread by default, so one slow block doesn't leave the
+    // other threads idle.
+    if(blockSize <= 0)
+        blockSize = max(1, count / (threads * 8));
+    int blocks = (count + blockSize - 1) / blockSize;
+    threads = min(threads, blocks);
+
+    // Take the threads other than this one from the shared budget.  If other work is using
+    // all of them, just run on this thread.
+    int acquired = 0;
+    if(useBudget)
+    {
+        acquired = AcquireThreads(threads - 1);
+        threads = acquired + 1;
+        if(threads <= 1)
+        {
+            func(0, count);
+            return;
+        }
+    }
+
+    atomic<int> nextBlock(0);
+    mutex errorLock;
+    exception_ptr error;
+
+    auto worker = [&]() {
+        inParallelFor = true;
+        while(1)
+        {
+            int block = nextBlock++;
+            if(block >= blocks)
+                break;
+
+            int begin = block * blockSize;
+            int end = min(begin + blockSize, count);
+            try {
+                func(begin, end);
+            } catch(...) {
+                // Stop handing out blocks, and rethrow the first exception once all threads
+                // have stopped.
+                lock_guard<mutex> lock(errorLock);
+                if(!error)
+                    error = current_exception();
+                nextBlock = blocks;
+                break;
+            }
+        }
+        inParallelFor = false;
+    };
+
+    // The calling thread does its share of the work too.
+    vector<thread> workers;
+    for(int i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+
+    for(auto &t: workers)
+        t.join();
+    ReleaseThreads(acquired);
+
+    if(error)
+        rethrow_exception(error);
+}
@@ -6,6 +6,7 @@
 #include <map>
 #include <unordered_map>
 #include <algorithm>
+#include <functional>
 using namespace std;
 
 template<typename K, typename V, typename def>
@@ -48,9 +49,20 @@ string basename(const string &dir);
 string getExtension(string path);
 string setExtension(string path, const string &ext);
 void split(const string &source, const string &delimitor, vector<string> &result, const bool ignoreEmpty=true);
+
+// Return the size of a file in bytes, or -1 if it can't be opened.
+int64_t GetFileSize(const string &path);
+
+// A fast 64-bit hash.  This isn't cryptographic, and is only used to tell if data has
+// changed.  Data can be hashed in pieces by passing the previous result as hash.
+uint64_t HashBytes(const void *data, size_t size, uint64_t hash=0);
 float LinearToSRGB(float value);
 float SRGBToLinear(float value);
 
+// The lookup table used by LinearToSRGB.  Linear values from 0 to 1 are looked up at
+// int(value * 65535).
+const vector<float> &GetLinearToSRGBTable();
+
 // Convert a 0-1 float to a 0-255 int.  The value must already be clamped.
 inline uint8_t FloatToInt(float f)
 {
@@ -59,6 +71,61 @@ inline uint8_t FloatToInt(float f)
     return (uint8_t) u.i;
 }
 
+// SIMD instruction sets that are available at runtime.  Code with SIMD paths checks
+// these to decide whether to use them, and falls back on scalar code if not.
+struct CPUFeatures
+{
+    bool sse41 = false;
+    bool avx = false;
+    bool f16c = false;
+};
+const CPUFeatures &GetCPUFeatures();
+
+// Disable all SIMD code paths, so GetCPUFeatures reports nothing available.  This is
+// useful for checking SIMD results against the scalar code.
+void DisableSIMD();
+
+// Functions using SSE4.1 or F16C intrinsics must be marked with these.  MSVC allows intrinsics
+// anywhere, but GCC and Clang only allow them in functions targetting that instruction set.
+#if defined(__GNUC__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_F16C __attribute__((target("f16c")))
+#else
+#define TARGET_SSE41
+#define TARGET_F16C
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#endif
+
+// Set the number of threads used by ParallelFor.  If this is 0 (the default), one thread
+// is used per CPU core.
+void SetThreadCount(int count);
+int GetThreadCount();
+
+// Threads other than the main one share a budget of GetThreadCount()-1.  AcquireThreads
+// takes up to count threads from it without waiting, and returns how many it got, which
+// must be returned with ReleaseThreads.  This keeps work running at the same time, like
+// operations run on their own threads, from using more than GetThreadCount() threads
+// between them.
+int AcquireThreads(int count);
+void ReleaseThreads(int count);
+
+// Call func(begin, end) for blocks covering [0,count) on up to GetThreadCount() threads,
+// returning when all blocks are finished.  Blocks may run in any order, so func must only
+// write data belonging to its own range.  If blockSize is 0, a size is chosen automatically.
+//
+// The calling thread runs blocks too, and the other threads are taken from AcquireThreads,
+// so if other work is already using threads, fewer are used.
+//
+// If func throws, remaining blocks are skipped and the first exception is rethrown.  Calls
+// to ParallelFor from inside func run on the calling thread.
+//
+// If threads is nonzero, exactly that many threads are used instead, without using the
+// shared budget.
+void ParallelFor(int count, function<void(int begin, int end)> func, int blockSize=0, int threads=0);
+
 template<typename T>
 T clamp(T value, T low, T high)
 {
@@ -89,7 +156,7 @@ public:
 	value = s;
     }
 
-    const char *what() const { return value.c_str(); }
+    const char *what() const noexcept { return value.c_str(); }
 private:
     string value;
 };